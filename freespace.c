@@ -0,0 +1,233 @@
+/**
+ * @file freespace.c
+ * @brief imgStore library: in-memory map of the free extents of the file.
+ *
+ * The extents are kept in an array sorted by offset: merging a released
+ * extent with its neighbours is a binary search, and the best fit is a
+ * scan of the (few) holes, which costs much less than the image it makes
+ * room for.
+ */
+
+#include "imgStore.h"
+#include "freespace.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// ======================================================================
+/**
+ * @brief Compares two extents by offset (for qsort).
+ */
+static int compare_extent(const void* a, const void* b)
+{
+    const uint64_t x = ((const struct free_extent*) a)->offset;
+    const uint64_t y = ((const struct free_extent*) b)->offset;
+    return (x > y) - (x < y);
+}
+
+// ======================================================================
+/**
+ * @brief Inserts an extent at position 'pos' of the array.
+ */
+static int insert_extent(struct imgst_freespace* map, size_t pos, uint64_t offset, uint64_t size)
+{
+    if (map->nb_extents == map->capacity) {
+        const size_t capacity = map->capacity > 0 ? 2 * map->capacity : 16;
+        struct free_extent* extents = realloc(map->extents, capacity * sizeof(struct free_extent));
+        if (extents == NULL) return ERR_OUT_OF_MEMORY;
+        map->extents = extents;
+        map->capacity = capacity;
+    }
+
+    memmove(&map->extents[pos + 1], &map->extents[pos], (map->nb_extents - pos) * sizeof(struct free_extent));
+    map->extents[pos].offset = offset;
+    map->extents[pos].size = size;
+    ++map->nb_extents;
+    return ERR_NONE;
+}
+
+// ======================================================================
+/**
+ * @brief Collects the used extents of the file: the header, the metadata
+ *        and the stored images, sorted by offset.
+ */
+static int collect_used(const struct imgst_file* imgst_file, struct free_extent** used, size_t* nb_used)
+{
+    size_t capacity = (size_t) imgst_file->header.num_files * NB_RES + 2;
+    *used = calloc(capacity, sizeof(struct free_extent));
+    if (*used == NULL) return ERR_OUT_OF_MEMORY;
+
+    (*used)[0] = (struct free_extent) { 0, sizeof(struct imgst_header) };
+    (*used)[1] = (struct free_extent) {
+        get_metadata_offset(&imgst_file->header),
+        (uint64_t) imgst_file->header.max_files * sizeof(struct img_metadata)
+    };
+    *nb_used = 2;
+
+    for (size_t i = 0; i < imgst_file->header.max_files; ++i) {
+        const struct img_metadata* metadata = &imgst_file->metadata[i];
+        if (metadata->is_valid != NON_EMPTY) continue;
+
+        for (int res = 0; res < NB_RES; ++res) {
+            if (metadata->offset[res] == 0) continue;
+            if (*nb_used == capacity) { // num_files is not trusted
+                struct free_extent* more = realloc(*used, 2 * capacity * sizeof(struct free_extent));
+                if (more == NULL) return ERR_OUT_OF_MEMORY;
+                *used = more;
+                capacity *= 2;
+            }
+            (*used)[(*nb_used)++] = (struct free_extent) { metadata->offset[res], metadata->size[res] };
+        }
+    }
+
+    qsort(*used, *nb_used, sizeof(struct free_extent), compare_extent);
+    return ERR_NONE;
+}
+
+// See freespace.h
+int freespace_build(struct imgst_file* imgst_file)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->metadata);
+    if (imgst_file->freespace != NULL) return ERR_NONE;
+
+    struct imgst_freespace* map = calloc(1, sizeof(struct imgst_freespace));
+    if (map == NULL) return ERR_OUT_OF_MEMORY;
+
+    struct free_extent* used = NULL;
+    size_t nb_used = 0;
+    int ret = collect_used(imgst_file, &used, &nb_used);
+
+    // The holes between the used extents (the end of the file is not a hole: it is appended to)
+    uint64_t end = 0;
+    for (size_t u = 0; ret == ERR_NONE && u < nb_used; ++u) {
+        if (used[u].offset > end) ret = insert_extent(map, map->nb_extents, end, used[u].offset - end);
+        if (used[u].offset + used[u].size > end) end = used[u].offset + used[u].size;
+    }
+    free(used);
+
+    if (ret != ERR_NONE) {
+        free(map->extents);
+        free(map);
+        return ret;
+    }
+    imgst_file->freespace = map;
+    return ERR_NONE;
+}
+
+// See freespace.h
+void freespace_free(struct imgst_file* imgst_file)
+{
+    if (imgst_file == NULL || imgst_file->freespace == NULL) return;
+
+    free(imgst_file->freespace->extents);
+    FREE_POINTER(imgst_file->freespace);
+}
+
+// See freespace.h
+int freespace_alloc(struct imgst_file* imgst_file, uint64_t size, uint64_t* offset)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(offset);
+    M_EXIT_IF_ERR(freespace_build(imgst_file));
+
+    // Best fit: the smallest extent big enough
+    struct imgst_freespace* map = imgst_file->freespace;
+    size_t best = map->nb_extents;
+    for (size_t e = 0; e < map->nb_extents; ++e) {
+        if (map->extents[e].size >= size && (best == map->nb_extents || map->extents[e].size < map->extents[best].size)) {
+            best = e;
+            if (map->extents[e].size == size) break;
+        }
+    }
+    if (best == map->nb_extents) return ERR_FULL_IMGSTORE;
+
+    // Allocated at its beginning (the rest stays in place in the array)
+    struct free_extent* extent = &map->extents[best];
+    *offset = extent->offset;
+    if (extent->size == size) {
+        memmove(extent, extent + 1, (map->nb_extents - best - 1) * sizeof(struct free_extent));
+        --map->nb_extents;
+    } else {
+        extent->offset += size;
+        extent->size -= size;
+    }
+    return ERR_NONE;
+}
+
+// See freespace.h
+int freespace_reserve(struct imgst_file* imgst_file, uint64_t offset, uint64_t size)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_EXIT_IF_ERR(freespace_build(imgst_file));
+
+    struct imgst_freespace* map = imgst_file->freespace;
+    const uint64_t end = offset + size;
+    size_t e = 0;
+    while (e < map->nb_extents && map->extents[e].offset < end) {
+        struct free_extent* extent = &map->extents[e];
+        const uint64_t extent_end = extent->offset + extent->size;
+        if (extent_end <= offset) {
+            ++e;
+        } else if (extent->offset < offset && extent_end > end) {
+            // Split in two around the bytes
+            extent->size = offset - extent->offset;
+            return insert_extent(map, e + 1, end, extent_end - end);
+        } else if (extent->offset < offset) {
+            extent->size = offset - extent->offset;
+            ++e;
+        } else if (extent_end > end) {
+            extent->size = extent_end - end;
+            extent->offset = end;
+            ++e;
+        } else {
+            memmove(extent, extent + 1, (map->nb_extents - e - 1) * sizeof(struct free_extent));
+            --map->nb_extents;
+        }
+    }
+    return ERR_NONE;
+}
+
+// See freespace.h
+int freespace_release(struct imgst_file* imgst_file, uint64_t offset, uint64_t size)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+    struct imgst_freespace* map = imgst_file->freespace;
+    if (map == NULL || size == 0) return ERR_NONE;
+
+    // Position of the first extent after it
+    size_t pos = 0;
+    size_t high = map->nb_extents;
+    while (pos < high) {
+        const size_t mid = pos + (high - pos) / 2;
+        if (map->extents[mid].offset < offset) pos = mid + 1;
+        else high = mid;
+    }
+
+    struct free_extent* prev = pos > 0 ? &map->extents[pos - 1] : NULL;
+    struct free_extent* next = pos < map->nb_extents ? &map->extents[pos] : NULL;
+
+    // Already free (the map does not match the metadata): left as is, since
+    // built again it would count the contents being inserted as holes
+    if ((prev != NULL && prev->offset + prev->size > offset) || (next != NULL && offset + size > next->offset)) {
+        return ERR_NONE;
+    }
+
+    // Merged with its neighbours
+    const int with_prev = prev != NULL && prev->offset + prev->size == offset;
+    const int with_next = next != NULL && offset + size == next->offset;
+    if (with_prev && with_next) {
+        prev->size += size + next->size;
+        memmove(next, next + 1, (map->nb_extents - pos - 1) * sizeof(struct free_extent));
+        --map->nb_extents;
+    } else if (with_prev) {
+        prev->size += size;
+    } else if (with_next) {
+        next->offset = offset;
+        next->size += size;
+    } else {
+        M_EXIT_IF_ERR(insert_extent(map, pos, offset, size));
+    }
+    return ERR_NONE;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+/**
+ * @file freespace.h
+ * @brief Methods offered by 'freespace.c'.
+ *
+ * In-memory map of the free extents of an imgStore file: the holes left
+ * between the stored images (by deleted images, or by a metadata table
+ * moved away by do_grow()). It is built from the metadata when first
+ * needed, then kept up to date by do_delete() and by the writes of new
+ * images, which reuse the holes (best fit) before appending to the file.
+ */
+
+#include "imgStore.h"
+
+/**
+ * @brief A free extent of the imgStore file.
+ */
+struct free_extent {
+    uint64_t offset; // first free byte
+    uint64_t size;   // number of free bytes
+};
+
+/**
+ * @brief The free extents of an imgStore file, sorted by offset and
+ *        never adjacent (neighbours are merged).
+ */
+struct imgst_freespace {
+    struct free_extent* extents;
+    size_t nb_extents;
+    size_t capacity;
+};
+
+/**
+ * @brief Builds the map of the free extents from the metadata
+ *        (nothing is done if already built).
+ *
+ * @param imgst_file The main in-memory data structure, with its metadata loaded.
+ * @return Some error code. 0 if no error.
+ */
+int freespace_build(struct imgst_file* imgst_file);
+
+/**
+ * @brief Frees the map of the free extents (if any), e.g. when the images
+ *        are moved: it will be built again when needed.
+ *
+ * @param imgst_file The main in-memory data structure.
+ */
+void freespace_free(struct imgst_file* imgst_file);
+
+/**
+ * @brief Allocates 'size' bytes in the smallest free extent big enough.
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @param size The number of bytes.
+ * @param offset Set to the position of the allocated bytes, if any.
+ * @return ERR_NONE if allocated, ERR_FULL_IMGSTORE if no free extent is big enough
+ *         (the bytes have to be appended to the file), another error code otherwise.
+ */
+int freespace_alloc(struct imgst_file* imgst_file, uint64_t size, uint64_t* offset);
+
+/**
+ * @brief Removes the bytes [offset, offset + size[ from the free extents
+ *        (building the map if needed), e.g. for copies whose metadata is
+ *        not written yet: they are not allocated meanwhile.
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @param offset The position of the bytes.
+ * @param size Their number.
+ * @return Some error code. 0 if no error.
+ */
+int freespace_reserve(struct imgst_file* imgst_file, uint64_t offset, uint64_t size);
+
+/**
+ * @brief Gives back an extent no longer referenced by the metadata
+ *        (nothing is done if the map is not built).
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @param offset The position of the extent.
+ * @param size Its number of bytes.
+ * @return Some error code. 0 if no error.
+ */
+int freespace_release(struct imgst_file* imgst_file, uint64_t offset, uint64_t size);
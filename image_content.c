@@ -1,34 +1,60 @@
 /**
  * @file imgst_content.c
- * @brief imgStore library: lazily_resize implementation.
+ * @brief imgStore library: lazily_resize, lazily_resize_all, resize_variants and store_variants implementations.
  */
 #include "imgStore.h"
 #include "image_content.h"
+#include "index.h"
 #include "util.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h> // for memset
 #include <vips/vips.h>
 
-double shrink_value(const VipsImage *image,
-                    int max_thumbnail_width,
-                    int max_thumbnail_height);
+static int load_orig_from_disk(struct imgst_file * imgst_file,
+                               const size_t index,
+                               void** buffer);
 
-int load_orig_from_disk(struct imgst_file * imgst_file,
-                        const size_t index,
-                        VipsImage** original,
-                        void** buffer);
+static int store_resized_on_disk(const int res,
+                                 struct imgst_file * imgst_file,
+                                 const size_t index,
+                                 VipsImage* resized,
+                                 void** buffer);
 
-int store_resized_on_disk(const int res,
-                          struct imgst_file * imgst_file,
-                          const size_t index,
-                          VipsImage** resized,
-                          void** buffer);
+static int store_content_on_disk(const int res,
+                                 struct imgst_file * imgst_file,
+                                 const size_t index,
+                                 const void* buffer,
+                                 const size_t size);
+
+static int resize_image(void* original,
+                        const size_t original_size,
+                        VipsImage** resized,
+                        const struct imgst_file * imgst_file,
+                        const int res);
+
+static int derive_image(VipsImage* larger,
+                        VipsImage** resized,
+                        const struct imgst_file * imgst_file,
+                        const int res);
+
+static int can_derive(const struct imgst_file * imgst_file,
+                      const int larger_res,
+                      const int res);
 
-void resize_image(VipsImage* original,
-                  VipsImage** resized,
-                  const struct imgst_file * imgst_file,
-                  const int res);
+static int has_shared_variant(const int res,
+                              const struct imgst_file * imgst_file,
+                              const size_t index);
+
+static int adopt_shared_variant(const int res,
+                                struct imgst_file * imgst_file,
+                                const size_t index,
+                                int* adopted);
+
+static int share_variant(const int res,
+                         struct imgst_file * imgst_file,
+                         const size_t index);
 
 // ======================================================================
 // See image_content.h
@@ -42,45 +68,152 @@ int lazily_resize (const int res,
     }
     if (res == RES_ORIG || imgst_file->metadata[index].offset[res]) return ERR_NONE;
 
-    VipsObject* parent = VIPS_OBJECT(vips_image_new());
-    VipsObject** tab = vips_object_local_array(parent, 2); // contains references of original and resized image
+    // A duplicate of the image may have generated it already
+    int adopted = 0;
+    M_EXIT_IF_ERR(adopt_shared_variant(res, imgst_file, index, &adopted));
+    if (adopted) return ERR_NONE;
 
-    // Loads the original image from memory
+    // Loads the original image (still encoded) from the disk
     void* buffer_orig = NULL; // allocated by 'load_orig_from_disk'
-    VipsImage* original = VIPS_IMAGE(tab[0]);
-    M_EXIT_IF_ERR(load_orig_from_disk(imgst_file, index, &original, &buffer_orig));
+    M_EXIT_IF_ERR(load_orig_from_disk(imgst_file, index, &buffer_orig));
 
-    // Resizes the original image in a new resolution
-    VipsImage* resized = VIPS_IMAGE(tab[1]);
-    resize_image(original, &resized, imgst_file, res);
+    // Decodes it directly at the size of the new resolution
+    VipsImage* resized = NULL;
+    int ret = resize_image(buffer_orig, imgst_file->metadata[index].size[RES_ORIG], &resized, imgst_file, res);
+    FREE_POINTER(buffer_orig);
+    if (ret != ERR_NONE) return ret;
 
     // Stores the new image in memory
     void* buffer_resized = NULL; // allocated by 'vips_jpegsave_buffer'
-    M_EXIT_IF_ERR(store_resized_on_disk(res, imgst_file, index, &resized, &buffer_resized));
+    ret = store_resized_on_disk(res, imgst_file, index, resized, &buffer_resized);
+
+    g_object_unref(resized);
+    FREE_POINTER(buffer_resized);
+
+    return ret;
+}
+
+// ======================================================================
+// See image_content.h
+int lazily_resize_all (struct imgst_file * imgst_file,
+                       const size_t index)
+{
+    struct resized_variants variants;
+    M_EXIT_IF_ERR(resize_variants(imgst_file, index, RES_ORIG, &variants));
+    const int ret = store_variants(imgst_file, index, &variants);
+    free_variants(&variants);
+    return ret;
+}
+
+// ======================================================================
+// See image_content.h
+int resize_variants (struct imgst_file * imgst_file,
+                     const size_t index,
+                     const int only_res,
+                     struct resized_variants* variants)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(variants);
+    if (index >= imgst_file->header.max_files || only_res < RES_THUMB || only_res > RES_ORIG) return ERR_INVALID_ARGUMENT;
+    memset(variants, 0, sizeof(*variants));
+
+    // Lists the missing resolutions, from the largest one (duplicates of the image may have some already)
+    int missing[NB_RES - 1];
+    int nb_missing = 0;
+    for (int res = RES_ORIG - 1; res >= RES_THUMB; --res) {
+        if (only_res != RES_ORIG && res != only_res) continue;
+        if (imgst_file->metadata[index].offset[res] == 0 && !has_shared_variant(res, imgst_file, index)) {
+            missing[nb_missing++] = res;
+        }
+    }
+    if (nb_missing == 0) return ERR_NONE;
+
+    // Loads the original image (still encoded) from the disk, once for all resolutions
+    void* buffer_orig = NULL; // allocated by 'load_orig_from_disk'
+    M_EXIT_IF_ERR(load_orig_from_disk(imgst_file, index, &buffer_orig));
+
+    VipsImage* larger = NULL; // previous resized image, from which the smaller ones are derived
+    int larger_res = RES_ORIG;
+    int ret = ERR_NONE;
+    for (int m = 0; m < nb_missing && ret == ERR_NONE; ++m) {
+        const int res = missing[m];
+
+        // Derives the image from the previous one if it is large enough, or decodes the original otherwise
+        VipsImage* resized = NULL;
+        if (larger != NULL && can_derive(imgst_file, larger_res, res)) {
+            ret = derive_image(larger, &resized, imgst_file, res);
+        } else {
+            ret = resize_image(buffer_orig, imgst_file->metadata[index].size[RES_ORIG], &resized, imgst_file, res);
+        }
+        if (ret != ERR_NONE) break;
 
-    // Frees the array of image
-    g_object_unref(parent);
+        // Keeps its pixels in memory, so that deriving from it does not decode the original again
+        VipsImage* in_memory = vips_image_copy_memory(resized);
+        g_object_unref(resized);
+        if (in_memory == NULL) {
+            ret = ERR_IMGLIB;
+            break;
+        }
 
-    // Frees the buffers
+        // Encodes it (allocating its buffer)
+        if (vips_jpegsave_buffer(in_memory, &variants->buffers[res], &variants->sizes[res], NULL)) ret = ERR_IMGLIB;
+
+        if (larger != NULL) g_object_unref(larger);
+        larger = in_memory;
+        larger_res = res;
+    }
+
+    if (larger != NULL) g_object_unref(larger);
     FREE_POINTER(buffer_orig);
-    FREE_POINTER(buffer_resized);
 
+    if (ret != ERR_NONE) free_variants(variants);
+    return ret;
+}
+
+// ======================================================================
+// See image_content.h
+int store_variants (struct imgst_file * imgst_file,
+                    const size_t index,
+                    const struct resized_variants* variants)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(variants);
+    if (index >= imgst_file->header.max_files) return ERR_INVALID_ARGUMENT;
+
+    for (int res = RES_ORIG - 1; res >= RES_THUMB; --res) {
+        if (imgst_file->metadata[index].offset[res]) continue; // (stored meanwhile)
+
+        int adopted = 0;
+        M_EXIT_IF_ERR(adopt_shared_variant(res, imgst_file, index, &adopted));
+        if (!adopted && variants->buffers[res] != NULL) {
+            M_EXIT_IF_ERR(store_content_on_disk(res, imgst_file, index, variants->buffers[res], variants->sizes[res]));
+        }
+    }
     return ERR_NONE;
 }
 
+// ======================================================================
+// See image_content.h
+void free_variants (struct resized_variants* variants)
+{
+    if (variants == NULL) return;
+    for (int res = RES_THUMB; res < RES_ORIG; ++res) {
+        FREE_POINTER(variants->buffers[res]);
+        variants->sizes[res] = 0;
+    }
+}
+
 // ======================================================================
 /**
- * @brief Loads the original image from the disk, in 'original'.
+ * @brief Loads the original image, as stored (JPEG), from the disk.
  *
  * @param imgst_file The main in-memory data structure
  * @param index The position of the image to be resized in memory.
- * @param original Pointer to the original image.
  * @param buffer Pointer to the memory buffer to be filled (to be freed in 'lazily_resize').
  */
-int load_orig_from_disk (struct imgst_file * imgst_file,
-                         const size_t index,
-                         VipsImage** original,
-                         void** buffer)
+static int load_orig_from_disk (struct imgst_file * imgst_file,
+                                const size_t index,
+                                void** buffer)
 {
     // Allocates the buffer on the heap
     size_t buffer_size_orig = imgst_file->metadata[index].size[RES_ORIG]; // Size (in bytes) of the original image
@@ -94,9 +227,6 @@ int load_orig_from_disk (struct imgst_file * imgst_file,
         return error_load;
     }
 
-    // Loads the content of the buffer in the 'original' VipsImage
-    if (vips_jpegload_buffer(*buffer, buffer_size_orig, original, NULL)) return ERR_IMGLIB;
-
     return ERR_NONE;
 }
 
@@ -110,59 +240,212 @@ int load_orig_from_disk (struct imgst_file * imgst_file,
  * @param resized Pointer to the resized image.
  * @param buffer Pointer to the buffer (to be freed in 'lazily_resize').
  */
-int store_resized_on_disk (const int res,
-                           struct imgst_file * imgst_file,
-                           const size_t index,
-                           VipsImage** resized,
-                           void** buffer)
+static int store_resized_on_disk (const int res,
+                                  struct imgst_file * imgst_file,
+                                  const size_t index,
+                                  VipsImage* resized,
+                                  void** buffer)
 {
     size_t buffer_size = 0; // computed by 'vips_jpegsave_buffer'
 
     // Allocates the buffer and saves the 'resized' VipsImage in it
-    if (vips_jpegsave_buffer(*resized, buffer, &buffer_size, NULL)) return ERR_IMGLIB;
+    if (vips_jpegsave_buffer(resized, buffer, &buffer_size, NULL)) return ERR_IMGLIB;
 
-    // Stores the content of the buffer at the end of the imgStore
-    M_EXIT_IF_ERR(write_image_end_of_imgst(index, res, *buffer, buffer_size, imgst_file));
+    return store_content_on_disk(res, imgst_file, index, *buffer, buffer_size);
+}
+
+// ======================================================================
+/**
+ * @brief Stores the content (JPEG) of the resized image of resolution 'res'
+ *        of the image at position 'index' on the disk.
+ *
+ * @param res The code of the new image resolution.
+ * @param imgst_file The main in-memory data structure.
+ * @param index The position of the resized image in memory.
+ * @param buffer The content of the resized image.
+ * @param size The size of this content.
+ */
+static int store_content_on_disk (const int res,
+                                  struct imgst_file * imgst_file,
+                                  const size_t index,
+                                  const void* buffer,
+                                  const size_t size)
+{
+    // Stores the content of the buffer in a hole of the imgStore, or at its end
+    M_EXIT_IF_ERR(write_image_to_imgst(index, res, buffer, size, imgst_file));
 
-    // Updates the metadata
-    imgst_file->metadata[index].size[res] = buffer_size;
-    return update_metadata(imgst_file, index);
+    // Updates the metadata (also of the duplicates of the image, which share it)
+    imgst_file->metadata[index].size[res] = size;
+    M_EXIT_IF_ERR(update_metadata(imgst_file, index));
+    M_EXIT_IF_ERR(share_variant(res, imgst_file, index));
+    return commit_updates(imgst_file);
 }
 
 // ======================================================================
 /**
- * @brief Stores the resized version of 'original' image in 'resized'.
+ * @brief Stores the version of the 'larger' (already resized) image
+ *        at the size of resolution 'res' in 'resized' (not rotated either,
+ *        see resize_image).
  *
- * @param original The original image.
- * @param resized Pointer to the resized image.
+ * @param larger The image of a larger resolution.
+ * @param resized Pointer to the resized image (to be unreferenced by the caller).
  * @param imgst_file The main in-memory data structure.
  * @param res The code of the new image resolution to the resized image.
  */
-void resize_image(VipsImage* original,
-                  VipsImage** resized,
-                  const struct imgst_file * imgst_file,
-                  const int res)
+static int derive_image(VipsImage* larger,
+                        VipsImage** resized,
+                        const struct imgst_file * imgst_file,
+                        const int res)
 {
-    const double ratio = shrink_value(original, imgst_file->header.res_resized[2*res], imgst_file->header.res_resized[2*res+1]);
-    vips_resize(original, resized, ratio, NULL); // Creates the resized image in 'resized'
+    const int width = imgst_file->header.res_resized[2*res];
+    const int height = imgst_file->header.res_resized[2*res+1];
+    if (vips_thumbnail_image(larger, resized, width, "height", height, "no_rotate", TRUE, NULL)) return ERR_IMGLIB;
+    return ERR_NONE;
 }
 
 // ======================================================================
 /**
- * @brief Computes the shrinking factor (keeping aspect ratio).
+ * @brief Tells whether the image of resolution 'res' can be derived from
+ *        the one of resolution 'larger_res' without upscaling it, i.e.
+ *        whether the box of 'larger_res' contains the one of 'res'.
  *
- * @param image The image to be resized.
- * @param max_thumbnail_width The maximum width allowed for thumbnail creation.
- * @param max_thumbnail_height The maximum height allowed for thumbnail creation.
+ * @param imgst_file The main in-memory data structure.
+ * @param larger_res The code of the resolution of the source image.
+ * @param res The code of the resolution of the image to derive.
  */
-double
-shrink_value (const VipsImage *image,
-              int max_thumbnail_width,
-              int max_thumbnail_height)
+static int can_derive(const struct imgst_file * imgst_file,
+                      const int larger_res,
+                      const int res)
 {
-    const double h_shrink = (double) max_thumbnail_width  / (double) image->Xsize ;
-    const double v_shrink = (double) max_thumbnail_height / (double) image->Ysize ;
-    return h_shrink > v_shrink ? v_shrink : h_shrink ;
+    const uint16_t* boxes = imgst_file->header.res_resized;
+    return boxes[2*larger_res] >= boxes[2*res] && boxes[2*larger_res+1] >= boxes[2*res+1];
+}
+
+// ======================================================================
+/**
+ * @brief Tells whether one of the duplicates (see dedup.c) of the image at
+ *        position 'index' has a resized image of resolution 'res'.
+ *
+ * @param res The code of the resolution.
+ * @param imgst_file The main in-memory data structure.
+ * @param index The position of the image in memory.
+ */
+static int has_shared_variant (const int res,
+                               const struct imgst_file * imgst_file,
+                               const size_t index)
+{
+    const uint32_t refs = index_blob_refs(imgst_file, imgst_file->metadata[index].SHA);
+    if (refs <= 1) return 0; // no duplicate
+
+    size_t* duplicates = calloc(refs, sizeof(size_t));
+    if (duplicates == NULL) return 0; // (resized again then)
+    const size_t nb_duplicates = index_find_all_sha(imgst_file, imgst_file->metadata[index].SHA, duplicates, refs);
+
+    int shared = 0;
+    for (size_t d = 0; d < nb_duplicates && !shared; ++d) {
+        shared = duplicates[d] != index && imgst_file->metadata[duplicates[d]].offset[res] != 0;
+    }
+    FREE_POINTER(duplicates);
+    return shared;
+}
+
+// ======================================================================
+/**
+ * @brief Makes the image at position 'index' point to the resized image
+ *        of resolution 'res' of one of its duplicates (see dedup.c), if any.
+ *
+ * @param res The code of the resolution.
+ * @param imgst_file The main in-memory data structure.
+ * @param index The position of the image in memory.
+ * @param adopted Set to whether a duplicate had the resized image.
+ */
+static int adopt_shared_variant (const int res,
+                                 struct imgst_file * imgst_file,
+                                 const size_t index,
+                                 int* adopted)
+{
+    *adopted = 0;
+    const uint32_t refs = index_blob_refs(imgst_file, imgst_file->metadata[index].SHA);
+    if (refs <= 1) return ERR_NONE; // no duplicate
+
+    size_t* duplicates = calloc(refs, sizeof(size_t));
+    M_EXIT_IF_NULL(duplicates, refs * sizeof(size_t));
+    const size_t nb_duplicates = index_find_all_sha(imgst_file, imgst_file->metadata[index].SHA, duplicates, refs);
+
+    for (size_t d = 0; d < nb_duplicates && !*adopted; ++d) {
+        const struct img_metadata* duplicate = &imgst_file->metadata[duplicates[d]];
+        if (duplicates[d] != index && duplicate->offset[res] != 0) {
+            imgst_file->metadata[index].offset[res] = duplicate->offset[res];
+            imgst_file->metadata[index].size[res] = duplicate->size[res];
+            *adopted = 1;
+        }
+    }
+    FREE_POINTER(duplicates);
+    if (!*adopted) return ERR_NONE;
+
+    M_EXIT_IF_ERR(update_metadata(imgst_file, index));
+    return commit_updates(imgst_file);
+}
+
+// ======================================================================
+/**
+ * @brief Makes the duplicates (see dedup.c) of the image at position 'index'
+ *        which have no resized image of resolution 'res' point to its one.
+ *
+ * @param res The code of the resolution.
+ * @param imgst_file The main in-memory data structure.
+ * @param index The position of the image in memory.
+ */
+static int share_variant (const int res,
+                          struct imgst_file * imgst_file,
+                          const size_t index)
+{
+    const uint32_t refs = index_blob_refs(imgst_file, imgst_file->metadata[index].SHA);
+    if (refs <= 1) return ERR_NONE; // no duplicate
+
+    size_t* duplicates = calloc(refs, sizeof(size_t));
+    M_EXIT_IF_NULL(duplicates, refs * sizeof(size_t));
+    const size_t nb_duplicates = index_find_all_sha(imgst_file, imgst_file->metadata[index].SHA, duplicates, refs);
+
+    int ret = ERR_NONE;
+    for (size_t d = 0; d < nb_duplicates && ret == ERR_NONE; ++d) {
+        struct img_metadata* duplicate = &imgst_file->metadata[duplicates[d]];
+        if (duplicates[d] != index && duplicate->offset[res] == 0) {
+            duplicate->offset[res] = imgst_file->metadata[index].offset[res];
+            duplicate->size[res] = imgst_file->metadata[index].size[res];
+            ret = update_metadata(imgst_file, duplicates[d]);
+        }
+    }
+    FREE_POINTER(duplicates);
+    return ret;
+}
+
+// ======================================================================
+/**
+ * @brief Decodes the 'original' JPEG image directly at the size of resolution 'res'.
+ *
+ * The image is shrunk in the DCT domain while it is loaded (shrink-on-load),
+ * so the original is never decoded at full size, then resized (keeping aspect
+ * ratio) to fit in the box of 'res'. Like the former resize, it ignores the
+ * EXIF orientation of the original (no rotation).
+ *
+ * @param original The content of the original image.
+ * @param original_size The size of the content of the original image.
+ * @param resized Pointer to the resized image (to be unreferenced by the caller).
+ * @param imgst_file The main in-memory data structure.
+ * @param res The code of the new image resolution to the resized image.
+ */
+static int resize_image(void* original,
+                        const size_t original_size,
+                        VipsImage** resized,
+                        const struct imgst_file * imgst_file,
+                        const int res)
+{
+    const int width = imgst_file->header.res_resized[2*res];
+    const int height = imgst_file->header.res_resized[2*res+1];
+    if (vips_thumbnail_buffer(original, original_size, resized, width, "height", height,
+                              "no_rotate", TRUE, NULL)) return ERR_IMGLIB;
+    return ERR_NONE;
 }
 
 // ======================================================================
@@ -16,6 +16,54 @@
  */
 int lazily_resize(const int res_code, struct imgst_file * imgst_file, const size_t index);
 
+/**
+ * @brief Creates and stores in memory every missing derivative image of the
+ *        image at position 'index', decoding the original only once: each
+ *        resolution is derived from the next larger one when possible
+ *        (thumbnail from small).
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @param index The index of the image to be resized in memory.
+ */
+int lazily_resize_all(struct imgst_file * imgst_file, const size_t index);
+
+/* Resized images of an image, created but not stored yet (see resize_variants) */
+struct resized_variants {
+    void* buffers[NB_RES - 1]; // content (JPEG) of each resolution, NULL if not created
+    size_t sizes[NB_RES - 1];  // size of this content
+};
+
+/**
+ * @brief Creates in memory, as lazily_resize_all does, the missing derivative
+ *        images of the image at position 'index' which none of its duplicates
+ *        has, without storing them: the imgStore is only read, so that this
+ *        (lengthy) work needs only the read lock.
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @param index The index of the image to be resized in memory.
+ * @param res The code of the only resolution to create, or RES_ORIG for all of them.
+ * @param variants The images created (to be freed by free_variants).
+ */
+int resize_variants(struct imgst_file * imgst_file, const size_t index, const int res, struct resized_variants* variants);
+
+/**
+ * @brief Stores the images created by resize_variants for the image at
+ *        position 'index', in the resolutions still missing (the ones stored
+ *        meanwhile are kept; the ones which a duplicate has are shared).
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @param index The index of the image in memory.
+ * @param variants The images created by resize_variants.
+ */
+int store_variants(struct imgst_file * imgst_file, const size_t index, const struct resized_variants* variants);
+
+/**
+ * @brief Frees the images created by resize_variants.
+ *
+ * @param variants The images.
+ */
+void free_variants(struct resized_variants* variants);
+
 /**
  * @brief Gets the resolution of a JPEG image.
  *
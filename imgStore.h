@@ -11,6 +11,12 @@
  * because it should be stored as raw bytes appended at the end of the
  * imgStore file and addressed by offsets in the metadata structure.
  *
+ * In the v2 format (imgst_header.format), the metadata structures are
+ * rather found at imgst_header.metadata_offset: do_grow() can thus
+ * append a larger metadata table at the end of the file and switch the
+ * header to it, without moving any image content. do_create() writes
+ * v1 files, unless max_files exceeds MAX_MAX_FILES.
+ *
  * @author Mia Primorac
  */
 
@@ -31,6 +37,27 @@
 #define MAX_IMGST_NAME  31  // max. size of a ImgStore name
 #define MAX_IMG_ID     127  // max. size of an image id
 #define MAX_MAX_FILES 100000  // will be increased later in the project
+#define MAX_GROWN_FILES 16777216 // max. number of images of a (v2) imgStore grown by do_grow()
+#define COPY_BUFFER_SIZE (1 << 20) // size of the buffer of copy_range()
+#define MAX_GC_THREADS 64 // max. number of threads copying the images in do_gbcollect_threads()
+#define READ_CHUNK_SIZE (256 << 10) // default size of the chunks of do_read_stream()
+#define INSERT_CHUNK_SIZE (256 << 10) // size of the chunks read by do_insert_fd()
+
+/* For format in imgst_header */
+#define IMGST_FORMAT_V1 0 // metadata right after the header
+#define IMGST_FORMAT_V2 2 // metadata at metadata_offset
+
+/* Flag of the open mode of do_open() (not passed to fopen()) to map the header and metadata in memory */
+#define MMAP_FLAG 'm'
+
+/* Durability levels of the updates of an imgStore (see do_set_durability) */
+#define DURABILITY_NONE  0 // no journal nor fsync: a crash may leave the header and metadata inconsistent (default)
+#define DURABILITY_SYNC  1 // journaled, durable at the end of each operation
+#define DURABILITY_GROUP 2 // journaled, durable by groups of operations (group commit)
+
+/* Policies of creation of the resized images of an imgStore (variants in imgst_header) */
+#define VARIANTS_LAZY  0 // created on the first read of each resolution (default)
+#define VARIANTS_EAGER 1 // created right after the insertion of the image, see do_create_variants
 
 /* For is_valid in imgst_metadata */
 #define EMPTY 0
@@ -51,10 +78,11 @@ struct imgst_header {
     char imgst_name[MAX_IMGST_NAME+1];          // name of the database
     uint32_t imgst_version;                     // version of the database
     uint32_t num_files;                         // number of (valid) images in the database
-    const uint32_t max_files;                   // maximal number of images in the database
+    uint32_t max_files;                         // maximal number of images in the database (see do_grow)
     const uint16_t res_resized[2 * (NB_RES-1)]; // array of the maximal resolutions of "thumbnail" and "small"
-    uint32_t unused_32;
-    uint64_t unused_64;
+    uint16_t format;                            // layout of the file (IMGST_FORMAT_V1 or IMGST_FORMAT_V2)
+    uint16_t variants;                          // when the resized images are created (VARIANTS_LAZY or VARIANTS_EAGER)
+    uint64_t metadata_offset;                   // position of the metadata in the file (v2 only)
 };
 
 /* The metadata of an image */
@@ -70,11 +98,23 @@ struct img_metadata {
     uint32_t padding1;                       // for padding of the struct
 };
 
+struct imgst_index; // in-memory index of the metadata, see index.h
+struct imgst_journal; // redo journal of the updates, see journal.h
+struct imgst_freespace; // in-memory map of the free extents, see freespace.h
+struct imgst_lock; // readers/writers lock of the operations, see tools.c
+
 /* The database */
 struct imgst_file {
     FILE* file;                    // database file (on the disk)
     struct imgst_header header;    // header of the database
     struct img_metadata* metadata; // metadata of the images in the database
+    struct imgst_index* index;     // in-memory index of the metadata (not stored on the disk)
+    void* map;                     // mapping of the header and metadata (NULL if read on the heap)
+    size_t map_size;               // size (in bytes) of this mapping
+    int read_only;                 // whether the file was opened without write access
+    struct imgst_journal* journal; // redo journal of the header and metadata updates (NULL without)
+    struct imgst_freespace* freespace; // free extents of the file (NULL until needed, not stored on the disk)
+    struct imgst_lock* lock;       // readers/writers lock of the operations (NULL: not locked)
 };
 
 /**
@@ -92,10 +132,25 @@ void print_header (const struct imgst_header * header);
 void print_metadata (const struct img_metadata * metadata);
 
 /**
- * @brief Open imgStore file, read the header and all the metadata.
+ * @brief Open imgStore file, read the header and all the metadata,
+ *        and build the in-memory index of the metadata.
+ *
+ * With MMAP_FLAG in open_mode (e.g. "rb+m"), the header and metadata are
+ * not read but mapped in memory: only the touched entries are faulted in,
+ * the metadata is edited in place (shared with other processes mapping
+ * the same file) and written back by the kernel, or by do_sync().
+ *
+ * If a journal was left behind by a crash (see do_set_durability), its
+ * complete operations are first replayed in the file.
+ *
+ * The imgStore may then be used by several threads: the data is read and
+ * written at explicit offsets (pread()/pwrite(), the file position is never
+ * used), and the operations take a readers/writers lock, so that do_read()
+ * and do_list() run concurrently, and the operations updating the imgStore
+ * one at a time.
  *
  * @param imgst_filename Path to the imgStore file
- * @param open_mode Mode for fopen(), eg.: "rb", "rb+", etc.
+ * @param open_mode Mode for fopen(), eg.: "rb", "rb+", etc., possibly with MMAP_FLAG.
  * @param imgst_file Structure for header, metadata and file pointer.
  */
 int do_open (const char * imgst_filename, const char * open_mode, struct imgst_file* imgst_file);
@@ -107,6 +162,53 @@ int do_open (const char * imgst_filename, const char * open_mode, struct imgst_f
  */
 void do_close (struct imgst_file* imgst_file);
 
+/**
+ * @brief Flushes all the pending modifications of the imgStore to the disk
+ *        (stdio buffers, mapped metadata), and waits for the disk.
+ *
+ * Takes no lock (the operations updating the imgStore call it): not to be
+ * called concurrently with them.
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @return Some error code. 0 if no error.
+ */
+int do_sync (struct imgst_file* imgst_file);
+
+/**
+ * @brief Sets the durability level of the updates of an open imgStore.
+ *
+ * With DURABILITY_SYNC or DURABILITY_GROUP, the header and metadata updates
+ * are logged in a redo journal next to the imgStore (its name followed by
+ * ".journal"), which do_open() replays after a crash, and mapped metadata
+ * is no longer shared with other processes. An operation is durable when
+ * it returns (DURABILITY_SYNC), or once group_ops operations have been
+ * done or group_ms milliseconds have elapsed since the first of them
+ * (DURABILITY_GROUP; see also do_group_commit()).
+ *
+ * @param imgst_filename Path to the imgStore file, as given to do_open().
+ * @param durability DURABILITY_NONE, DURABILITY_SYNC or DURABILITY_GROUP.
+ * @param group_ops Max. number of operations per group (0 for no limit).
+ * @param group_ms Max. delay of a group in milliseconds (0 for no limit).
+ * @param imgst_file The main in-memory data structure.
+ * @return Some error code. 0 if no error.
+ */
+int do_set_durability (const char* imgst_filename, int durability, unsigned group_ops, unsigned group_ms,
+                       struct imgst_file* imgst_file);
+
+/**
+ * @brief Makes the pending group of operations durable if its delay has
+ *        elapsed (DURABILITY_GROUP). To be called periodically, e.g. from
+ *        an event loop; does nothing for the other durability levels.
+ *
+ * It never waits for the lock of the imgStore: if another thread holds it
+ * (e.g. a resize reading the imgStore), the group is left to the next call,
+ * or flushed by the writer when it commits.
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @return Some error code. 0 if no error.
+ */
+int do_group_commit (struct imgst_file* imgst_file);
+
 /**
  * @brief List of possible output modes for do_list
  *
@@ -167,7 +269,128 @@ int resolution_atoi(const char* resolution);
 int do_read(const char* img_id, int resolution, char** image_buffer, uint32_t* image_size, struct imgst_file* imgst_file);
 
 /**
- * @brief Insert image in the imgStore file
+ * @brief Tells whether an image is stored in the given resolution, i.e.
+ *        whether reading it needs no resize (see do_create_variants).
+ *
+ * @param img_id The ID of the image.
+ * @param resolution The resolution.
+ * @param stored Set to whether the image is stored in this resolution.
+ * @param imgst_file The main in-memory data structure
+ * @return Some error code (ERR_FILE_NOT_FOUND if there is no such image). 0 if no error.
+ */
+int do_is_stored(const char* img_id, int resolution, int* stored, struct imgst_file* imgst_file);
+
+/* One image to be read by do_read_batch */
+struct img_to_read {
+    const char* img_id; // image ID
+    int resolution;     // desired resolution
+    char* buffer;       // set by do_read_batch: image content (to be freed by the caller), NULL on error
+    uint32_t size;      // set by do_read_batch: image size
+    int error;          // set by do_read_batch: error code of the read of this image
+};
+
+/**
+ * @brief Reads several images from the imgStore at once.
+ *
+ * All the images are looked up first (missing resolutions are created),
+ * then read in the order of their offsets in the file, contiguous images
+ * with a single vectored read (preadv()): the file is read in a few mostly
+ * sequential passes rather than at random. The results are given in the
+ * order of the images.
+ *
+ * @param images The images to read (their buffer, size and error are set).
+ * @param nb_images The number of images.
+ * @param imgst_file The main in-memory data structure
+ * @return Some error code (of the whole batch, e.g. ERR_OUT_OF_MEMORY). 0 if no error.
+ */
+int do_read_batch(struct img_to_read* images, size_t nb_images, struct imgst_file* imgst_file);
+
+/* Read-only view of the content of an image, see do_read_view */
+struct img_view {
+    const char* data;                    // image content (not to be freed)
+    uint32_t size;                       // image size
+    void* map;                           // mapping of the pages holding it (NULL if none)
+    size_t map_size;                     // size (in bytes) of this mapping
+    const struct imgst_file* imgst_file; // imgStore whose read lock is held until do_release_view
+};
+
+/**
+ * @brief Reads the content of an image from a imgStore without copying it:
+ *        the view points into a read-only mapping of the file, so that the
+ *        image is served straight from the page cache.
+ *
+ * The read lock of the imgStore (see do_open()) is held until the view is
+ * released: the image can be neither moved nor deleted meanwhile, and the
+ * calling thread must not update the imgStore before do_release_view().
+ * Nor may it read an image in a resolution not created yet (e.g. with
+ * do_read): the creation waits for the write lock, thus for the view to
+ * be released, and the thread deadlocks.
+ *
+ * @param img_id The ID of the image to be read.
+ * @param resolution The desired resolution for the image read.
+ * @param view The view to be filled.
+ * @param imgst_file The main in-memory data structure
+ * @return Some error code. 0 if no error (the view must then be released).
+ */
+int do_read_view(const char* img_id, int resolution, struct img_view* view, struct imgst_file* imgst_file);
+
+/**
+ * @brief Reads the content of an image from a imgStore without copying it
+ *        (see do_read_view), only if it is stored in the given resolution:
+ *        a missing one is not created, so that the caller (e.g. the event
+ *        loop of a server) never waits for a resize.
+ *
+ * @param img_id The ID of the image to be read.
+ * @param resolution The desired resolution for the image read.
+ * @param view The view to be filled.
+ * @param stored Set to whether the image is stored in this resolution
+ *        (if not, the view is left empty and need not be released).
+ * @param imgst_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_read_stored_view(const char* img_id, int resolution, struct img_view* view, int* stored,
+                        struct imgst_file* imgst_file);
+
+/**
+ * @brief Receives the content of an image, chunk by chunk (see do_read_stream).
+ *
+ * @param chunk The bytes of the chunk (only valid during the call).
+ * @param size The number of bytes of the chunk.
+ * @param arg The argument given to do_read_stream.
+ * @return Some error code. 0 to receive the next chunk.
+ */
+typedef int (*img_chunk_callback)(const char* chunk, size_t size, void* arg);
+
+/**
+ * @brief Reads the content of an image from a imgStore in chunks of at
+ *        most 'chunk_size' bytes, given in order to 'callback': only one
+ *        chunk is in memory at a time, and the first one is delivered
+ *        without waiting for the rest of the image.
+ *
+ * The read lock of the imgStore (see do_open()) is held during the calls
+ * of the callback, which must not update the imgStore.
+ *
+ * @param img_id The ID of the image to be read.
+ * @param resolution The desired resolution for the image read.
+ * @param chunk_size Max. size of the chunks (READ_CHUNK_SIZE if 0).
+ * @param callback Called with each chunk.
+ * @param arg Given to the callback.
+ * @param imgst_file The main in-memory data structure
+ * @return Some error code (the first one returned by the callback, if any). 0 if no error.
+ */
+int do_read_stream(const char* img_id, int resolution, size_t chunk_size, img_chunk_callback callback, void* arg,
+                   struct imgst_file* imgst_file);
+
+/**
+ * @brief Releases a view filled by do_read_view (nothing is done for an empty view).
+ *
+ * @param view The view to be released.
+ */
+void do_release_view(struct img_view* view);
+
+/**
+ * @brief Insert image in the imgStore file (its content is written only if
+ *        neither its ID nor its content is already stored)
  *
  * @param buffer Pointer to the raw image content
  * @param size Image size
@@ -177,6 +400,153 @@ int do_read(const char* img_id, int resolution, char** image_buffer, uint32_t* i
  */
 int do_insert(const char* buffer, size_t size, const char* img_id, struct imgst_file* imgst_file);
 
+/* An insertion in progress, see do_insert_begin */
+struct imgst_insertion {
+    struct imgst_file* imgst_file;
+    char img_id[MAX_IMG_ID + 1];
+    uint64_t expected;          // size of the content if known, 0 otherwise
+    uint64_t offset;            // position of the appended content
+    uint64_t size;              // number of bytes appended so far
+    uint64_t reserved;          // number of bytes given for them (see imgst_space_alloc)
+    int in_hole;                // whether they were given in a hole
+    void* sha;                  // SHA256 of these bytes, computed as they arrive (EVP_MD_CTX*)
+};
+
+/**
+ * @brief Starts inserting an image whose content is not in memory: the
+ *        content is then appended chunk by chunk (do_insert_append), and
+ *        published by do_insert_commit, or dropped by do_insert_abort.
+ *
+ * If its size is known, the content is written in the smallest hole big
+ * enough (see freespace.h), if any; otherwise at the end of the file.
+ *
+ * The content is written without the lock of the imgStore (see do_open()),
+ * which is still read meanwhile: do_insert_commit only takes the write
+ * lock to publish the image. The operations moving the images wait until
+ * the insertion ends (see imgst_insertion_begin).
+ *
+ * @param img_id Image ID
+ * @param expected_size The size of the content if known (no more bytes may be appended), 0 otherwise.
+ * @param insertion The insertion to be started.
+ * @param imgst_file The main in-memory data structure
+ * @return Some error code. 0 if no error (the insertion must then be committed or aborted).
+ */
+int do_insert_begin(const char* img_id, size_t expected_size, struct imgst_insertion* insertion,
+                    struct imgst_file* imgst_file);
+
+/**
+ * @brief Appends the next bytes of the content of an image being inserted.
+ *
+ * @param insertion The insertion (see do_insert_begin).
+ * @param chunk The bytes.
+ * @param size Their number.
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_append(struct imgst_insertion* insertion, const char* chunk, size_t size);
+
+/**
+ * @brief Ends an insertion: de-duplicates the image (the appended bytes are
+ *        dropped if its content is already stored), reads its resolution,
+ *        then writes its metadata. On error, the insertion is aborted.
+ *
+ * @param insertion The insertion (see do_insert_begin).
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_commit(struct imgst_insertion* insertion);
+
+/**
+ * @brief Drops an insertion and the bytes it appended.
+ *
+ * @param insertion The insertion (see do_insert_begin).
+ */
+void do_insert_abort(struct imgst_insertion* insertion);
+
+/**
+ * @brief Inserts the image read from a file descriptor (until its end),
+ *        INSERT_CHUNK_SIZE bytes at a time, without holding it in memory
+ *        (the content of a regular file may fill a hole, see do_insert_begin).
+ *
+ * @param fd The file descriptor to read the image from.
+ * @param img_id Image ID
+ * @param imgst_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_fd(int fd, const char* img_id, struct imgst_file* imgst_file);
+
+/**
+ * @brief Creates all the missing resized images of an image (see
+ *        lazily_resize_all), so that its first reads need no resize.
+ *
+ * The insertions do not call it: with VARIANTS_EAGER in the header, the
+ * program inserting the images calls it after each insertion, right away
+ * or later (e.g. from a background thread, the imgStore being locked).
+ *
+ * @param img_id The ID of the image.
+ * @param imgst_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_create_variants(const char* img_id, struct imgst_file* imgst_file);
+
+/**
+ * @brief Creates the resized image of an image in the given resolution,
+ *        if still missing (see lazily_resize), and only in this one: the
+ *        reads call it, so that reading a thumbnail does not create the
+ *        small image too. The other resolutions are left to their own
+ *        first read, or to do_create_variants.
+ *
+ * @param img_id The ID of the image.
+ * @param resolution The code of the resolution (RES_THUMB or RES_SMALL;
+ *        nothing is created for RES_ORIG).
+ * @param imgst_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_create_resized(const char* img_id, int resolution, struct imgst_file* imgst_file);
+
+/**
+ * @brief Raises the maximal number of images of an imgStore, in place.
+ *
+ * The larger metadata table is appended at the end of the file, then
+ * the header is switched to it (upgrading a v1 imgStore to v2). The
+ * image content is not moved; the space of the former table is only
+ * reclaimed by garbage collection.
+ *
+ * @param imgst_file The main in-memory data structure, opened for writing.
+ * @param max_files The new maximal number of images.
+ * @return Some error code. 0 if no error.
+ */
+int do_grow (struct imgst_file* imgst_file, uint32_t max_files);
+
+/* One image to be inserted by do_insert_batch */
+struct img_to_insert {
+    const char* buffer; // raw image content
+    size_t size;        // image size
+    const char* img_id; // image ID
+    int error;          // set by do_insert_batch: error code of the insertion of this image
+};
+
+/**
+ * @brief Inserts several images in the imgStore file at once.
+ *
+ * All the new image contents are appended in one sequential pass,
+ * without the lock of the imgStore (like do_insert_begin), then the
+ * touched metadata ranges and the header are written once, under the
+ * write lock.
+ * Each image succeeds or fails on its own: one which cannot be inserted
+ * (e.g. existing ID, invalid content, size of 4 GiB or more, full
+ * imgStore) is skipped, with its error code in its 'error' field, and the
+ * others are inserted. Only their 'error' fields tell which ones are.
+ *
+ * @param images The images to be inserted.
+ * @param nb_images The number of images.
+ * @param imgst_file The main in-memory data structure
+ * @return Some error code of the whole batch. 0 if no error, even if some
+ *         images are skipped. If the contents cannot be written (e.g.
+ *         ERR_IO), none of the images is inserted, and each one not skipped
+ *         has this error too. If the metadata or the header cannot be
+ *         written, the error is returned only here.
+ */
+int do_insert_batch(struct img_to_insert* images, size_t nb_images, struct imgst_file* imgst_file);
+
 /**
  * @brief Removes the deleted images by moving the existing ones
  *
@@ -186,6 +556,67 @@ int do_insert(const char* buffer, size_t size, const char* img_id, struct imgst_
  */
 int do_gbcollect (const char *imgst_path, const char *imgst_tmp_bkp_path);
 
+/**
+ * @brief Same as do_gbcollect(), with the images copied by 'nb_threads'
+ *        threads (in the kernel when the system allows it).
+ *
+ * @param imgst_path The path to the imgStore file
+ * @param imgst_tmp_bkp_path The path to the a (to be created) temporary imgStore backup file
+ * @param nb_threads The number of threads (1 to MAX_GC_THREADS)
+ * @return Some error code. 0 if no error.
+ */
+int do_gbcollect_threads (const char *imgst_path, const char *imgst_tmp_bkp_path, unsigned nb_threads);
+
+/**
+ * @brief Removes the deleted images in place: the stored images slide
+ *        toward the beginning of the file (keeping their order and their
+ *        metadata entries) and the file is truncated. Unlike do_gbcollect(),
+ *        no temporary copy of the imgStore is needed. The metadata on the
+ *        disk stays consistent if interrupted (e.g. by a crash).
+ *
+ * @param imgst_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_compact (struct imgst_file* imgst_file);
+
+struct compact_state; // references to the images, kept from a slice to the next, see imgst_compact.c
+
+/**
+ * @brief State of a compaction pass run in slices (see do_compact_step()).
+ *        To be zeroed before its first pass.
+ */
+struct imgst_compaction {
+    uint64_t cursor;             // end of the compacted part of the file
+    int changed;                 // whether the pass moved or removed anything yet
+    int running;                 // whether the pass is not over yet
+    struct compact_state* state; // kept from a slice to the next (NULL: collected by the next slice)
+};
+
+/**
+ * @brief Starts a compaction pass (from the beginning of the file), to be
+ *        run by do_compact_step(). A pass not over yet is dropped.
+ *
+ * @param compaction The state of the pass.
+ */
+void do_compact_start (struct imgst_compaction* compaction);
+
+/**
+ * @brief Runs a slice of a compaction pass: moves at least one image, and
+ *        stops once 'max_bytes' bytes were moved. The images are collected
+ *        (and sorted) once, then kept from a slice to the next, as long as
+ *        the imgStore does not change in between (see imgst_changes()).
+ *        The metadata of the moved images is switched to their new places
+ *        at once, when their former places are needed, when the imgStore
+ *        changed, or at the end of the pass: a slice does not sync the file
+ *        otherwise. The imgStore may be used (and modified) between two
+ *        slices. The last slice truncates the file and ends the pass.
+ *
+ * @param imgst_file The main in-memory data structure
+ * @param compaction The state of the pass (started by do_compact_start())
+ * @param max_bytes The number of bytes to move in this slice
+ * @return Some error code. 0 if no error.
+ */
+int do_compact_step (struct imgst_file* imgst_file, struct imgst_compaction* compaction, uint64_t max_bytes);
 
 // ======================================== Additional methods ========================================
 /**
@@ -196,6 +627,57 @@ int do_gbcollect (const char *imgst_path, const char *imgst_tmp_bkp_path);
  */
 int update_metadata (struct imgst_file * imgst_file, const size_t index);
 
+/**
+ * @brief (Additional) Position of the metadata in the imgStore file.
+ *
+ * @param header The header of the imgStore.
+ */
+uint64_t get_metadata_offset (const struct imgst_header* header);
+
+/**
+ * @brief (Additional) Reads (or maps) again the metadata from the
+ *        position given by the header, and rebuilds the index.
+ *
+ * @param imgst_file The main in-memory data structure.
+ */
+int reload_metadata (struct imgst_file * imgst_file);
+
+/**
+ * @brief (Additional) Updates the metadata of the images at positions
+ *        [first, first+count[ in memory, with a single write.
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @param first The position of the first image in memory.
+ * @param count The number of consecutive images to be written.
+ */
+int update_metadata_range (struct imgst_file * imgst_file, const size_t first, const size_t count);
+
+/**
+ * @brief (Additional) Ends an operation: its header and metadata updates
+ *        are committed to the journal, if any (see do_set_durability).
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @return Some error code. 0 if no error.
+ */
+int commit_updates (struct imgst_file * imgst_file);
+
+/**
+ * @brief (Additional) Copies 'size' bytes from offset 'from' of file 'in'
+ *        to offset 'to' of file 'out' (possibly the same, without overlap),
+ *        in the kernel if possible (copy_file_range(), which may share the
+ *        blocks on filesystems supporting it, or sendfile(), which moves
+ *        the file position of 'out'), with pread()/pwrite() otherwise.
+ *
+ * @param in The file descriptor to copy from.
+ * @param out The file descriptor to copy to.
+ * @param from The offset of the bytes in 'in'.
+ * @param to The offset of the copy in 'out'.
+ * @param size The number of bytes.
+ * @param buffer A buffer of COPY_BUFFER_SIZE bytes, for pread()/pwrite().
+ * @return Some error code. 0 if no error.
+ */
+int copy_range (int in, int out, uint64_t from, uint64_t to, uint64_t size, char* buffer);
+
 /**
  * @brief (Additional) Updates the header of the image store file on disk.
  *
@@ -223,6 +705,178 @@ int compare_sha (const unsigned char* sha1, const unsigned char* sha2);
  */
 int write_image_end_of_imgst (size_t index, const int res, const char* buffer, size_t size, struct imgst_file* imgst_file);
 
+/**
+ * @brief (Additional) Writes the image (buffer content) in the smallest hole
+ *        of the imgStore file big enough (see freespace.h), or at its end.
+ *
+ * @param index The index of the image in the metadata.
+ * @param res Image resolution.
+ * @param buffer Pointer to the raw image content.
+ * @param size Image size.
+ * @param imgst_file The main in-memory data structure.
+ * @return Some error code. 0 if no error.
+ */
+int write_image_to_imgst (size_t index, const int res, const char* buffer, size_t size, struct imgst_file* imgst_file);
+
+/**
+ * @brief (Additional) Reads exactly 'size' bytes at offset 'offset' of a file
+ *        (pread(), repeated on partial reads), without moving its position.
+ *
+ * @param fd The file descriptor.
+ * @param buffer Buffer of at least 'size' bytes.
+ * @param size The number of bytes.
+ * @param offset Their offset in the file.
+ * @return Some error code (ERR_IO at the end of the file). 0 if no error.
+ */
+int pread_full (int fd, void* buffer, size_t size, uint64_t offset);
+
+/**
+ * @brief (Additional) Writes exactly 'size' bytes at offset 'offset' of a file
+ *        (pwrite(), repeated on partial writes), without moving its position.
+ *
+ * @param fd The file descriptor.
+ * @param buffer The bytes to write.
+ * @param size The number of bytes.
+ * @param offset Their offset in the file.
+ * @return Some error code. 0 if no error.
+ */
+int pwrite_full (int fd, const void* buffer, size_t size, uint64_t offset);
+
+/**
+ * @brief (Additional) Size of the imgStore file, i.e. the offset of the next appended image.
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @param end Set to the size of the file.
+ * @return Some error code. 0 if no error.
+ */
+int get_file_end (const struct imgst_file* imgst_file, uint64_t* end);
+
+/**
+ * @brief (Additional) Creates the readers/writers lock of an imgStore just
+ *        opened or created (see do_open()).
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @return Some error code. 0 if no error.
+ */
+int imgst_lock_init (struct imgst_file* imgst_file);
+
+/**
+ * @brief (Additional) Takes the lock of the imgStore for reading (shared),
+ *        resp. for writing (exclusive), then releases it. Nothing is done
+ *        if the imgStore has no lock (e.g. a structure built by hand).
+ *
+ * @param imgst_file The main in-memory data structure.
+ */
+void imgst_read_lock (const struct imgst_file* imgst_file);
+void imgst_write_lock (const struct imgst_file* imgst_file);
+void imgst_unlock (const struct imgst_file* imgst_file);
+
+/**
+ * @brief (Additional) Takes the lock of the imgStore for writing if no
+ *        other thread holds it, without waiting (e.g. for an event loop).
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @return Whether the lock is taken (always if the imgStore has no lock).
+ */
+int imgst_try_write_lock (const struct imgst_file* imgst_file);
+
+/**
+ * @brief (Additional) Number of writes of the header or of the metadata
+ *        (see update_header() and update_metadata_range()) since the
+ *        imgStore was opened, to be read under its lock: unchanged, so are
+ *        the header and the metadata.
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @return The number of writes, or UINT64_MAX if unknown (no lock).
+ */
+uint64_t imgst_changes (const struct imgst_file* imgst_file);
+
+/**
+ * @brief (Additional) Claims the creation of the resized images of the
+ *        image at position 'index', resp. ends it: while a thread creates
+ *        them, the others wanting to wait until it is done (single flight),
+ *        then find them created. Not to be called under the lock of the
+ *        imgStore (the creating thread needs it). Nothing is done if the
+ *        imgStore has no lock.
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @param index The position of the image in the metadata.
+ */
+void imgst_resize_begin (const struct imgst_file* imgst_file, size_t index);
+void imgst_resize_end (const struct imgst_file* imgst_file, size_t index);
+
+/**
+ * @brief (Additional) Starts, resp. ends, writing the content of a new
+ *        image without the write lock of the imgStore (readers go on
+ *        meanwhile): the operations moving the images or the end of the
+ *        file (see imgst_space_exclusive_begin) wait until it ends. Not to
+ *        be called under the lock of the imgStore. Nothing is done if the
+ *        imgStore has no lock.
+ *
+ * @param imgst_file The main in-memory data structure.
+ */
+void imgst_insertion_begin (const struct imgst_file* imgst_file);
+void imgst_insertion_end (const struct imgst_file* imgst_file);
+
+/**
+ * @brief (Additional) Waits until no insertion writes its content (see
+ *        imgst_insertion_begin), and keeps new ones from starting, resp.
+ *        lets them start again: for the operations moving the images or
+ *        the end of the file (e.g. a compaction). Not to be called under
+ *        the lock of the imgStore. Nothing is done if it has no lock.
+ *
+ * @param imgst_file The main in-memory data structure.
+ */
+void imgst_space_exclusive_begin (const struct imgst_file* imgst_file);
+void imgst_space_exclusive_end (const struct imgst_file* imgst_file);
+
+/**
+ * @brief (Additional) Gives 'size' bytes of the file to a new content: in
+ *        the smallest hole big enough (see freespace.h), if 'in_holes' and
+ *        if any, otherwise at the end of the file, after the contents being
+ *        written by the insertions. A hole is only given once the deletion
+ *        which freed it is durable. To be called under the lock of the
+ *        imgStore (at least for reading): the insertions are given their
+ *        space in parallel.
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @param in_holes Whether the bytes may be given in a hole.
+ * @param size Their number.
+ * @param offset Set to their position.
+ * @param in_hole Set to whether they are in a hole (if not NULL).
+ * @return Some error code. 0 if no error.
+ */
+int imgst_space_alloc (struct imgst_file* imgst_file, int in_holes, uint64_t size, uint64_t* offset, int* in_hole);
+
+/**
+ * @brief (Additional) Extends by 'extra' bytes the last 'size' bytes given
+ *        at the end of the file at 'offset': in place if nothing was given
+ *        after them, otherwise at a new position (set in 'offset'), to
+ *        which the caller copies them (then gives back the former ones).
+ *        To be called under the lock of the imgStore (at least for reading).
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @param size The number of bytes given so far.
+ * @param extra The number of bytes to add.
+ * @param offset Position of the bytes, updated if they are moved.
+ * @return Some error code. 0 if no error.
+ */
+int imgst_space_extend (struct imgst_file* imgst_file, uint64_t size, uint64_t extra, uint64_t* offset);
+
+/**
+ * @brief (Additional) Gives back bytes given by imgst_space_alloc() (or
+ *        imgst_space_extend()) which were not published: to the holes, or
+ *        to the end of the file (then truncated) if they are the last ones
+ *        given there. To be called under the lock of the imgStore (at
+ *        least for reading).
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @param offset The position of the bytes.
+ * @param size Their number.
+ * @param in_hole Whether they were given in a hole.
+ */
+void imgst_space_release (struct imgst_file* imgst_file, uint64_t offset, uint64_t size, int in_hole);
+
 /**
  * @brief (Additional) Loads in the given buffer the image at position 'index' in the imgStore file.
  *
@@ -13,6 +13,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>  // for open
+#include <unistd.h> // for close
 #include <vips/vips.h>
 
 typedef int (*command)(int, char*[]);
@@ -22,7 +24,16 @@ typedef struct {
     const command command;
 } command_mapping;
 
-int write_disk_image(const char* img_id, const char* resolution_suffix, const char* image_buffer, size_t image_size);
+/* Image written on the disk by do_read_cmd, chunk by chunk */
+struct disk_image {
+    const char* img_id;
+    const char* resolution_suffix;
+    FILE* file;     // opened with the first chunk (NULL before)
+    char* filename; // its name (set with it)
+};
+
+int write_disk_chunk(const char* chunk, size_t size, void* arg);
+int close_disk_image(struct disk_image* image, int error);
 int read_disk_image(char** buffer, size_t* size, const char* filename);
 void create_name(const char* img_id, const char* resolution_suffix, char* filename, size_t name_length);
 
@@ -37,7 +48,7 @@ do_list_cmd (int args, char* argv[])
 
     struct imgst_file myfile;
 
-    M_EXIT_IF_ERR(do_open(filename, "rb", &myfile));
+    M_EXIT_IF_ERR(do_open(filename, "rbm", &myfile));
     do_list(&myfile, STDOUT);
 
     do_close(&myfile);
@@ -59,6 +70,7 @@ do_create_cmd (int args, char* argv[])
     uint16_t thumb_res_y =  64;
     uint16_t small_res_x = 256;
     uint16_t small_res_y = 256;
+    uint16_t variants    = VARIANTS_LAZY;
 
     // Parsing of command line arguments
     for (size_t i = 2; i < args; ++i) {
@@ -88,6 +100,8 @@ do_create_cmd (int args, char* argv[])
             } else {
                 return ERR_NOT_ENOUGH_ARGUMENTS;
             }
+        } else if (!strcmp(argv[i], "-eager")) {
+            variants = VARIANTS_EAGER;
         } else {
             return ERR_INVALID_ARGUMENT;
         }
@@ -102,7 +116,8 @@ do_create_cmd (int args, char* argv[])
             thumb_res_y,
             small_res_x,
             small_res_y
-        }
+        },
+        .variants = variants
     };
 
     struct imgst_file imgst_file = { .header = header };
@@ -137,12 +152,22 @@ help (int args, char* argv[])
     "          -small_res <X_RES> <Y_RES>: resolution for small images.\n"
     "                                  default value is 256x256\n"
     "                                  maximum value is 512x512\n"
+    "          -eager: creates the resized images when inserting the images,\n"
+    "                                  rather than when first reading them\n"
     "  read <imgstore_filename> <imgID> [original|orig|thumbnail|thumb|small]:\n"
     "      read an image from the imgStore and save it to a file.\n"
     "      default resolution is \"original\".\n"
+    "  read-many <imgstore_filename> <original|orig|thumbnail|thumb|small> <imgID> [<imgID> ...]:\n"
+    "      read several images from the imgStore at once and save them to files.\n"
     "  insert <imgstore_filename> <imgID> <filename>: insert a new image in the imgStore.\n"
+    "  insert-many <imgstore_filename> <imgID> <filename> [<imgID> <filename> ...]:\n"
+    "      insert several new images in the imgStore at once.\n"
     "  delete <imgstore_filename> <imgID>: delete image imgID from imgStore.\n"
-    "  gc <imgstore_filename> <tmp imgstore_filename>: performs garbage collecting on imgStore. Requires a temporary filename for copying the imgStore.\n");
+    "  gc <imgstore_filename> <tmp imgstore_filename> [<nb_threads>]: performs garbage collecting on imgStore. Requires a temporary filename for copying the imgStore.\n"
+    "      <nb_threads>: number of threads copying the images (default 1, maximum 64).\n"
+    "  compact <imgstore_filename>: removes the deleted images in place, without temporary copy.\n"
+    "  grow <imgstore_filename> <MAX_FILES>: raises the maximum number of files of the imgStore, in place.\n"
+    "                                  maximum value is 16777216\n");
     return 0;
 }
 
@@ -161,7 +186,7 @@ do_delete_cmd (int args, char* argv[])
     struct imgst_file myfile;
 
     // Reads the file
-    M_EXIT_IF_ERR(do_open(filename, "rb+", &myfile));
+    M_EXIT_IF_ERR(do_open(filename, "rb+m", &myfile));
 
     // Deletes the image which has ID 'imgID';
     int error_delete = do_delete(imgID, &myfile);
@@ -200,20 +225,75 @@ do_read_cmd (int args, char* argv[])
     if (strlen(img_id) == 0 || strlen(img_id) > MAX_IMG_ID) return ERR_INVALID_IMGID;
 
 
-    // Reads the buffer content from the imgStore
+    // Reads the image content from the imgStore
     struct imgst_file myfile;
-    M_EXIT_IF_ERR(do_open(imgstore_filename, "rb+", &myfile));
+    M_EXIT_IF_ERR(do_open(imgstore_filename, "rb+m", &myfile));
+
+    // ... and writes it on the disk chunk by chunk, with constant memory
+    struct disk_image image = { img_id, resolution_suffix, NULL, NULL };
+    int error = do_read_stream(img_id, resolution, READ_CHUNK_SIZE, write_disk_chunk, &image, &myfile);
+    if (error == ERR_NONE && image.file == NULL) error = write_disk_chunk("", 0, &image); // empty image
+
+    do_close(&myfile);
+    return close_disk_image(&image, error); // no partial image left on error
+}
 
-    char* image_buffer = NULL; // Location of the image content
-    uint32_t image_size = 0; // Image size
+/********************************************************************//**
+ * Reads several images from the imgStore.
+********************************************************************** */
+int
+do_read_many_cmd (int args, char* argv[])
+{
+    if (args < 4) return ERR_NOT_ENOUGH_ARGUMENTS;
 
-    int error = do_read(img_id, resolution, &image_buffer, &image_size, &myfile);
-    if (error == ERR_NONE) {
-        error = write_disk_image(img_id, resolution_suffix, image_buffer, (size_t) image_size);
+    // Command line arguments
+    const char* imgstore_filename = argv[1]; // name of the imgStore
+    const int resolution = resolution_atoi(argv[2]);
+    const char* resolution_suffix;
+    switch (resolution) {
+    case RES_ORIG: resolution_suffix = "orig"; break;
+    case RES_THUMB: resolution_suffix = "thumb"; break;
+    case RES_SMALL: resolution_suffix = argv[2]; break;
+    default: return ERR_RESOLUTIONS;
+    }
+    const size_t nb_images = (size_t) (args - 3);
+    for (size_t k = 0; k < nb_images; ++k) {
+        const char* img_id = argv[3 + k];
+        if (strlen(img_id) == 0 || strlen(img_id) > MAX_IMG_ID) return ERR_INVALID_IMGID;
+    }
+
+    struct img_to_read* images = calloc(nb_images, sizeof(struct img_to_read));
+    M_EXIT_IF_NULL(images, nb_images * sizeof(struct img_to_read));
+    for (size_t k = 0; k < nb_images; ++k) {
+        images[k].img_id = argv[3 + k];
+        images[k].resolution = resolution;
     }
 
+    // Reads the images from the imgStore, in the order of the file...
+    struct imgst_file myfile;
+    int error = do_open(imgstore_filename, "rb+m", &myfile);
+    if (error != ERR_NONE) {
+        FREE_POINTER(images);
+        return error;
+    }
+    error = do_read_batch(images, nb_images, &myfile);
     do_close(&myfile);
-    FREE_POINTER(image_buffer);
+
+    // ... and writes them on the disk; the first error is returned
+    for (size_t k = 0; k < nb_images; ++k) {
+        int error_image = images[k].error;
+        if (error_image == ERR_NONE) {
+            struct disk_image image = { images[k].img_id, resolution_suffix, NULL, NULL };
+            error_image = write_disk_chunk(images[k].buffer, images[k].size, &image);
+            error_image = close_disk_image(&image, error_image);
+        }
+        if (error_image != ERR_NONE) {
+            fprintf(stderr, "ERROR: %s: %s\n", images[k].img_id, ERR_MESSAGES[error_image]);
+            if (error == ERR_NONE) error = error_image;
+        }
+        FREE_POINTER(images[k].buffer);
+    }
+    FREE_POINTER(images);
 
     return error;
 }
@@ -232,20 +312,90 @@ do_insert_cmd (int args, char* argv[])
     if (strlen(img_id) == 0 || strlen(img_id) > MAX_IMG_ID) return ERR_INVALID_IMGID;
     const char* filename = argv[3]; // name of the image file
 
-    char* buffer = NULL;
-    size_t size = 0;
-    M_EXIT_IF_ERR(read_disk_image(&buffer, &size, filename));
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0) return ERR_IO;
 
-    // Inserts the buffer content in the imgStore
+    // Inserts the content of the image file in the imgStore, chunk by chunk
     struct imgst_file myfile;
-    M_EXIT_IF_ERR(do_open(imgstore_filename, "rb+", &myfile));
+    int error_insert = do_open(imgstore_filename, "rb+m", &myfile);
+    if (error_insert == ERR_NONE) {
+        error_insert = do_insert_fd(fd, img_id, &myfile);
+        // The image is inserted even if its resized images cannot be created (they are then created on its reads)
+        if (error_insert == ERR_NONE && myfile.header.variants == VARIANTS_EAGER) {
+            const int error_variants = do_create_variants(img_id, &myfile);
+            if (error_variants != ERR_NONE) {
+                fprintf(stderr, "WARNING: resized images of %s: %s\n", img_id, ERR_MESSAGES[error_variants]);
+            }
+        }
+        do_close(&myfile);
+    }
+    close(fd);
+
+    return error_insert;
+}
+
+/* Number of images read in memory and inserted together by insert-many */
+#define INSERT_MANY_CHUNK 256
+
+/********************************************************************//**
+ * Inserts several images in the imgStore.
+********************************************************************** */
+int
+do_insert_many_cmd (int args, char* argv[])
+{
+    if (args < 4) return ERR_NOT_ENOUGH_ARGUMENTS;
+    if (args % 2 != 0) return ERR_INVALID_ARGUMENT;
+
+    const char* imgstore_filename = argv[1]; // name of the imgStore
+    const size_t nb_images = (size_t) (args - 2) / 2;
+    for (size_t k = 0; k < nb_images; ++k) {
+        const char* img_id = argv[2 + 2 * k];
+        if (strlen(img_id) == 0 || strlen(img_id) > MAX_IMG_ID) return ERR_INVALID_IMGID;
+    }
+
+    struct img_to_insert images[INSERT_MANY_CHUNK];
+    char* buffers[INSERT_MANY_CHUNK];
 
-    int error_insert = do_insert(buffer, size, img_id, &myfile);
+    struct imgst_file myfile;
+    M_EXIT_IF_ERR(do_open(imgstore_filename, "rb+m", &myfile));
+
+    // Reads and inserts the images chunk by chunk; the first error is returned
+    int error = ERR_NONE;
+    for (size_t start = 0; start < nb_images; start += INSERT_MANY_CHUNK) {
+        const size_t count = nb_images - start < INSERT_MANY_CHUNK ? nb_images - start : INSERT_MANY_CHUNK;
+        size_t nb_read = 0;
+        int error_chunk = ERR_NONE;
+
+        for (; nb_read < count && error_chunk == ERR_NONE; ++nb_read) {
+            buffers[nb_read] = NULL;
+            images[nb_read].img_id = argv[2 + 2 * (start + nb_read)];
+            error_chunk = read_disk_image(&buffers[nb_read], &images[nb_read].size, argv[3 + 2 * (start + nb_read)]);
+            images[nb_read].buffer = buffers[nb_read];
+        }
+        if (error_chunk == ERR_NONE) {
+            error_chunk = do_insert_batch(images, count, &myfile);
+            for (size_t k = 0; k < count; ++k) {
+                if (images[k].error == ERR_NONE && myfile.header.variants == VARIANTS_EAGER) {
+                    const int error_variants = do_create_variants(images[k].img_id, &myfile);
+                    if (error_variants != ERR_NONE) {
+                        fprintf(stderr, "WARNING: resized images of %s: %s\n", images[k].img_id, ERR_MESSAGES[error_variants]);
+                    }
+                }
+                if (images[k].error != ERR_NONE) {
+                    fprintf(stderr, "ERROR: %s: %s\n", images[k].img_id, ERR_MESSAGES[images[k].error]);
+                    if (error == ERR_NONE) error = images[k].error;
+                }
+            }
+        }
+        if (error == ERR_NONE) error = error_chunk;
+
+        for (size_t k = 0; k < nb_read; ++k) FREE_POINTER(buffers[k]);
+        if (error_chunk != ERR_NONE) break;
+    }
 
     do_close(&myfile);
-    FREE_POINTER(buffer);
 
-    return error_insert;
+    return error;
 }
 
 /********************************************************************//**
@@ -255,41 +405,108 @@ int
 do_gc_cmd (int args, char* argv[])
 {
     if (args < 3) return ERR_NOT_ENOUGH_ARGUMENTS;
+    if (args < 4) return do_gbcollect(argv[1], argv[2]);
+
+    const uint32_t nb_threads = atouint32(argv[3]);
+    if (nb_threads == 0 || nb_threads > MAX_GC_THREADS) return ERR_INVALID_ARGUMENT;
+
+    return do_gbcollect_threads(argv[1], argv[2], nb_threads);
+}
+
+/********************************************************************//**
+ * Compacts the imgStore in place.
+********************************************************************** */
+int
+do_compact_cmd (int args, char* argv[])
+{
+    if (args < 2) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    struct imgst_file myfile;
+    M_EXIT_IF_ERR(do_open(argv[1], "rb+m", &myfile));
+
+    int error_compact = do_compact(&myfile);
+
+    do_close(&myfile);
+
+    return error_compact;
+}
+
+/********************************************************************//**
+ * Raises the maximum number of files of the imgStore.
+********************************************************************** */
+int
+do_grow_cmd (int args, char* argv[])
+{
+    if (args < 3) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    const char* imgstore_filename = argv[1];
+    const uint32_t max_files = atouint32(argv[2]);
+    if (max_files == 0 || max_files > MAX_GROWN_FILES) return ERR_MAX_FILES;
+
+    struct imgst_file myfile;
+    M_EXIT_IF_ERR(do_open(imgstore_filename, "rb+m", &myfile));
 
-    return do_gbcollect(argv[1], argv[2]);
+    int error_grow = do_grow(&myfile, max_files);
+    if (error_grow == ERR_NONE) {
+        print_header(&myfile.header);
+    }
+
+    do_close(&myfile);
+
+    return error_grow;
 }
 
 /**
- * @brief Writes the image on the disk (i.e. creates a new JPEG file).
+ * @brief Writes a chunk of the image on the disk (the first one creates a new JPEG file).
  *
- * @param img_id Image ID.
- * @param resolution_suffix ("thumb", "small", "orig").
- * @param image_buffer Buffer containing the image (bytes).
- * @param image_size Image size (in bytes).
+ * @param chunk The bytes of the chunk.
+ * @param size The number of bytes of the chunk.
+ * @param arg The image being written (struct disk_image).
  * @return Some error code. 0 if no error.
  */
 int
-write_disk_image(const char* img_id, const char* resolution_suffix, const char* image_buffer, size_t image_size)
+write_disk_chunk(const char* chunk, size_t size, void* arg)
 {
-    // Creates the image filename
-    size_t name_length = strlen(img_id) + 1 + strlen(resolution_suffix) + strlen(".jpg");
-    char* filename = calloc(name_length+1, 1);
-    M_EXIT_IF_NULL(filename, name_length+1);
-    create_name(img_id, resolution_suffix, filename, name_length);
-
-    // Opens the corresponding image file
-    FILE* image_file = fopen(filename, "wb");
-    FREE_POINTER(filename);
-    if (image_file == NULL) return ERR_IO;
-    
-    // Writes the content of the buffer to the image file
-    int error = ERR_NONE;
-    if (fwrite(image_buffer, 1, image_size, image_file) != image_size) {
-        error = ERR_IO;
+    struct disk_image* image = arg;
+
+    if (image->file == NULL) {
+        // Creates the image filename
+        size_t name_length = strlen(image->img_id) + 1 + strlen(image->resolution_suffix) + strlen(".jpg");
+        image->filename = calloc(name_length+1, 1);
+        M_EXIT_IF_NULL(image->filename, name_length+1);
+        create_name(image->img_id, image->resolution_suffix, image->filename, name_length);
+
+        // Opens the corresponding image file
+        image->file = fopen(image->filename, "wb");
+        if (image->file == NULL) {
+            FREE_POINTER(image->filename);
+            return ERR_IO;
+        }
     }
 
-    fclose(image_file);
+    // Writes the content of the chunk to the image file
+    if (size > 0 && fwrite(chunk, 1, size, image->file) != size) return ERR_IO;
+
+    return ERR_NONE;
+}
 
+/**
+ * @brief Closes the image file written by write_disk_chunk (if any); on
+ *        error, the file is removed, so that no partial image is left.
+ *
+ * @param image The image being written.
+ * @param error The error code of its writing so far.
+ * @return The given error code, or ERR_IO if the file cannot be closed.
+ */
+int
+close_disk_image(struct disk_image* image, int error)
+{
+    if (image->file != NULL) {
+        if (fclose(image->file) != 0 && error == ERR_NONE) error = ERR_IO;
+        image->file = NULL;
+        if (error != ERR_NONE) remove(image->filename);
+    }
+    FREE_POINTER(image->filename);
     return error;
 }
 
@@ -351,15 +568,19 @@ void create_name(const char* img_id, const char* resolution_suffix, char* filena
  */
 int main (int argc, char* argv[])
 {
-    size_t nb_commands = 7;
+    size_t nb_commands = 11;
     command_mapping commands[] = {
         {"help", help},
         {"list", do_list_cmd},
         {"create", do_create_cmd},
         {"read", do_read_cmd},
+        {"read-many", do_read_many_cmd},
         {"insert", do_insert_cmd},
+        {"insert-many", do_insert_many_cmd},
         {"delete", do_delete_cmd},
-        {"gc", do_gc_cmd}
+        {"gc", do_gc_cmd},
+        {"compact", do_compact_cmd},
+        {"grow", do_grow_cmd}
     };
 
     int ret = 0;
@@ -11,15 +11,69 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>    // for open
+#include <unistd.h>   // for close
+#include <pthread.h>
+#include <sys/stat.h> // for fstat
 #include <vips/vips.h>
 
 // ======================================================================
 static const char* s_listening_address = "http://localhost:8000";
 static struct imgst_file imgst_file;
+static struct imgst_compaction compaction; // (Additional) background compaction
+static uint64_t compaction_slice = 0;      // (Additional) bytes moved per slice (0: no compaction)
+static int compacting = 0;                 // (Additional) whether a worker runs a slice of the compaction
+static int compaction_restart = 0;         // (Additional) whether to start the compaction again after this slice
 
 // ======================================================================
 #define MAX_IMG_RES 10  // (Additional) max. size of an image resolution variable
 #define MAX_OFFSET 40   // (Additional) max. size of an image size variable
+#define POLL_MS 1000    // (Additional) max. time of one poll of the connections
+#define COMPACT_SLICE_MB 4 // (Additional) default number of MB moved by a slice of the compaction
+#define NB_WORKERS 2        // (Additional) default number of threads of the worker pool
+#define MAX_WORKERS 64      // (Additional) max. number of threads of the worker pool
+#define WORKER_QUEUE_SIZE 256 // (Additional) default max. number of jobs waiting for a worker
+#define WORKER_POLL_MS 5    // (Additional) max. time of one poll while connections wait for a job
+
+// ======================================================================
+#define JOB_RESIZE  0 // (Additional) creates the resized images of an image
+#define JOB_INSERT  1 // (Additional) inserts an image, from its temporary file
+#define JOB_DELETE  2 // (Additional) deletes an image
+#define JOB_COMPACT 3 // (Additional) runs a slice of the compaction
+
+/* (Additional) A job of the worker pool: an operation which takes the write
+ * lock of the imgStore, so that the event loop never waits for it */
+struct worker_job {
+    struct worker_job* next;
+    int kind;              // JOB_RESIZE, JOB_INSERT, JOB_DELETE or JOB_COMPACT
+    char img_id[MAX_IMG_ID+1];
+    int resolution;        // (JOB_RESIZE) resolution to create and send once done (RES_ORIG: all, after an insertion)
+    int fd;                // (JOB_INSERT) temporary file of the image, closed by the worker
+    unsigned long conn_id; // ID of the connection waiting for it (0: none, e.g. resize after an insertion)
+    int error;             // set by the worker
+    struct worker_job* next_resize; // (JOB_RESIZE) next resize queued or running (see find_resize)
+    struct worker_job* followers;   // (JOB_RESIZE) reads of the same image, answered along with this job
+};
+
+/* (Additional) Threads doing the resizes and the writes, so that the event loop never waits for them */
+struct worker_pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    struct worker_job* first; // jobs waiting for a worker (FIFO)
+    struct worker_job* last;
+    size_t nb_queued;         // number of those jobs
+    size_t max_queued;        // max. number of those jobs (queue depth)
+    struct worker_job* done;  // jobs done, to be answered or followed up by the event loop
+    struct worker_job* resizes; // resizes queued or running, so that the reads of an image share one
+    size_t nb_waiting;        // number of connections waiting for a job (only used by the event loop)
+    int stopping;             // whether the workers have to stop
+    size_t nb_threads;        // number of running workers
+    pthread_t threads[MAX_WORKERS];
+};
+static struct worker_pool pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER
+};
 
 // ======================================================================
 /**
@@ -81,6 +135,252 @@ static void refresh_page(struct mg_connection* nc, int error_cmd)
     }
 }
 
+// ======================================================================
+/**
+ * @brief (Additional) Runs a job, in a worker.
+ *
+ * @param job The job.
+ * @return Some error code. 0 if no error.
+ */
+static int run_job(struct worker_job* job)
+{
+    int error = ERR_NONE;
+    switch (job->kind) {
+    case JOB_INSERT:
+        error = do_insert_fd(job->fd, job->img_id, &imgst_file);
+        close(job->fd);
+        job->fd = -1;
+        break;
+    case JOB_DELETE: error = do_delete(job->img_id, &imgst_file); break;
+    // (the event loop does not touch the compaction until this slice is done)
+    case JOB_COMPACT: error = do_compact_step(&imgst_file, &compaction, compaction_slice); break;
+    // (a read creates only the resolution it asks for, an insertion all of them)
+    default: error = job->resolution != RES_ORIG ? do_create_resized(job->img_id, job->resolution, &imgst_file)
+                                                 : do_create_variants(job->img_id, &imgst_file);
+    }
+    return error;
+}
+
+// ======================================================================
+/**
+ * @brief (Additional) Frees a job, its temporary file if not inserted,
+ *        and its followers.
+ *
+ * @param job The job.
+ */
+static void free_job(struct worker_job* job)
+{
+    if (job->kind == JOB_INSERT && job->fd >= 0) close(job->fd);
+    while (job->followers != NULL) {
+        struct worker_job* follower = job->followers;
+        job->followers = follower->next;
+        free_job(follower);
+    }
+    free(job);
+}
+
+// ======================================================================
+/**
+ * @brief (Additional) Finds the resize, queued or running, which creates the
+ *        resolution of the given resize job (under the mutex of the pool).
+ *
+ * @param job The resize job.
+ * @return The resize found, NULL if none.
+ */
+static struct worker_job* find_resize(const struct worker_job* job)
+{
+    struct worker_job* resize = pool.resizes;
+    while (resize != NULL && (strcmp(resize->img_id, job->img_id)
+                              || (resize->resolution != job->resolution && resize->resolution != RES_ORIG))) {
+        resize = resize->next_resize;
+    }
+    return resize;
+}
+
+// ======================================================================
+/**
+ * @brief (Additional) Runs the queued jobs, one after the other, until the
+ *        pool is stopped. The jobs of connections, as well as the writes,
+ *        are then given back to the event loop (see answer_jobs).
+ *
+ * @param arg Unused.
+ */
+static void* pool_worker(void* arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&pool.mutex);
+    for (;;) {
+        while (pool.first == NULL && !pool.stopping) pthread_cond_wait(&pool.not_empty, &pool.mutex);
+        if (pool.stopping) break;
+
+        struct worker_job* job = pool.first;
+        pool.first = job->next;
+        if (pool.first == NULL) pool.last = NULL;
+        --pool.nb_queued;
+
+        // The imgStore is locked by the library: the event loop only waits
+        // (to read) while a worker holds the write lock, to store its result
+        pthread_mutex_unlock(&pool.mutex);
+        job->error = run_job(job);
+        pthread_mutex_lock(&pool.mutex);
+
+        // The reads coalesced with a resize are answered along with it
+        if (job->kind == JOB_RESIZE) {
+            struct worker_job** link = &pool.resizes;
+            while (*link != job) link = &(*link)->next_resize;
+            *link = job->next_resize;
+            while (job->followers != NULL) {
+                struct worker_job* follower = job->followers;
+                job->followers = follower->next;
+                follower->error = job->error;
+                follower->next = pool.done;
+                pool.done = follower;
+            }
+        }
+
+        if (job->conn_id != 0 || job->kind != JOB_RESIZE) {
+            job->next = pool.done;
+            pool.done = job;
+        } else {
+            if (job->error != ERR_NONE && job->error != ERR_FILE_NOT_FOUND) { // (the image may have been deleted since)
+                fprintf(stderr, "variants of %s: %s\n", job->img_id, ERR_MESSAGES[job->error]);
+            }
+            free_job(job);
+        }
+    }
+    pthread_mutex_unlock(&pool.mutex);
+    return NULL;
+}
+
+// ======================================================================
+/**
+ * @brief (Additional) Creates a job for the worker pool (see queue_job).
+ *
+ * @param kind The kind of job.
+ * @param img_id The ID of the image.
+ * @param conn_id The ID of the connection waiting for it (0: none).
+ * @return The job, NULL if out of memory.
+ */
+static struct worker_job* new_job(int kind, const char* img_id, unsigned long conn_id)
+{
+    struct worker_job* job = calloc(1, sizeof(struct worker_job));
+    if (job == NULL) return NULL;
+    job->kind = kind;
+    strncpy(job->img_id, img_id, MAX_IMG_ID);
+    job->fd = -1;
+    job->conn_id = conn_id;
+    return job;
+}
+
+// ======================================================================
+/**
+ * @brief (Additional) Queues a job for the worker pool. A resize of an image
+ *        already queued or running (in the same resolution, or in all of
+ *        them) is not queued again: it follows that one (single flight).
+ *
+ * @param job The job (freed if it cannot be queued).
+ * @return Some error code (ERR_FULL_IMGSTORE if the queue is full). 0 if no error.
+ */
+static int queue_job(struct worker_job* job)
+{
+    if (job == NULL) return ERR_OUT_OF_MEMORY;
+    const unsigned long conn_id = job->conn_id; // (a job without connection may be done and freed at once)
+
+    pthread_mutex_lock(&pool.mutex);
+    struct worker_job* resize = job->kind == JOB_RESIZE ? find_resize(job) : NULL;
+    const int full = resize == NULL && pool.nb_queued >= pool.max_queued;
+    if (resize != NULL) {
+        job->next = resize->followers;
+        resize->followers = job;
+    } else if (!full) {
+        if (pool.last == NULL) pool.first = job;
+        else pool.last->next = job;
+        pool.last = job;
+        ++pool.nb_queued;
+        if (job->kind == JOB_RESIZE) {
+            job->next_resize = pool.resizes;
+            pool.resizes = job;
+        }
+        pthread_cond_signal(&pool.not_empty);
+    }
+    pthread_mutex_unlock(&pool.mutex);
+
+    if (full) {
+        free_job(job);
+        return ERR_FULL_IMGSTORE;
+    }
+    if (conn_id != 0) ++pool.nb_waiting;
+    return ERR_NONE;
+}
+
+// ======================================================================
+/**
+ * @brief (Additional) Queues the job of a connection, which is answered once
+ *        done (see answer_jobs), or answers that the server is busy.
+ *
+ * @param nc The connection.
+ * @param job The job (freed if it cannot be queued).
+ * @return Whether the answer is deferred until a worker has done the job.
+ */
+static int queue_conn_job(struct mg_connection* nc, struct worker_job* job)
+{
+    const int error = queue_job(job);
+    if (error == ERR_FULL_IMGSTORE) {
+        mg_http_reply(nc, 503, "Retry-After: 1\r\n", "Error: too many requests being processed\n");
+    } else if (error != ERR_NONE) {
+        mg_error_msg(nc, error);
+    }
+    return error == ERR_NONE;
+}
+
+// ======================================================================
+/**
+ * @brief (Additional) Starts the worker pool.
+ *
+ * @param nb_threads The number of workers.
+ * @param max_queued The max. number of jobs waiting for a worker.
+ * @return Some error code. 0 if no error.
+ */
+static int start_workers(size_t nb_threads, size_t max_queued)
+{
+    pool.max_queued = max_queued;
+    while (pool.nb_threads < nb_threads) {
+        if (pthread_create(&pool.threads[pool.nb_threads], NULL, pool_worker, NULL) != 0) return ERR_OUT_OF_MEMORY;
+        ++pool.nb_threads;
+    }
+    return ERR_NONE;
+}
+
+// ======================================================================
+/**
+ * @brief (Additional) Stops the worker pool (the queued images are left
+ *        to be resized on their first read, the queued writes are dropped).
+ */
+static void stop_workers(void)
+{
+    pthread_mutex_lock(&pool.mutex);
+    pool.stopping = 1;
+    pthread_cond_broadcast(&pool.not_empty);
+    pthread_mutex_unlock(&pool.mutex);
+
+    for (size_t t = 0; t < pool.nb_threads; ++t) pthread_join(pool.threads[t], NULL);
+    pool.nb_threads = 0;
+
+    while (pool.first != NULL) {
+        struct worker_job* job = pool.first;
+        pool.first = job->next;
+        free_job(job);
+    }
+    pool.last = NULL;
+    pool.resizes = NULL; // (all queued, now freed)
+    while (pool.done != NULL) {
+        struct worker_job* job = pool.done;
+        pool.done = job->next;
+        free_job(job);
+    }
+}
+
 // ======================================================================
 /**
  * @brief Handles the 'list' call.
@@ -97,6 +397,110 @@ static void handle_list_call(struct mg_connection* nc)
     FREE_POINTER(json);
 }
 
+// ======================================================================
+/**
+ * @brief Sends an image stored in the given resolution, or the error given.
+ *        An image missing in this resolution (not created yet, or inserted
+ *        again since its resize) is first created by a worker: the event
+ *        loop never resizes.
+ *
+ * @param nc The connection.
+ * @param img_id The ID of the image.
+ * @param resolution The resolution.
+ * @param error The error of the read so far.
+ * @return Whether the answer is deferred until a worker has resized the image.
+ */
+static int send_image(struct mg_connection* nc, const char* img_id, int resolution, int error)
+{
+    // Maps the image at the given resolution: mg_send copies it from the page cache
+    // to the output buffer of the connection, with no intermediate buffer
+    struct img_view view;
+    int stored = 0;
+    if (error == ERR_NONE) error = do_read_stored_view(img_id, resolution, &view, &stored, &imgst_file);
+    if (error == ERR_NONE && !stored) {
+        if (resolution == RES_ORIG) {
+            error = ERR_IO; // (an original is always stored)
+        } else {
+            struct worker_job* job = new_job(JOB_RESIZE, img_id, nc->id);
+            if (job != NULL) job->resolution = resolution;
+            return queue_conn_job(nc, job);
+        }
+    }
+    if (error == ERR_NONE) {
+        mg_printf(nc, "HTTP/1.1 200 OK\r\nContent-Type: image/jpeg\r\nContent-Length: %" PRIu32 "\r\n\r\n", view.size);
+        mg_send(nc, view.data, view.size); // Sends the content of the image
+        do_release_view(&view);
+    } else {
+        mg_error_msg(nc, error);
+    }
+    return 0;
+}
+
+// ======================================================================
+/**
+ * @brief (Additional) Starts a compaction pass, once the slice run by a
+ *        worker (if any) is done.
+ */
+static void start_compaction(void)
+{
+    if (compacting) compaction_restart = 1;
+    else do_compact_start(&compaction);
+}
+
+// ======================================================================
+/**
+ * @brief (Additional) Follows up on the jobs done, and answers their connections.
+ *
+ * @param mgr The event manager, holding the connections.
+ */
+static void answer_jobs(struct mg_mgr* mgr)
+{
+    pthread_mutex_lock(&pool.mutex);
+    struct worker_job* done = pool.done;
+    pool.done = NULL;
+    pthread_mutex_unlock(&pool.mutex);
+
+    while (done != NULL) {
+        struct worker_job* job = done;
+        done = job->next;
+
+        // The resized images of an inserted image are created in the background
+        // (VARIANTS_EAGER), or on their first read if the queue of the workers is full
+        if (job->kind == JOB_INSERT && job->error == ERR_NONE && imgst_file.header.variants == VARIANTS_EAGER) {
+            struct worker_job* resize = new_job(JOB_RESIZE, job->img_id, 0);
+            if (resize != NULL) resize->resolution = RES_ORIG;
+            queue_job(resize);
+        }
+        // The space of a deleted image (if not shared) is reclaimed in the background
+        if (job->kind == JOB_DELETE && job->error == ERR_NONE && compaction_slice > 0) start_compaction();
+        if (job->kind == JOB_COMPACT) {
+            compacting = 0;
+            if (job->error != ERR_NONE) {
+                fprintf(stderr, "compaction: %s\n", ERR_MESSAGES[job->error]);
+                compaction.running = 0;
+            }
+            if (compaction_restart) {
+                compaction_restart = 0;
+                do_compact_start(&compaction);
+            }
+        }
+
+        if (job->conn_id != 0) {
+            // The connection may have been closed meanwhile
+            struct mg_connection* nc = mgr->conns;
+            while (nc != NULL && nc->id != job->conn_id) nc = nc->next;
+            if (nc != NULL && !nc->is_closing) {
+                int deferred = 0;
+                if (job->kind == JOB_RESIZE) deferred = send_image(nc, job->img_id, job->resolution, job->error);
+                else refresh_page(nc, job->error);
+                if (!deferred) nc->is_draining = 1;
+            }
+            --pool.nb_waiting;
+        }
+        free_job(job);
+    }
+}
+
 // ======================================================================
 /**
  * @brief Handles the 'read' call, i.e. downloads an image.
@@ -104,39 +508,30 @@ static void handle_list_call(struct mg_connection* nc)
  * @param nc The connection.
  * @param hm HTTP GET message. 
  *           Example: http://localhost:8000/imgStore/read?res=orig&img_id=pic1
+ * @return Whether the answer is deferred until a worker has resized the image.
  */
-static void handle_read_call(struct mg_connection* nc, struct mg_http_message* hm)
+static int handle_read_call(struct mg_connection* nc, struct mg_http_message* hm)
 {
     // Gets the parameter 'res' (image resolution)
     char res[MAX_IMG_RES+1] = "";
     int len = mg_http_get_var(&(hm->query), "res", res, MAX_IMG_RES+1); // length of the decoded variable
-    if (arg_tests(nc, len)) return;
+    if (arg_tests(nc, len)) return 0;
 
     int resolution = resolution_atoi(res); // The corresponding resolution code
     if (resolution == -1) {
         mg_error_msg(nc, ERR_RESOLUTIONS);
-        return;
+        return 0;
     }
 
     // Gets the parameter 'imd_id' (image ID)
     char img_id[2*MAX_IMG_ID] = "";
     len = mg_http_get_var(&(hm->query), "img_id", img_id, 2*MAX_IMG_ID);
-    if (arg_tests_img_id(nc, len)) return;
-
+    if (arg_tests_img_id(nc, len)) return 0;
 
-    char* image_buffer = NULL; // Location of the image content
-    uint32_t image_size = 0; // Image size
-
-    // Reads the image at the given resolution in the image buffer
-    int error_read = do_read(img_id, resolution, &image_buffer, &image_size, &imgst_file);
-    if (error_read == ERR_NONE) {
-        mg_printf(nc, "HTTP/1.1 200 OK\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n", image_size);
-        mg_send(nc, image_buffer, image_size); // Sends the content of the image
-    } else {
-        mg_error_msg(nc, error_read);
-    }
 
-    FREE_POINTER(image_buffer);
+    // Sends the image right away if it is stored in this resolution,
+    // otherwise once a worker has created it (see answer_jobs)
+    return send_image(nc, img_id, resolution, ERR_NONE);
 }
 
 // ======================================================================
@@ -146,17 +541,17 @@ static void handle_read_call(struct mg_connection* nc, struct mg_http_message* h
  * @param nc The connection.
  * @param hm HTTP GET message. 
  *           Example: http://localhost:8000/imgStore/delete?img_id=pic1
+ * @return Whether the answer is deferred until a worker has deleted the image.
  */
-static void handle_delete_call(struct mg_connection* nc, struct mg_http_message* hm)
+static int handle_delete_call(struct mg_connection* nc, struct mg_http_message* hm)
 {
     // Gets the parameter 'img_id' (image ID)
     char img_id[2*MAX_IMG_ID] = "";
     int len = mg_http_get_var(&(hm->query), "img_id", img_id, 2*MAX_IMG_ID);
-    if (arg_tests_img_id(nc, len)) return;
+    if (arg_tests_img_id(nc, len)) return 0;
 
-    // Deletes the image from the imgStore and refreshes the page
-    int error_delete = do_delete(img_id, &imgst_file);
-    refresh_page(nc, error_delete);
+    // Deletes the image from the imgStore (in a worker), then refreshes the page (see answer_jobs)
+    return queue_conn_job(nc, new_job(JOB_DELETE, img_id, nc->id));
 }
 
 // ======================================================================
@@ -166,68 +561,58 @@ static void handle_delete_call(struct mg_connection* nc, struct mg_http_message*
  * @param nc The connection.
  * @param hm HTTP POST message, containing the content of the image to insert.
  *           Example: http://localhost:8000/imgStore/insert?name=foret.jpg&offset=1234
+ * @return Whether the answer is deferred until a worker has inserted the image.
  */
-static void handle_insert_call(struct mg_connection* nc, struct mg_http_message* hm)
+static int handle_insert_call(struct mg_connection* nc, struct mg_http_message* hm)
 {
     /* Collects and stores the chunks of the image file in the '/tmp' directory */
     if (hm->body.len != 0) {
         mg_http_upload(nc, hm, "/tmp");
-        return;
+        return 0;
     }
 
     /* Decodes the additional arguments when the last chunk has been received */
     // Gets the parameter 'name' (image ID)
     char name[2*MAX_IMG_ID] = "";
     int len = mg_http_get_var(&(hm->query), "name", name, 2*MAX_IMG_ID);
-    if (arg_tests_img_id(nc, len)) return;
+    if (arg_tests_img_id(nc, len)) return 0;
 
     // Gets the parameter 'offset' (image size)
     char offset[MAX_OFFSET+1] = "";
     len = mg_http_get_var(&(hm->query), "offset", offset, MAX_OFFSET+1);
-    if (arg_tests(nc, len)) return;
+    if (arg_tests(nc, len)) return 0;
 
 
     /* Reads the temporary storage file in 'tmp' */
     // Creates the filename '/tmp/name'
-    char* tmp_name = calloc(strlen("/tmp/") + strlen(name), 1);
+    char* tmp_name = calloc(strlen("/tmp/") + strlen(name) + 1, 1);
     if (tmp_name == NULL) {
         mg_error_msg(nc, ERR_OUT_OF_MEMORY);
-        return;
+        return 0;
     }
     strcpy(tmp_name, "/tmp/");
     strcat(tmp_name, name);
 
     // Temporary storage file
-    FILE* tmp_file = fopen(tmp_name, "rb");
+    const int tmp_fd = open(tmp_name, O_RDONLY);
     FREE_POINTER(tmp_name);
-    if (tmp_file == NULL) {
+    if (tmp_fd < 0) {
         mg_error_msg(nc, ERR_IO);
-        return;
-    }
-
-
-    /* Inserts the image file in the buffer */
-    size_t size = atouint32(offset); // Image size
-    char* buffer = malloc(size+1); // Pointer to the raw image content
-    if (buffer == NULL) {
-        fclose(tmp_file);
-        mg_error_msg(nc, ERR_OUT_OF_MEMORY);
-        return;
+        return 0;
     }
-
-    size_t nb_ok = fread(buffer, 1, size, tmp_file);
-    fclose(tmp_file);
-    if (nb_ok != size) {
-        FREE_POINTER(buffer);
+    struct stat st;
+    if (fstat(tmp_fd, &st) != 0 || (uint64_t) st.st_size != atouint32(offset)) {
+        close(tmp_fd);
         mg_error_msg(nc, ERR_IO);
-        return;
+        return 0;
     }
 
-    /* Inserts the image in the imgStore and refreshes the page */
-    int error_insert = do_insert(buffer, size, name, &imgst_file);
-    refresh_page(nc, error_insert);
-
-    FREE_POINTER(buffer);
+    /* Inserts the image in the imgStore (in a worker), chunk by chunk from the file,
+     * then refreshes the page (see answer_jobs) */
+    struct worker_job* job = new_job(JOB_INSERT, name, nc->id);
+    if (job != NULL) job->fd = tmp_fd;
+    else close(tmp_fd);
+    return queue_conn_job(nc, job);
 }
 
 // ======================================================================
@@ -237,21 +622,23 @@ static void handle_insert_call(struct mg_connection* nc, struct mg_http_message*
  * @param nc The connection that received an event.
  * @param hm HTTP message.
  * @param ev_data Event-specific data.
+ * @return Whether the answer is deferred (see answer_jobs).
  */
-static void imgst_event_handler(struct mg_connection* nc, struct mg_http_message* hm, void* ev_data)
+static int imgst_event_handler(struct mg_connection* nc, struct mg_http_message* hm, void* ev_data)
 {   
     if (mg_http_match_uri(hm, "/imgStore/list") && !strncmp("GET", hm->method.ptr, 3)) {
         handle_list_call(nc);
     } else if (mg_http_match_uri(hm, "/imgStore/read") && !strncmp("GET", hm->method.ptr, 3)) {
-        handle_read_call(nc, hm);
+        return handle_read_call(nc, hm);
     } else if (mg_http_match_uri(hm, "/imgStore/delete") && !strncmp("GET", hm->method.ptr, 3)) {
-        handle_delete_call(nc, hm);
+        return handle_delete_call(nc, hm);
     } else if (mg_http_match_uri(hm, "/imgStore/insert") && !strncmp("POST", hm->method.ptr, 4)) {
-        handle_insert_call(nc, hm);
+        return handle_insert_call(nc, hm);
     } else {
         struct mg_http_serve_opts opts = { .root_dir = "." };
         mg_http_serve_dir(nc, hm, &opts);
     }
+    return 0;
 }
 
 // ======================================================================
@@ -267,11 +654,102 @@ static void event_handler(struct mg_connection* nc, int ev, void* ev_data, void*
 {
     if (ev == MG_EV_HTTP_MSG) {
         struct mg_http_message* hm = (struct mg_http_message*) ev_data;
-        imgst_event_handler(nc, hm, ev_data);
-        nc->is_draining = 1;
+        // (a deferred connection is closed once answered, see answer_jobs)
+        if (!imgst_event_handler(nc, hm, ev_data)) nc->is_draining = 1;
     }
 }
 
+// ======================================================================
+/**
+ * @brief (Additional) Sets the durability level given on the command line:
+ *        [none|sync|group <N_ops> <N_ms>] (default: none).
+ *
+ * @param argc Number of arguments after the imgStore filename.
+ * @param argv Those arguments.
+ * @param filename The imgStore filename.
+ * @param poll_ms Set to the max. time of one poll, for the group commit delay to be honored.
+ * @return Some error code. 0 if no error.
+ */
+static int set_durability(int argc, char* argv[], const char* filename, int* poll_ms)
+{
+    if (argc == 0 || !strcmp(argv[0], "none")) return ERR_NONE;
+
+    if (!strcmp(argv[0], "sync")) return do_set_durability(filename, DURABILITY_SYNC, 0, 0, &imgst_file);
+
+    if (strcmp(argv[0], "group")) return ERR_INVALID_ARGUMENT;
+    if (argc < 3) return ERR_NOT_ENOUGH_ARGUMENTS;
+    const uint32_t group_ops = atouint32(argv[1]);
+    const uint32_t group_ms = atouint32(argv[2]);
+    if (group_ms > 0 && group_ms < (uint32_t) *poll_ms) *poll_ms = (int) group_ms;
+
+    return do_set_durability(filename, DURABILITY_GROUP, group_ops, group_ms, &imgst_file);
+}
+
+// ======================================================================
+/**
+ * @brief (Additional) Sets the background compaction given on the command
+ *        line: [compact <N_MB>], the number of MB moved per poll (default:
+ *        COMPACT_SLICE_MB, 0 for no compaction).
+ *
+ * @param argc Number of arguments, from 'compact'.
+ * @param argv Those arguments.
+ * @return Some error code. 0 if no error.
+ */
+static int set_compaction(int argc, char* argv[])
+{
+    uint32_t slice_mb = COMPACT_SLICE_MB;
+    if (argc > 0) {
+        if (argc < 2) return ERR_NOT_ENOUGH_ARGUMENTS;
+        slice_mb = atouint32(argv[1]);
+        if (slice_mb == 0 && strcmp(argv[1], "0")) return ERR_INVALID_ARGUMENT;
+    }
+    compaction_slice = (uint64_t) slice_mb << 20;
+
+    // Reclaims the space of the images deleted before the server started
+    if (compaction_slice > 0) do_compact_start(&compaction);
+    return ERR_NONE;
+}
+
+// ======================================================================
+/**
+ * @brief (Additional) Starts the worker pool given on the command line:
+ *        [workers <N_threads> <N_jobs>], the number of workers and the max.
+ *        number of jobs waiting for them (default: NB_WORKERS and
+ *        WORKER_QUEUE_SIZE).
+ *
+ * @param argc Number of arguments, from 'workers'.
+ * @param argv Those arguments.
+ * @return Some error code. 0 if no error.
+ */
+static int set_workers(int argc, char* argv[])
+{
+    uint32_t nb_threads = NB_WORKERS;
+    uint32_t max_queued = WORKER_QUEUE_SIZE;
+    if (argc > 0) {
+        if (argc < 3) return ERR_NOT_ENOUGH_ARGUMENTS;
+        nb_threads = atouint32(argv[1]);
+        max_queued = atouint32(argv[2]);
+        if (nb_threads == 0 || nb_threads > MAX_WORKERS || max_queued == 0) return ERR_INVALID_ARGUMENT;
+    }
+    return start_workers(nb_threads, max_queued);
+}
+
+// ======================================================================
+/**
+ * @brief (Additional) Finds an option on the command line.
+ *
+ * @param argc Number of arguments.
+ * @param argv Those arguments.
+ * @param name Name of the option.
+ * @return Its position among the arguments, argc if absent.
+ */
+static int find_option(int argc, char* argv[], const char* name)
+{
+    int i = 2; // (after the imgStore filename)
+    while (i < argc && strcmp(argv[i], name)) ++i;
+    return i;
+}
+
 // ======================================================================
 int main (int argc, char* argv[])
 {
@@ -282,7 +760,22 @@ int main (int argc, char* argv[])
     } else {
 
         if (!VIPS_INIT(argv[0])) {
-            M_EXIT_IF_ERR(do_open(argv[1], "rb+", &imgst_file));
+            M_EXIT_IF_ERR(do_open(argv[1], "rb+m", &imgst_file));
+            // The options of the compaction and of the workers follow the ones of the durability
+            const int compact_arg = find_option(argc, argv, "compact");
+            const int workers_arg = find_option(argc, argv, "workers");
+            const int nb_durability_args = (compact_arg < workers_arg ? compact_arg : workers_arg) - 2;
+
+            int poll_ms = POLL_MS;
+            ret = set_durability(nb_durability_args, argv + 2, argv[1], &poll_ms);
+            if (ret == ERR_NONE) ret = set_compaction(argc - compact_arg, argv + compact_arg);
+            if (ret == ERR_NONE) ret = set_workers(argc - workers_arg, argv + workers_arg);
+            if (ret != ERR_NONE) {
+                stop_workers();
+                do_close(&imgst_file);
+                fprintf(stderr, "%s\n", ERR_MESSAGES[ret]);
+                return ret;
+            }
 
             // Start mongoose server
             struct mg_mgr mgr; // Event manager, that holds all active connections
@@ -295,10 +788,21 @@ int main (int argc, char* argv[])
             print_header(&(imgst_file.header));
 
             // Poll
-            for (;;) mg_mgr_poll(&mgr, 1000);
+            for (;;) {
+                // Does not wait long while connections wait for the workers, nor while compacting
+                mg_mgr_poll(&mgr, pool.nb_waiting > 0 || compacting ? WORKER_POLL_MS : poll_ms);
+                answer_jobs(&mgr);
+
+                const int error = do_group_commit(&imgst_file);
+                if (error != ERR_NONE) fprintf(stderr, "%s\n", ERR_MESSAGES[error]);
+
+                // The compaction runs a slice at a time in a worker, the requests being served meanwhile
+                if (!compacting && compaction.running) compacting = queue_job(new_job(JOB_COMPACT, "", 0)) == ERR_NONE;
+            }
 
             // Shutdown mongoose server
             mg_mgr_free(&mgr);
+            stop_workers();
 
             vips_shutdown();
 
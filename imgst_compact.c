@@ -0,0 +1,426 @@
+/**
+ * @file imgst_compact.c
+ * @brief imgStore library: do_compact implementation.
+ *
+ * In-place compaction: the stored images slide, in the order of their
+ * offsets, toward the beginning of the file, over the space of the deleted
+ * ones, and the file is truncated at the end. No second copy of the
+ * imgStore is needed.
+ *
+ * Crash safety: an image is only copied to free space, and the space it
+ * leaves is only reused once the metadata pointing to its new place is on
+ * the disk. Until then both copies are valid, so that the metadata on the
+ * disk is consistent at any time, whichever of its entries were written.
+ *
+ * A pass may be run in slices (see do_compact_step()), between which the
+ * imgStore stays usable: the sorted references to the images, and the
+ * copies whose metadata is not written yet, are kept from a slice to the
+ * next. The copies are kept out of the free space map meanwhile, so that
+ * nothing is written over them; if the imgStore changed between two
+ * slices, the copies of the images still there are committed, and the
+ * references are collected again (from the end of the compacted part).
+ */
+
+#define _DEFAULT_SOURCE // for fileno, ftruncate
+
+#include "imgStore.h"
+#include "freespace.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h> // for ftruncate
+
+/**
+ * @brief A reference from the metadata to a stored image.
+ */
+struct compact_ref {
+    uint64_t offset; // position of the image in the file
+    uint64_t to;     // its new position, once copied there
+    uint32_t size;   // its size
+    uint32_t slot;   // position of the metadata entry
+    int res;         // resolution
+};
+
+/**
+ * @brief The images copied but whose metadata is not on the disk yet.
+ */
+struct compact_batch {
+    size_t first;    // first reference of the batch (in the sorted references)
+    size_t end;      // past its last reference (all the images in between are rewritten)
+    uint64_t lowest; // lowest former offset of its images: the free space ends there
+};
+
+/**
+ * @brief What a pass keeps from a slice to the next.
+ */
+struct compact_state {
+    struct compact_ref* refs;   // references to the images, sorted by offset
+    size_t nb_refs;
+    size_t next;                // first reference not compacted yet
+    struct compact_batch batch; // copies whose metadata is not written yet
+    uint64_t changes;           // imgst_changes() at the end of the previous slice
+};
+
+/********************************************************************//**
+ * Compares two references by offset (for qsort).
+ */
+static int
+compare_ref (const void* a, const void* b)
+{
+    const uint64_t x = ((const struct compact_ref*) a)->offset;
+    const uint64_t y = ((const struct compact_ref*) b)->offset;
+    return (x > y) - (x < y);
+}
+
+/********************************************************************//**
+ * Collects the references of all the valid metadata entries to their images.
+ */
+static int
+collect_refs (const struct imgst_file* imgst_file, struct compact_ref** refs, size_t* nb_refs)
+{
+    *nb_refs = 0;
+    *refs = calloc((size_t) imgst_file->header.num_files * NB_RES + 1, sizeof(struct compact_ref));
+    if (*refs == NULL) return ERR_OUT_OF_MEMORY;
+
+    size_t max_refs = (size_t) imgst_file->header.num_files * NB_RES + 1;
+    for (size_t i = 0; i < imgst_file->header.max_files; ++i) {
+        const struct img_metadata* metadata = &imgst_file->metadata[i];
+        if (metadata->is_valid != NON_EMPTY) continue;
+
+        for (int res = 0; res < NB_RES; ++res) {
+            if (metadata->offset[res] == 0) continue;
+            if (*nb_refs == max_refs) { // num_files is not trusted
+                struct compact_ref* more = realloc(*refs, 2 * max_refs * sizeof(struct compact_ref));
+                if (more == NULL) return ERR_OUT_OF_MEMORY;
+                *refs = more;
+                max_refs *= 2;
+            }
+            (*refs)[(*nb_refs)++] = (struct compact_ref) {
+                .offset = metadata->offset[res], .to = metadata->offset[res], .size = metadata->size[res], .slot = (uint32_t) i, .res = res
+            };
+        }
+    }
+
+    qsort(*refs, *nb_refs, sizeof(struct compact_ref), compare_ref);
+    return ERR_NONE;
+}
+
+/********************************************************************//**
+ * Position of the first reference at 'offset' or after it (binary search).
+ */
+static size_t
+find_ref (const struct compact_ref* refs, size_t nb_refs, uint64_t offset)
+{
+    size_t low = 0;
+    size_t high = nb_refs;
+    while (low < high) {
+        const size_t mid = low + (high - low) / 2;
+        if (refs[mid].offset < offset) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+/********************************************************************//**
+ * Whether one of the images overlaps the bytes [offset, offset + size[.
+ */
+static int
+overlaps_ref (const struct compact_ref* refs, size_t nb_refs, uint64_t offset, uint64_t size)
+{
+    const size_t r = find_ref(refs, nb_refs, offset);
+    if (r > 0 && refs[r - 1].offset + refs[r - 1].size > offset) return 1;
+    return r < nb_refs && refs[r].offset < offset + size;
+}
+
+/********************************************************************//**
+ * Makes the images of the batch, then the metadata pointing to them,
+ * durable: from then on, their former space is free. The metadata is
+ * only updated in memory once the images are on the disk, as mapped
+ * metadata may be written back at any time.
+ */
+static int
+commit_batch (struct imgst_file* imgst_file, struct compact_ref* refs, struct compact_batch* batch)
+{
+    if (batch->first == batch->end) return ERR_NONE;
+
+    M_EXIT_IF_ERR(do_sync(imgst_file));
+    for (size_t r = batch->first; r < batch->end; ++r) {
+        imgst_file->metadata[refs[r].slot].offset[refs[r].res] = refs[r].to;
+    }
+    for (size_t r = batch->first; r < batch->end; ++r) {
+        M_EXIT_IF_ERR(update_metadata(imgst_file, refs[r].slot));
+    }
+    M_EXIT_IF_ERR(commit_updates(imgst_file));
+    M_EXIT_IF_ERR(do_sync(imgst_file));
+
+    // The former places are free, once for the references to the same image
+    for (size_t r = batch->first; r < batch->end; ++r) {
+        if (r == batch->first || refs[r].offset != refs[r - 1].offset) {
+            M_EXIT_IF_ERR(freespace_release(imgst_file, refs[r].offset, refs[r].size));
+        }
+    }
+    for (size_t r = batch->first; r < batch->end; ++r) refs[r].offset = refs[r].to;
+
+    batch->first = batch->end;
+    batch->lowest = UINT64_MAX;
+    return ERR_NONE;
+}
+
+/********************************************************************//**
+ * Copies the image (shared by the references [first, end[) from 'from' to
+ * 'to', which is kept out of the free space until the copy is committed.
+ */
+static int
+move_image (struct imgst_file* imgst_file, struct compact_ref* refs, size_t first, size_t end,
+            uint64_t from, uint64_t to, char* buffer)
+{
+    const int fd = fileno(imgst_file->file);
+    M_EXIT_IF_ERR(copy_range(fd, fd, from, to, refs[first].size, buffer));
+    M_EXIT_IF_ERR(freespace_reserve(imgst_file, to, refs[first].size));
+
+    for (size_t r = first; r < end; ++r) refs[r].to = to;
+    return ERR_NONE;
+}
+
+/********************************************************************//**
+ * Frees what a pass keeps from a slice to the next.
+ */
+static void
+free_state (struct imgst_compaction* compaction)
+{
+    if (compaction->state == NULL) return;
+
+    free(compaction->state->refs);
+    FREE_POINTER(compaction->state);
+}
+
+/********************************************************************//**
+ * Sets the references of the next slice: the first one not compacted is
+ * the first one after the end of the compacted part.
+ */
+static void
+set_refs (struct compact_state* state, struct compact_ref* refs, size_t nb_refs, uint64_t cursor)
+{
+    free(state->refs);
+    state->refs = refs;
+    state->nb_refs = nb_refs;
+    state->next = find_ref(refs, nb_refs, cursor);
+    state->batch = (struct compact_batch) { state->next, state->next, UINT64_MAX };
+}
+
+/********************************************************************//**
+ * Brings the state of the pass up to date with an imgStore changed since
+ * the previous slice: the copies of the images still there (neither
+ * deleted, nor replaced, nor overwritten by new ones) are committed, the
+ * others dropped, then the references are collected again.
+ */
+static int
+refresh_state (struct imgst_file* imgst_file, struct imgst_compaction* compaction)
+{
+    struct compact_state* state = compaction->state;
+    struct compact_ref* refs = NULL;
+    size_t nb_refs = 0;
+    int ret = collect_refs(imgst_file, &refs, &nb_refs);
+
+    struct compact_batch* batch = &state->batch;
+    size_t kept = batch->first;
+    for (size_t r = batch->first; ret == ERR_NONE && r < batch->end; ++r) {
+        const struct compact_ref* ref = &state->refs[r];
+        const struct img_metadata* metadata = &imgst_file->metadata[ref->slot];
+        if (metadata->is_valid != NON_EMPTY || metadata->offset[ref->res] != ref->offset
+            || metadata->size[ref->res] != ref->size || overlaps_ref(refs, nb_refs, ref->to, ref->size)) continue;
+
+        // Its collected reference moves with it
+        for (size_t n = find_ref(refs, nb_refs, ref->offset); n < nb_refs && refs[n].offset == ref->offset; ++n) {
+            if (refs[n].slot == ref->slot && refs[n].res == ref->res) refs[n].to = ref->to;
+        }
+        state->refs[kept++] = *ref;
+    }
+    batch->end = kept;
+    if (ret == ERR_NONE) ret = commit_batch(imgst_file, state->refs, batch);
+
+    // The former places may still be used by new images (de-duplicated): the free space is built again
+    freespace_free(imgst_file);
+
+    if (ret != ERR_NONE) {
+        free(refs);
+        return ret;
+    }
+    for (size_t n = 0; n < nb_refs; ++n) refs[n].offset = refs[n].to;
+    qsort(refs, nb_refs, sizeof(struct compact_ref), compare_ref);
+    set_refs(state, refs, nb_refs, compaction->cursor);
+    return ERR_NONE;
+}
+
+/********************************************************************//**
+ * Ends a compaction pass: truncates the file after the last image (or the
+ * metadata), and records the new version if anything changed.
+ */
+static int
+finish_pass (struct imgst_file* imgst_file, struct imgst_compaction* compaction, uint64_t table_end)
+{
+    const uint64_t new_end = compaction->cursor > table_end ? compaction->cursor : table_end;
+
+    // Inserted images, as the copies of a pass, are at the end of the file
+    uint64_t file_end = 0;
+    M_EXIT_IF_ERR(get_file_end(imgst_file, &file_end));
+    if (new_end < file_end) compaction->changed = 1;
+
+    if (compaction->changed) {
+        ++imgst_file->header.imgst_version;
+        M_EXIT_IF_ERR(update_header(imgst_file));
+        M_EXIT_IF_ERR(commit_updates(imgst_file));
+        M_EXIT_IF_ERR(do_sync(imgst_file));
+    }
+    if (new_end < file_end && ftruncate(fileno(imgst_file->file), (off_t) new_end) != 0) return ERR_IO;
+
+    compaction->running = 0;
+    return ERR_NONE;
+}
+
+// See imgStore.h
+void do_compact_start (struct imgst_compaction* compaction)
+{
+    if (compaction == NULL) return;
+
+    free_state(compaction);
+    compaction->cursor = sizeof(struct imgst_header);
+    compaction->changed = 0;
+    compaction->running = 1;
+}
+
+/********************************************************************//**
+ * Body of do_compact_step(), under the write lock.
+ */
+static int
+compact_step (struct imgst_file* imgst_file, struct imgst_compaction* compaction, uint64_t max_bytes)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->file);
+    M_REQUIRE_NON_NULL(imgst_file->metadata);
+    M_REQUIRE_NON_NULL(compaction);
+    if (imgst_file->read_only) return ERR_IO;
+    if (!compaction->running) return ERR_NONE;
+
+    // The metadata table stays where it is: images are placed before or after it
+    const uint64_t table_start = get_metadata_offset(&imgst_file->header);
+    const uint64_t table_end = table_start + (uint64_t) imgst_file->header.max_files * sizeof(struct img_metadata);
+
+    // Everything is written with the file descriptor
+    if (fflush(imgst_file->file) != 0) return ERR_IO;
+
+    // The references are collected by the first slice, and again if the imgStore changed since the previous one
+    char* buffer = malloc(COPY_BUFFER_SIZE);
+    int ret = buffer == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+    if (ret == ERR_NONE && compaction->state == NULL) {
+        struct compact_ref* refs = NULL;
+        size_t nb_refs = 0;
+        compaction->state = calloc(1, sizeof(struct compact_state));
+        ret = compaction->state == NULL ? ERR_OUT_OF_MEMORY : collect_refs(imgst_file, &refs, &nb_refs);
+        if (ret == ERR_NONE) set_refs(compaction->state, refs, nb_refs, compaction->cursor);
+        else free(refs);
+    } else if (ret == ERR_NONE && (imgst_changes(imgst_file) == UINT64_MAX || imgst_changes(imgst_file) != compaction->state->changes)) {
+        ret = refresh_state(imgst_file, compaction);
+    }
+    if (ret != ERR_NONE) {
+        free_state(compaction);
+        free(buffer);
+        return ret;
+    }
+
+    struct compact_state* state = compaction->state;
+    struct compact_ref* refs = state->refs;
+    const size_t nb_refs = state->nb_refs;
+    struct compact_batch* batch = &state->batch;
+    size_t first = state->next;
+    uint64_t cursor = compaction->cursor; // first byte of the free space
+    uint64_t nb_moved = 0;
+    while (ret == ERR_NONE && first < nb_refs && nb_moved < max_bytes) {
+        // References to the same image (de-duplicated ones) are moved together
+        size_t end = first + 1;
+        while (end < nb_refs && refs[end].offset == refs[first].offset) ++end;
+        const uint64_t from = refs[first].offset;
+        const uint32_t size = refs[first].size;
+
+        uint64_t to = cursor;
+        if (to < table_end && to + size > table_start) to = table_end;
+
+        if (to >= from) {
+            to = from; // already in place
+        } else {
+            // The free space ends at the former place of the images of the batch
+            if (to + size > batch->lowest) ret = commit_batch(imgst_file, refs, batch);
+
+            uint64_t source = from;
+            if (ret == ERR_NONE && to + size > from) {
+                // Overlapping its own place: goes through the end of the file first
+                // (which may hold the former place of an image of the batch)
+                uint64_t file_end = 0;
+                ret = commit_batch(imgst_file, refs, batch);
+                if (ret == ERR_NONE) ret = get_file_end(imgst_file, &file_end);
+                if (ret == ERR_NONE) ret = move_image(imgst_file, refs, first, end, source, file_end, buffer);
+                batch->first = first;
+                batch->end = end;
+                if (ret == ERR_NONE) ret = commit_batch(imgst_file, refs, batch);
+                source = file_end;
+            }
+            if (ret == ERR_NONE) {
+                ret = move_image(imgst_file, refs, first, end, source, to, buffer);
+                if (batch->first == batch->end) batch->first = first;
+                batch->end = end;
+                if (source < batch->lowest) batch->lowest = source;
+                nb_moved += size;
+                compaction->changed = 1;
+            }
+        }
+
+        if (ret == ERR_NONE) cursor = to + size;
+        first = end;
+    }
+    free(buffer);
+
+    // The copies of the slice stay in the batch (their former places are still valid) until the end of the pass
+    if (ret == ERR_NONE) {
+        compaction->cursor = cursor;
+        state->next = first;
+        if (first == nb_refs) {
+            ret = commit_batch(imgst_file, refs, batch);
+            if (ret == ERR_NONE) ret = finish_pass(imgst_file, compaction, table_end);
+        }
+    }
+
+    if (ret != ERR_NONE || !compaction->running) {
+        // The end of the file may be truncated (or the copies of the batch dropped)
+        freespace_free(imgst_file);
+        free_state(compaction);
+    } else {
+        state->changes = imgst_changes(imgst_file);
+    }
+    return ret;
+}
+
+// See imgStore.h
+int do_compact_step (struct imgst_file* imgst_file, struct imgst_compaction* compaction, uint64_t max_bytes)
+{
+    // The images are moved into the gaps: no insertion may be writing there
+    imgst_space_exclusive_begin(imgst_file);
+    imgst_write_lock(imgst_file);
+    const int ret = compact_step(imgst_file, compaction, max_bytes);
+    imgst_unlock(imgst_file);
+    imgst_space_exclusive_end(imgst_file);
+    return ret;
+}
+
+// See imgStore.h
+int do_compact (struct imgst_file* imgst_file)
+{
+    struct imgst_compaction compaction = { .state = NULL };
+    do_compact_start(&compaction);
+
+    int ret = ERR_NONE;
+    while (ret == ERR_NONE && compaction.running) {
+        ret = do_compact_step(imgst_file, &compaction, UINT64_MAX);
+    }
+    return ret;
+}
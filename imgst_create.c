@@ -4,6 +4,8 @@
  */
 
 #include "imgStore.h"
+#include "index.h"
+#include "journal.h"
 #include "util.h"
 
 #include <stdio.h>
@@ -16,9 +18,19 @@ int do_create (const char* imgst_filename, struct imgst_file * imgst_file)
     M_REQUIRE_NON_NULL(imgst_filename);
     M_REQUIRE_NON_NULL(imgst_file);
 
+    imgst_file->map = NULL;
+    imgst_file->map_size = 0;
+    imgst_file->read_only = 0;
+    imgst_file->journal = NULL;
+    imgst_file->freespace = NULL;
+    imgst_file->lock = NULL;
+
     // Sets header fields
     imgst_file->header.imgst_version = 0;
     imgst_file->header.num_files = 0;
+    // v1 layout (metadata right after the header) unless too large for it, e.g. when garbage collecting a grown imgStore
+    imgst_file->header.format = imgst_file->header.max_files > MAX_MAX_FILES ? IMGST_FORMAT_V2 : IMGST_FORMAT_V1;
+    imgst_file->header.metadata_offset = imgst_file->header.format == IMGST_FORMAT_V2 ? sizeof(struct imgst_header) : 0;
     // Sets the DB header name
     strncpy(imgst_file->header.imgst_name, CAT_TXT, MAX_IMGST_NAME);
     imgst_file->header.imgst_name[MAX_IMGST_NAME] = '\0';
@@ -34,6 +46,13 @@ int do_create (const char* imgst_filename, struct imgst_file * imgst_file)
     imgst_file->metadata = metadata;
 
 
+    // A journal of a former imgStore of the same name must not be replayed in this one
+    char* journal = journal_filename(imgst_filename);
+    if (journal != NULL) {
+        remove(journal);
+        FREE_POINTER(journal);
+    }
+
     // Creates the binary file on which will be written the DB
     imgst_file->file = fopen(imgst_filename, "wb+");
     if (NULL == imgst_file->file) {
@@ -46,11 +65,22 @@ int do_create (const char* imgst_filename, struct imgst_file * imgst_file)
     nb_ok       += fwrite(imgst_file->metadata, sizeof(struct img_metadata), imgst_file->header.max_files, imgst_file->file);
 
     printf("%zu item(s) written\n", nb_ok); // number of items effectively written on the disk
-    if (nb_ok != 1 + imgst_file->header.max_files) {
+    // (then flushed: everything else is written at explicit offsets, with the file descriptor)
+    if (nb_ok != 1 + imgst_file->header.max_files || fflush(imgst_file->file) != 0) {
         CLOSE_FILE(imgst_file->file);
         FREE_POINTER(imgst_file->metadata);
         return ERR_IO;
     }
 
+    // Builds the (empty) in-memory index of the metadata, and the lock of the readers and writers
+    int error_index = index_build(imgst_file);
+    if (error_index == ERR_NONE) error_index = imgst_lock_init(imgst_file);
+    if (error_index != ERR_NONE) {
+        CLOSE_FILE(imgst_file->file);
+        FREE_POINTER(imgst_file->metadata);
+        index_free(imgst_file);
+        return error_index;
+    }
+
     return ERR_NONE;
 }
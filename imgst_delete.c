@@ -3,13 +3,112 @@
  * @brief imgStore library: do_delete implementation.
  */
 
+#define _GNU_SOURCE // for fileno, fallocate
+
 #include "imgStore.h"
+#include "freespace.h"
+#include "index.h"
+#include "journal.h"
+#include "util.h"
 
 #include <stdio.h>
-#include <string.h> // for strncmp
+#include <stdlib.h> // for calloc
+#include <stdint.h> // for SIZE_MAX
+#include <errno.h>
+#include <fcntl.h>  // for fallocate
 
-// See imgStore.h
-int do_delete(const char * img_id, struct imgst_file * imgst_file)
+/********************************************************************//**
+ * Frees the disk blocks of an image no longer referenced: its bytes read
+ * as zeros, and the file keeps its size (the other offsets stay valid).
+ * Nothing is done where the filesystem does not support it; any other
+ * failure is an I/O error (the blocks are then only freed by compaction).
+ */
+static int
+punch_hole (struct imgst_file* imgst_file, uint64_t offset, uint64_t size)
+{
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    // The deletion must be durable before the image is lost
+    if (imgst_file->journal != NULL) M_EXIT_IF_ERR(journal_flush(imgst_file, 1));
+    if (fflush(imgst_file->file) != 0) return ERR_IO;
+
+    if (fallocate(fileno(imgst_file->file), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) offset, (off_t) size) != 0
+        && errno != EOPNOTSUPP) {
+        return ERR_IO;
+    }
+#else
+    (void) imgst_file;
+    (void) offset;
+    (void) size;
+#endif
+    return ERR_NONE;
+}
+
+/********************************************************************//**
+ * Whether one of the valid duplicates of the deleted entry at position
+ * 'index' points to the image at 'offset'. Duplicates share their
+ * resized images since they are generated once for all of them, but not
+ * always the ones generated before (each one its own). Linear in the
+ * number of duplicates, which are all looked at when none shares it.
+ */
+static int
+is_shared (const struct imgst_file* imgst_file, size_t index, uint64_t offset, int* shared)
+{
+    *shared = 0;
+    const uint32_t refs = index_blob_refs(imgst_file, imgst_file->metadata[index].SHA);
+    if (refs == 0) return ERR_NONE;
+
+    size_t* duplicates = calloc(refs, sizeof(size_t));
+    M_EXIT_IF_NULL(duplicates, refs * sizeof(size_t));
+    const size_t nb_duplicates = index_find_all_sha(imgst_file, imgst_file->metadata[index].SHA, duplicates, refs);
+
+    for (size_t d = 0; d < nb_duplicates && !*shared; ++d) {
+        for (int res = 0; res < NB_RES; ++res) {
+            *shared |= imgst_file->metadata[duplicates[d]].offset[res] == offset;
+        }
+    }
+    FREE_POINTER(duplicates);
+    return ERR_NONE;
+}
+
+/********************************************************************//**
+ * Gives the images of the deleted entry at position 'index' (already
+ * removed from the index) back to the free space, and their blocks back
+ * to the filesystem, unless one of its duplicates (see dedup.c) shares them.
+ * The deletion is committed: this is done as far as possible, an image
+ * not given back being only left to compaction.
+ */
+static void
+release_unshared (struct imgst_file* imgst_file, size_t index)
+{
+    const struct img_metadata* deleted = &imgst_file->metadata[index];
+
+    // Only its duplicates (same SHA) may share its images: usually none, or all of them,
+    // so that the first one found usually tells (the others are only looked at otherwise)
+    size_t duplicate = 0;
+    const int has_duplicate = index_find_sha(imgst_file, deleted->SHA, index, &duplicate) == ERR_NONE;
+
+    for (int res = 0; res < NB_RES; ++res) {
+        const uint64_t offset = deleted->offset[res];
+        if (offset == 0) continue;
+        if (has_duplicate && imgst_file->metadata[duplicate].offset[res] == offset) continue;
+
+        // Not known to be unshared: kept
+        int shared = 0;
+        if (has_duplicate && is_shared(imgst_file, index, offset, &shared) != ERR_NONE) continue;
+        if (!shared && freespace_release(imgst_file, offset, deleted->size[res]) == ERR_NONE) {
+            const int error = punch_hole(imgst_file, offset, deleted->size[res]);
+            if (error != ERR_NONE) {
+                fprintf(stderr, "WARNING: disk blocks of %s not freed: %s\n", deleted->img_id, ERR_MESSAGES[error]);
+            }
+        }
+    }
+}
+
+/********************************************************************//**
+ * Body of do_delete(), under the write lock.
+ */
+static int
+delete_image (const char* img_id, struct imgst_file* imgst_file)
 {
     M_REQUIRE_NON_NULL(img_id);
     M_REQUIRE_NON_NULL(imgst_file);
@@ -18,15 +117,11 @@ int do_delete(const char * img_id, struct imgst_file * imgst_file)
 
     // ====================================== METADATA =====================================================
     // Finds the reference of the image in the metadata to be deleted and invalidates it
-    size_t index = -1;
-    for (size_t i = 0; index == -1 && i < imgst_file->header.max_files; ++i) {
-        if (!strncmp(imgst_file->metadata[i].img_id, img_id, MAX_IMGST_NAME) // the image has the same ID
-            && imgst_file->metadata[i].is_valid == NON_EMPTY) { // this image is not already erased
-            index = i;
-            imgst_file->metadata[i].is_valid = EMPTY; // invalidates the reference
-        }
-    }
-    if (index == -1) return ERR_FILE_NOT_FOUND; // The reference does not exist
+    size_t index = 0;
+    M_EXIT_IF_ERR(index_find_id(imgst_file, img_id, SIZE_MAX, &index)); // The reference may not exist
+
+    index_remove(imgst_file, index);
+    imgst_file->metadata[index].is_valid = EMPTY; // invalidates the reference
 
     M_EXIT_IF_ERR(update_metadata(imgst_file, index));
 
@@ -36,6 +131,18 @@ int do_delete(const char * img_id, struct imgst_file * imgst_file)
 
     // Writes the updated header on the disk
     M_EXIT_IF_ERR(update_header(imgst_file));
+    M_EXIT_IF_ERR(commit_updates(imgst_file));
 
+    // Its images leave holes for the next ones, and free their disk blocks now
+    release_unshared(imgst_file, index);
     return ERR_NONE;
-}
\ No newline at end of file
+}
+
+// See imgStore.h
+int do_delete(const char * img_id, struct imgst_file * imgst_file)
+{
+    imgst_write_lock(imgst_file);
+    const int ret = delete_image(img_id, imgst_file);
+    imgst_unlock(imgst_file);
+    return ret;
+}
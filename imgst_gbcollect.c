@@ -1,25 +1,264 @@
 /**
  * @file imgst_gbcollect.c
  * @brief imgStore library: do_gbcollect implementation.
+ *
+ * The stored images (in all their resolutions) are copied byte for byte,
+ * with their metadata, into a new imgStore: nothing is decoded, hashed
+ * nor resized again. Images sharing their content (see dedup.c) still
+ * share it in the new imgStore.
+ *
+ * The copy is planned as a list of live extents (original offset, new
+ * offset, size), merged into contiguous runs, which several threads copy
+ * in the kernel when possible.
  */
 
+#define _DEFAULT_SOURCE // for fileno
+
 #include "imgStore.h"
-#include "image_content.h"
+#include "index.h"
 #include "util.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h> // for memcpy
+#include <fcntl.h>    // for open
+#include <unistd.h>   // for close
+#include <pthread.h>
+
+#define GC_CHUNK_SIZE (8 << 20) // max. number of bytes copied by a thread at once
+
+/**
+ * @brief A live extent of the original imgStore, and its new position.
+ */
+struct gc_extent {
+    uint64_t from; // offset in the original imgStore
+    uint64_t to;   // offset in the new imgStore
+    uint64_t size; // number of bytes
+};
+
+/**
+ * @brief The plan of the copy: the live extents in the order of the new
+ *        imgStore, and a hash table from their original offsets to them.
+ */
+struct gc_plan {
+    struct gc_extent* extents;
+    size_t nb_extents;
+    size_t* table;   // position in 'extents' plus one (0 if the bucket is empty)
+    size_t capacity; // number of buckets (a power of two)
+};
+
+/********************************************************************//**
+ * Hash of an offset (Fibonacci hashing).
+ */
+static size_t
+hash_offset (uint64_t offset)
+{
+    return (size_t) ((offset * 11400714819323198485ULL) >> 20);
+}
+
+/********************************************************************//**
+ * Returns the new offset of the extent at offset 'from' in the original
+ * imgStore, appending it to the plan (at offset 'end' in the new one) if
+ * not planned yet.
+ */
+static uint64_t
+plan_extent (struct gc_plan* plan, uint64_t from, uint32_t size, uint64_t* end)
+{
+    size_t bucket = hash_offset(from) & (plan->capacity - 1);
+    while (plan->table[bucket] != 0) {
+        const struct gc_extent* extent = &plan->extents[plan->table[bucket] - 1];
+        if (extent->from == from) return extent->to; // shared content: copied once
+        bucket = (bucket + 1) & (plan->capacity - 1);
+    }
+
+    struct gc_extent* extent = &plan->extents[plan->nb_extents++];
+    extent->from = from;
+    extent->to = *end;
+    extent->size = size;
+    plan->table[bucket] = plan->nb_extents;
+    *end += size;
+    return extent->to;
+}
+
+/********************************************************************//**
+ * Builds the plan of the copy and the metadata of the new imgStore:
+ * the valid images in the order of the original metadata, each with
+ * its original, small and thumbnail resolutions, one after the other.
+ */
+static int
+build_plan (const struct imgst_file* original, struct imgst_file* temp, uint64_t start, struct gc_plan* plan)
+{
+    size_t nb_valid = 0;
+    for (size_t i = 0; i < original->header.max_files; ++i) {
+        if (original->metadata[i].is_valid == NON_EMPTY) ++nb_valid;
+    }
+
+    const size_t max_extents = nb_valid * NB_RES;
+    plan->nb_extents = 0;
+    plan->capacity = 1;
+    while (plan->capacity < 2 * max_extents) plan->capacity *= 2;
+    plan->extents = calloc(max_extents > 0 ? max_extents : 1, sizeof(struct gc_extent));
+    plan->table = calloc(plan->capacity, sizeof(size_t));
+    if (plan->extents == NULL || plan->table == NULL) return ERR_OUT_OF_MEMORY;
+
+    static const int order[NB_RES] = { RES_ORIG, RES_SMALL, RES_THUMB };
+    uint64_t end = start;
+    uint32_t j = 0;
+    for (size_t i = 0; i < original->header.max_files; ++i) {
+        const struct img_metadata* metadata = &original->metadata[i];
+        if (metadata->is_valid != NON_EMPTY) continue;
+
+        temp->metadata[j] = *metadata;
+        for (size_t r = 0; r < NB_RES; ++r) {
+            const int res = order[r];
+            if (metadata->offset[res] != 0) {
+                temp->metadata[j].offset[res] = plan_extent(plan, metadata->offset[res], metadata->size[res], &end);
+            }
+        }
+        ++j;
+    }
+    temp->header.num_files = j;
+    temp->header.imgst_version = j;
+    return ERR_NONE;
+}
+
+/**
+ * @brief The copy of the runs of the plan, shared by the copying threads.
+ */
+struct gc_copy {
+    const struct gc_extent* runs; // the extents, contiguous runs merged
+    size_t nb_runs;
+    size_t next_run;              // first run not taken yet by a thread
+    uint64_t next_done;           // bytes of this run already taken
+    pthread_mutex_t lock;         // protects next_run and next_done
+    int from;                     // original imgStore
+    const char* to_path;          // new imgStore (opened by each thread, for its own file position)
+    int ret;                      // first error of the threads
+};
+
+/********************************************************************//**
+ * Merges the extents which are contiguous both in the original imgStore
+ * and in the new one, so that each run is copied by a single call.
+ * Returns the number of runs (in place of the extents).
+ */
+static size_t
+merge_extents (struct gc_extent* extents, size_t nb_extents)
+{
+    size_t nb_runs = 0;
+    for (size_t e = 0; e < nb_extents; ++e) {
+        struct gc_extent* last = nb_runs > 0 ? &extents[nb_runs - 1] : NULL;
+        if (last != NULL && last->from + last->size == extents[e].from && last->to + last->size == extents[e].to) {
+            last->size += extents[e].size;
+        } else {
+            extents[nb_runs++] = extents[e];
+        }
+    }
+    return nb_runs;
+}
+
+/********************************************************************//**
+ * Body of a copying thread: takes the runs (split in chunks of at most
+ * GC_CHUNK_SIZE bytes, for the threads to share big runs) until none is left.
+ */
+static void*
+copy_runs (void* arg)
+{
+    struct gc_copy* copy = arg;
+
+    int ret = ERR_NONE;
+    char* buffer = malloc(COPY_BUFFER_SIZE);
+    const int out = open(copy->to_path, O_WRONLY);
+    if (buffer == NULL) ret = ERR_OUT_OF_MEMORY;
+    else if (out < 0) ret = ERR_IO;
+
+    while (ret == ERR_NONE) {
+        // Takes the next chunk
+        pthread_mutex_lock(&copy->lock);
+        int taken = copy->ret == ERR_NONE && copy->next_run < copy->nb_runs;
+        struct gc_extent chunk = { 0, 0, 0 };
+        if (taken) {
+            const struct gc_extent* run = &copy->runs[copy->next_run];
+            const uint64_t left = run->size - copy->next_done;
+            chunk.from = run->from + copy->next_done;
+            chunk.to = run->to + copy->next_done;
+            chunk.size = left < GC_CHUNK_SIZE ? left : GC_CHUNK_SIZE;
+            copy->next_done += chunk.size;
+            if (copy->next_done == run->size) {
+                ++copy->next_run;
+                copy->next_done = 0;
+            }
+        }
+        pthread_mutex_unlock(&copy->lock);
+        if (!taken) break;
+
+        ret = copy_range(copy->from, out, chunk.from, chunk.to, chunk.size, buffer);
+    }
+
+    if (out >= 0 && close(out) != 0 && ret == ERR_NONE) ret = ERR_IO;
+    free(buffer);
+
+    pthread_mutex_lock(&copy->lock);
+    if (copy->ret == ERR_NONE) copy->ret = ret;
+    pthread_mutex_unlock(&copy->lock);
+    return NULL;
+}
+
+/********************************************************************//**
+ * Copies the extents of the plan to the new imgStore, with 'nb_threads' threads.
+ */
+static int
+copy_extents (struct gc_plan* plan, FILE* from, const char* to_path, unsigned nb_threads)
+{
+    struct gc_copy copy = {
+        .runs = plan->extents,
+        .nb_runs = merge_extents(plan->extents, plan->nb_extents),
+        .next_run = 0,
+        .next_done = 0,
+        .from = fileno(from),
+        .to_path = to_path,
+        .ret = ERR_NONE
+    };
+    plan->nb_extents = copy.nb_runs;
+    if (copy.nb_runs == 0) return ERR_NONE;
+    if (pthread_mutex_init(&copy.lock, NULL) != 0) return ERR_OUT_OF_MEMORY;
+
+    pthread_t* threads = calloc(nb_threads, sizeof(pthread_t));
+    if (threads == NULL) {
+        pthread_mutex_destroy(&copy.lock);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // The calling thread copies as well
+    unsigned nb_started = 0;
+    while (nb_started + 1 < nb_threads && pthread_create(&threads[nb_started], NULL, copy_runs, &copy) == 0) {
+        ++nb_started;
+    }
+    copy_runs(&copy);
+    for (unsigned t = 0; t < nb_started; ++t) pthread_join(threads[t], NULL);
+
+    free(threads);
+    pthread_mutex_destroy(&copy.lock);
+    return copy.ret;
+}
 
 // See imgStore.h
 int do_gbcollect (const char *imgst_path, const char *imgst_tmp_bkp_path)
+{
+    return do_gbcollect_threads(imgst_path, imgst_tmp_bkp_path, 1);
+}
+
+// See imgStore.h
+int do_gbcollect_threads (const char *imgst_path, const char *imgst_tmp_bkp_path, unsigned nb_threads)
 {
     M_REQUIRE_NON_NULL(imgst_path);
     M_REQUIRE_NON_NULL(imgst_tmp_bkp_path);
-    
+    M_REQUIRE(nb_threads >= 1 && nb_threads <= MAX_GC_THREADS, ERR_INVALID_ARGUMENT,
+              "invalid number of threads (%u)", nb_threads);
+
     // Original imgStore file
     struct imgst_file original_file;
     M_EXIT_IF_ERR(do_open(imgst_path, "rb", &original_file));
-    
+
     // Temporary imgStore file
     struct imgst_header imgst_header = {
         .max_files = original_file.header.max_files,
@@ -29,52 +268,47 @@ int do_gbcollect (const char *imgst_path, const char *imgst_tmp_bkp_path)
             original_file.header.res_resized[2],
             original_file.header.res_resized[3]
 
-        }
+        },
+        .variants = original_file.header.variants
     };
     struct imgst_file temp_file = {
         .header = imgst_header
     };
 
-    do_create(imgst_tmp_bkp_path, &temp_file);
-    
-    // Garbage collection of the original file
-    int ret = ERR_NONE;
-    for (size_t i = 0; ret == ERR_NONE && i < original_file.header.max_files; ++i) {
-        if (original_file.metadata[i].is_valid == NON_EMPTY) {
-            // Buffer to contain the image in original resolution
-            size_t size = original_file.metadata[i].size[RES_ORIG];
-            char* buffer = calloc(size, 1);
-            uint32_t size1 = (uint32_t) size;
-
-            // Reads the image in original resolution
-            if ((ret = do_read(original_file.metadata[i].img_id, RES_ORIG, &buffer, &size1, &original_file)) != ERR_NONE) {
-                FREE_POINTER(buffer);
-                return ret;
-            }
-            
-            // Re-inserts the image in the imgStore (and possibly deduplicates it)
-            ret = do_insert(buffer, (size_t) size1, original_file.metadata[i].img_id, &temp_file);
-            FREE_POINTER(buffer);
-            if (ret != ERR_NONE) return ret;
-
-            // Inserts the image in other resolutions, if any
-            if (original_file.metadata[i].offset[RES_SMALL] != 0) {
-                M_EXIT_IF_ERR(lazily_resize(RES_SMALL, &temp_file, temp_file.header.num_files-1));
-            }
-
-            if (original_file.metadata[i].offset[RES_THUMB] != 0) {
-                M_EXIT_IF_ERR(lazily_resize(RES_THUMB, &temp_file, temp_file.header.num_files-1));
-            }
-        }
+    int ret = do_create(imgst_tmp_bkp_path, &temp_file);
+    if (ret != ERR_NONE) {
+        do_close(&original_file);
+        return ret;
     }
 
-    // Renames the temporary file with the original name
-    remove(imgst_path);
-    rename(imgst_tmp_bkp_path, imgst_path);
+    // The images are copied right after the (new) metadata
+    const uint64_t start = get_metadata_offset(&temp_file.header)
+                           + (uint64_t) temp_file.header.max_files * sizeof(struct img_metadata);
+
+    // Garbage collection of the original file: plans, then copies, the live extents
+    struct gc_plan plan = { NULL, 0, NULL, 0 };
+    ret = build_plan(&original_file, &temp_file, start, &plan);
+    if (ret == ERR_NONE && fflush(temp_file.file) != 0) ret = ERR_IO;
+    if (ret == ERR_NONE) ret = copy_extents(&plan, original_file.file, imgst_tmp_bkp_path, nb_threads);
+    if (ret == ERR_NONE) {
+        for (size_t j = 0; j < temp_file.header.num_files; ++j) index_add(&temp_file, j);
+        ret = update_metadata_range(&temp_file, 0, temp_file.header.num_files);
+    }
+    if (ret == ERR_NONE) ret = update_header(&temp_file);
+    if (ret == ERR_NONE) ret = do_sync(&temp_file);
+    FREE_POINTER(plan.extents);
+    FREE_POINTER(plan.table);
 
     // Cleanup
     do_close(&original_file);
     do_close(&temp_file);
 
-    return ret;
-}
\ No newline at end of file
+    // Renames the temporary file with the original name
+    if (ret != ERR_NONE) {
+        remove(imgst_tmp_bkp_path);
+        return ret;
+    }
+    if (rename(imgst_tmp_bkp_path, imgst_path) != 0) return ERR_IO;
+
+    return ERR_NONE;
+}
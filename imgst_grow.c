@@ -0,0 +1,78 @@
+/**
+ * @file imgst_grow.c
+ * @brief imgStore library: do_grow implementation.
+ */
+
+#define _DEFAULT_SOURCE // for fileno, fsync, sysconf
+
+#include "imgStore.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h> // for calloc
+#include <string.h> // for memcpy
+#include <unistd.h> // for fsync, sysconf
+
+/********************************************************************//**
+ * Body of do_grow(), under the write lock.
+ */
+static int
+grow_metadata (struct imgst_file* imgst_file, uint32_t max_files)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->file);
+    M_REQUIRE_NON_NULL(imgst_file->metadata);
+
+    if (max_files <= imgst_file->header.max_files || max_files > MAX_GROWN_FILES) return ERR_MAX_FILES;
+    if (imgst_file->read_only) return ERR_IO;
+
+    // Creates the new metadata table: the current entries, followed by empty ones
+    struct img_metadata* metadata = calloc(max_files, sizeof(struct img_metadata));
+    M_EXIT_IF_NULL(metadata, max_files * sizeof(struct img_metadata));
+    memcpy(metadata, imgst_file->metadata, imgst_file->header.max_files * sizeof(struct img_metadata));
+    for (size_t i = imgst_file->header.max_files; i < max_files; ++i) {
+        metadata[i].is_valid = EMPTY;
+    }
+
+    // Appends it at the end of the file, from a page boundary (so that it can be mapped, see do_open()),
+    // and makes sure it is on the disk before the header points to it
+    uint64_t offset = 0;
+    int ret = get_file_end(imgst_file, &offset);
+    const uint64_t page_size = (uint64_t) sysconf(_SC_PAGESIZE);
+    offset = (offset + page_size - 1) / page_size * page_size;
+    if (ret == ERR_NONE) ret = pwrite_full(fileno(imgst_file->file), metadata, max_files * sizeof(struct img_metadata), offset);
+    if (ret == ERR_NONE && fsync(fileno(imgst_file->file)) != 0) ret = ERR_IO;
+    FREE_POINTER(metadata);
+    if (ret != ERR_NONE) return ret;
+
+    // Switches the header to the new table (back to the former one if it cannot be written,
+    // the in-memory metadata still being the former table)
+    struct imgst_header former;
+    memcpy(&former, &imgst_file->header, sizeof(struct imgst_header));
+    imgst_file->header.max_files = max_files;
+    imgst_file->header.format = IMGST_FORMAT_V2;
+    imgst_file->header.metadata_offset = offset;
+    ++imgst_file->header.imgst_version;
+    ret = update_header(imgst_file);
+    if (ret == ERR_NONE) ret = do_sync(imgst_file);
+    if (ret != ERR_NONE) {
+        memcpy(&imgst_file->header, &former, sizeof(struct imgst_header));
+        update_header(imgst_file);
+        return ret;
+    }
+
+    // Reads (or maps) the new table and rebuilds the index
+    return reload_metadata(imgst_file);
+}
+
+// See imgStore.h
+int do_grow (struct imgst_file* imgst_file, uint32_t max_files)
+{
+    // The table is appended at the end of the file: no insertion may be writing there
+    imgst_space_exclusive_begin(imgst_file);
+    imgst_write_lock(imgst_file);
+    const int ret = grow_metadata(imgst_file, max_files);
+    imgst_unlock(imgst_file);
+    imgst_space_exclusive_end(imgst_file);
+    return ret;
+}
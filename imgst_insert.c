@@ -1,63 +1,668 @@
 /**
  * @file imgst_insert.c
- * @brief imgStore library: do_insert implementation.
+ * @brief imgStore library: do_insert, do_insert_batch, do_insert_fd, do_create_variants and do_create_resized implementations.
  */
+#define _DEFAULT_SOURCE // for fileno, sysconf
+
 #include "imgStore.h"
 #include "dedup.h"
 #include "image_content.h"
+#include "index.h"
+#include "util.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>   // for read, sysconf
+#include <sys/mman.h> // for mmap
+#include <sys/stat.h> // for fstat
+#include <openssl/evp.h>
 #include <openssl/sha.h>
 
+/**
+ * @brief Fills the entry at position 'index' of the metadata, whose SHA is
+ *        set, with the ID and size of a new image, and de-duplicates it.
+ *        If the image has no duplicate, none of its resolutions is stored
+ *        yet (offsets left at 0).
+ */
+static int
+fill_metadata (const char* img_id, size_t size, struct imgst_file* imgst_file, size_t index)
+{
+    struct img_metadata* metadata = &imgst_file->metadata[index];
+    strncpy(metadata->img_id, img_id, MAX_IMG_ID);
+    metadata->size[RES_ORIG] = (uint32_t) size;
+
+    // De-duplicates the image
+    M_EXIT_IF_ERR(do_name_and_content_dedup(imgst_file, (uint32_t) index));
+
+    if (metadata->offset[RES_ORIG] == 0) {
+        metadata->offset[RES_SMALL] = 0;
+        metadata->offset[RES_THUMB] = 0;
+        metadata->size[RES_SMALL] = 0;
+        metadata->size[RES_THUMB] = 0;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Fills an empty entry of the metadata with a new image
+ *        (SHA, ID, size, resolution, de-duplication) and marks it as used.
+ *        Nothing is written on the disk: if the image has no duplicate,
+ *        its offset is left at 0 and its content must still be written.
+ *        Under the write lock.
+ *
+ * @param img_id Image ID
+ * @param size Image size
+ * @param SHA SHA256 of the image content
+ * @param width Width of the image
+ * @param height Height of the image
+ * @param imgst_file The main in-memory data structure
+ * @param index Set to the position of the image in the metadata
+ * @return Some error code. 0 if no error.
+ */
+static int
+add_metadata (const char* img_id, size_t size, const unsigned char* SHA, uint32_t width, uint32_t height,
+              struct imgst_file* imgst_file, size_t* index)
+{
+    if (imgst_file->header.num_files >= imgst_file->header.max_files) return ERR_FULL_IMGSTORE;
+
+    // Finds (if possible) an empty entry in the metadata for the image
+    size_t i = 0;
+    M_EXIT_IF_ERR(index_find_free(imgst_file, &i));
+
+    // Sets the SHA, img_id and size fields of the image metadata, and de-duplicates it
+    memcpy(imgst_file->metadata[i].SHA, SHA, SHA256_DIGEST_LENGTH);
+    M_EXIT_IF_ERR(fill_metadata(img_id, size, imgst_file, i));
+
+    // Sets the width and the height of the image
+    imgst_file->metadata[i].res_orig[0] = width;
+    imgst_file->metadata[i].res_orig[1] = height;
+
+    imgst_file->metadata[i].is_valid = NON_EMPTY;
+    index_add(imgst_file, i);
+
+    *index = i;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Frees again an entry filled by add_metadata.
+ */
+static void
+remove_metadata (struct imgst_file* imgst_file, size_t index)
+{
+    index_remove(imgst_file, index);
+    imgst_file->metadata[index].is_valid = EMPTY;
+}
+
+/**
+ * @brief Body of do_insert(), once the insertion is started (see
+ *        imgst_insertion_begin): the ID and the content are checked before
+ *        anything is written, and only the publication takes the write lock.
+ */
+static int
+insert_image (const char* buffer, size_t size, const char* img_id, const unsigned char* SHA,
+              uint32_t width, uint32_t height, struct imgst_file* imgst_file)
+{
+    // A duplicate ID is rejected, and a content already stored is not written again,
+    // without any I/O; the new content is given its place under the read lock only
+    imgst_read_lock(imgst_file);
+    size_t i = 0;
+    int ret = imgst_file->header.num_files >= imgst_file->header.max_files ? ERR_FULL_IMGSTORE : ERR_NONE;
+    if (ret == ERR_NONE && index_find_id(imgst_file, img_id, SIZE_MAX, &i) == ERR_NONE) ret = ERR_DUPLICATE_ID;
+    const int written = ret == ERR_NONE && index_blob_refs(imgst_file, SHA) == 0;
+    uint64_t offset = 0;
+    int in_hole = 0;
+    if (written) ret = imgst_space_alloc(imgst_file, 1, size, &offset, &in_hole);
+    imgst_unlock(imgst_file);
+    if (ret != ERR_NONE) return ret;
+
+    // Writes the new content without the lock: the place is given to this insertion only
+    if (written) ret = pwrite_full(fileno(imgst_file->file), buffer, size, offset);
+
+    imgst_write_lock(imgst_file);
+    int used = 0;
+    if (ret == ERR_NONE) ret = add_metadata(img_id, size, SHA, width, height, imgst_file, &i);
+    if (ret == ERR_NONE) {
+        // The content of a duplicate inserted meanwhile is not used; the one of a
+        // duplicate deleted meanwhile is written now
+        if (imgst_file->metadata[i].offset[RES_ORIG] == 0) {
+            if (written) {
+                imgst_file->metadata[i].offset[RES_ORIG] = offset;
+                used = 1;
+            } else {
+                ret = write_image_to_imgst(i, RES_ORIG, buffer, size, imgst_file);
+                if (ret != ERR_NONE) remove_metadata(imgst_file, i);
+            }
+        }
+    }
+    if (ret == ERR_NONE) {
+        // Updates the database header and metadata on the disk
+        ++imgst_file->header.imgst_version;
+        ++imgst_file->header.num_files;
+        ret = update_header(imgst_file);
+        if (ret == ERR_NONE) ret = update_metadata(imgst_file, i);
+        if (ret == ERR_NONE) ret = commit_updates(imgst_file);
+    }
+    if (written && !used) imgst_space_release(imgst_file, offset, size, in_hole);
+    imgst_unlock(imgst_file);
+    return ret;
+}
+
 // See imgStore.h
 int do_insert(const char* buffer, size_t size, const char* img_id, struct imgst_file* imgst_file)
 {
     M_REQUIRE_NON_NULL(buffer);
     M_REQUIRE_NON_NULL(img_id);
     M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->file);
+    if (strlen(img_id) == 0 || strlen(img_id) > MAX_IMG_ID) return ERR_INVALID_IMGID;
+    if (size > UINT32_MAX) return ERR_INVALID_ARGUMENT; // sizes are stored on 32 bits
+    if (imgst_file->read_only) return ERR_IO;
 
-    if (imgst_file->header.num_files >= imgst_file->header.max_files) return ERR_FULL_IMGSTORE;
+    // The SHA and the resolution of the image, from the buffer and before any lock
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint32_t width = 0;
+    uint32_t height = 0;
+    SHA256((const unsigned char*) buffer, size, SHA);
+    M_EXIT_IF_ERR(get_resolution(&height, &width, buffer, size));
 
-    for (size_t i = 0; i < imgst_file->header.max_files; ++i) {
-        // Finds (if possible) an empty entry in the metadata for the image
-        if (!imgst_file->metadata[i].is_valid) {
-
-            // Sets the SHA, img_id and size fields of the image metadata
-            SHA256((const unsigned char*) buffer, size, imgst_file->metadata[i].SHA);
-            strncpy(imgst_file->metadata[i].img_id, img_id, MAX_IMG_ID);
-            imgst_file->metadata[i].size[RES_ORIG] = (uint32_t) size;
-
-            // De-duplicates the image
-            M_EXIT_IF_ERR(do_name_and_content_dedup(imgst_file, (uint32_t) i));
-
-            // If there is no duplicate of the image, writes the image on the disk
-            if (imgst_file->metadata[i].offset[RES_ORIG] == 0) {
-                imgst_file->metadata[i].offset[RES_SMALL] = 0;
-                imgst_file->metadata[i].offset[RES_THUMB] = 0;
-                imgst_file->metadata[i].size[RES_SMALL] = 0;
-                imgst_file->metadata[i].size[RES_THUMB] = 0;
-                M_EXIT_IF_ERR(write_image_end_of_imgst(i, RES_ORIG, buffer, size, imgst_file));
+    imgst_insertion_begin(imgst_file);
+    const int ret = insert_image(buffer, size, img_id, SHA, width, height, imgst_file);
+    imgst_insertion_end(imgst_file);
+    return ret;
+}
+
+/**
+ * @brief Compares two metadata positions (for qsort).
+ */
+static int
+compare_index (const void* a, const void* b)
+{
+    const size_t x = *(const size_t*) a;
+    const size_t y = *(const size_t*) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief What is known of an image of a batch before the write lock.
+ */
+struct batch_image {
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint32_t width;
+    uint32_t height;
+    uint64_t offset; // position of its content in the space given to the batch
+    int written;     // whether its content is written there
+    int used;        // whether that written content is published
+};
+
+/**
+ * @brief Whether the content of the image 'k' of the batch is to be
+ *        written: not already stored, nor the one of a previous image.
+ *        Under the lock (at least for reading).
+ */
+static int
+is_new_content (const struct img_to_insert* images, const struct batch_image* infos, size_t k,
+                struct imgst_file* imgst_file)
+{
+    if (index_blob_refs(imgst_file, infos[k].SHA) > 0) return 0;
+    for (size_t j = 0; j < k; ++j) {
+        if (images[j].error == ERR_NONE && infos[j].written
+            && compare_sha(infos[j].SHA, infos[k].SHA) == 0) return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Publishes the images of a batch whose new contents are written
+ *        at 'start': fills their metadata, then writes it and the header.
+ *        Under the write lock.
+ */
+static int
+publish_batch (struct img_to_insert* images, struct batch_image* infos, size_t nb_images,
+               uint64_t start, struct imgst_file* imgst_file)
+{
+    // Positions of the inserted images in the metadata
+    size_t* inserted = calloc(nb_images, sizeof(size_t));
+    M_EXIT_IF_NULL(inserted, nb_images * sizeof(size_t));
+    size_t nb_inserted = 0;
+
+    for (size_t k = 0; k < nb_images; ++k) {
+        if (images[k].error != ERR_NONE) continue;
+
+        size_t i = 0;
+        images[k].error = add_metadata(images[k].img_id, images[k].size, infos[k].SHA,
+                                       infos[k].width, infos[k].height, imgst_file, &i);
+        if (images[k].error != ERR_NONE) continue;
+
+        // The content of a duplicate inserted meanwhile is not used; the one of a
+        // duplicate deleted meanwhile is written now
+        if (imgst_file->metadata[i].offset[RES_ORIG] == 0) {
+            if (infos[k].written) {
+                imgst_file->metadata[i].offset[RES_ORIG] = start + infos[k].offset;
+                infos[k].used = 1;
+            } else {
+                images[k].error = write_image_to_imgst(i, RES_ORIG, images[k].buffer, images[k].size, imgst_file);
+                if (images[k].error != ERR_NONE) {
+                    remove_metadata(imgst_file, i);
+                    continue;
+                }
             }
-            imgst_file->metadata[i].is_valid = NON_EMPTY;
+        }
+        inserted[nb_inserted++] = i;
+    }
+
+    int error = ERR_NONE;
+    if (nb_inserted > 0) {
+        // Updates the database header on the disk
+        imgst_file->header.imgst_version += (uint32_t) nb_inserted;
+        imgst_file->header.num_files += (uint32_t) nb_inserted;
+        error = update_header(imgst_file);
+
+        // Updates the database metadata on the disk, one write per run of consecutive entries
+        qsort(inserted, nb_inserted, sizeof(size_t), compare_index);
+        for (size_t first = 0; first < nb_inserted && error == ERR_NONE; ) {
+            size_t last = first;
+            while (last + 1 < nb_inserted && inserted[last + 1] == inserted[last] + 1) ++last;
+            error = update_metadata_range(imgst_file, inserted[first], last - first + 1);
+            first = last + 1;
+        }
+        if (error == ERR_NONE) error = commit_updates(imgst_file);
+    }
+
+    FREE_POINTER(inserted);
+    return error;
+}
+
+/**
+ * @brief Body of do_insert_batch(), once the insertion is started (see
+ *        imgst_insertion_begin): only the publication takes the write lock.
+ */
+static int
+insert_batch (struct img_to_insert* images, struct batch_image* infos, size_t nb_images,
+              struct imgst_file* imgst_file)
+{
+    // The SHA and the resolution of the images, before any lock
+    for (size_t k = 0; k < nb_images; ++k) {
+        if (images[k].error != ERR_NONE) continue;
+        SHA256((const unsigned char*) images[k].buffer, images[k].size, infos[k].SHA);
+        images[k].error = get_resolution(&infos[k].height, &infos[k].width, images[k].buffer, images[k].size);
+    }
 
-            // Sets the width and the height of the image
-            M_EXIT_IF_ERR(get_resolution(&(imgst_file->metadata[i].res_orig[1]),
-                                         &(imgst_file->metadata[i].res_orig[0]),
-                                         buffer,
-                                         size));
+    // All new contents are given one place at the end of the imgStore, one after the other,
+    // under the read lock only: the imgStore is still read meanwhile
+    imgst_read_lock(imgst_file);
+    uint64_t total = 0;
+    for (size_t k = 0; k < nb_images; ++k) {
+        if (images[k].error != ERR_NONE || !is_new_content(images, infos, k, imgst_file)) continue;
+        infos[k].offset = total;
+        infos[k].written = 1;
+        total += images[k].size;
+    }
+    uint64_t start = 0;
+    int error = total > 0 ? imgst_space_alloc(imgst_file, 0, total, &start, NULL) : ERR_NONE;
+    imgst_unlock(imgst_file);
 
-            // Updates the database header on the disk
-            ++imgst_file->header.imgst_version;
-            ++imgst_file->header.num_files;
-            M_EXIT_IF_ERR(update_header(imgst_file));
+    // Writes the new contents in one sequential pass, without the lock
+    for (size_t k = 0; k < nb_images && error == ERR_NONE; ++k) {
+        if (infos[k].written && images[k].size > 0) {
+            error = pwrite_full(fileno(imgst_file->file), images[k].buffer, images[k].size, start + infos[k].offset);
+        }
+    }
 
-            // Updates the database metadata on the disk
-            M_EXIT_IF_ERR(update_metadata(imgst_file, i));
+    imgst_write_lock(imgst_file);
+    if (error == ERR_NONE) {
+        error = publish_batch(images, infos, nb_images, start, imgst_file);
+    } else {
+        // Nothing of the batch is recorded in the imgStore
+        for (size_t k = 0; k < nb_images; ++k) {
+            if (images[k].error == ERR_NONE) images[k].error = error;
+        }
+    }
 
-            return ERR_NONE;
+    // Gives back the written contents not used, from the last one (then cut off the end of the file)
+    for (size_t k = nb_images; k-- > 0; ) {
+        if (infos[k].written && !infos[k].used) {
+            imgst_space_release(imgst_file, start + infos[k].offset, images[k].size, 0);
         }
     }
-    return ERR_FULL_IMGSTORE;
-}
\ No newline at end of file
+    imgst_unlock(imgst_file);
+    return error;
+}
+
+// See imgStore.h
+int do_insert_batch(struct img_to_insert* images, size_t nb_images, struct imgst_file* imgst_file)
+{
+    M_REQUIRE_NON_NULL(images);
+    M_REQUIRE_NON_NULL(imgst_file);
+    if (nb_images == 0) return ERR_NONE;
+    if (imgst_file->read_only) return ERR_IO;
+
+    for (size_t k = 0; k < nb_images; ++k) {
+        M_REQUIRE_NON_NULL(images[k].buffer);
+        M_REQUIRE_NON_NULL(images[k].img_id);
+        // sizes are stored on 32 bits
+        images[k].error = images[k].size > UINT32_MAX ? ERR_INVALID_ARGUMENT : ERR_NONE;
+    }
+
+    struct batch_image* infos = calloc(nb_images, sizeof(struct batch_image));
+    M_EXIT_IF_NULL(infos, nb_images * sizeof(struct batch_image));
+
+    imgst_insertion_begin(imgst_file);
+    const int ret = insert_batch(images, infos, nb_images, imgst_file);
+    imgst_insertion_end(imgst_file);
+
+    FREE_POINTER(infos);
+    return ret;
+}
+
+/**
+ * @brief Gives back the space of the content of an insertion, not published.
+ */
+static void
+drop_content (struct imgst_insertion* insertion)
+{
+    imgst_read_lock(insertion->imgst_file);
+    imgst_space_release(insertion->imgst_file, insertion->offset, insertion->reserved, insertion->in_hole);
+    imgst_unlock(insertion->imgst_file);
+
+    insertion->reserved = 0;
+    insertion->size = 0;
+}
+
+// See imgStore.h
+int do_insert_begin(const char* img_id, size_t expected_size, struct imgst_insertion* insertion,
+                    struct imgst_file* imgst_file)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(insertion);
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->file);
+    if (strlen(img_id) == 0 || strlen(img_id) > MAX_IMG_ID) return ERR_INVALID_IMGID;
+    if (expected_size > UINT32_MAX) return ERR_INVALID_ARGUMENT; // sizes are stored on 32 bits
+    if (imgst_file->read_only) return ERR_IO;
+
+    insertion->imgst_file = imgst_file;
+    strncpy(insertion->img_id, img_id, MAX_IMG_ID);
+    insertion->img_id[MAX_IMG_ID] = '\0';
+    insertion->expected = expected_size;
+    insertion->size = 0;
+    insertion->reserved = 0;
+    insertion->in_hole = 0;
+    insertion->sha = EVP_MD_CTX_new();
+    if (insertion->sha == NULL) return ERR_OUT_OF_MEMORY;
+    if (EVP_DigestInit_ex(insertion->sha, EVP_sha256(), NULL) != 1) {
+        EVP_MD_CTX_free(insertion->sha);
+        insertion->sha = NULL;
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // Gives the content its place (in a hole if its size is known), under the read lock only
+    imgst_insertion_begin(imgst_file);
+    imgst_read_lock(imgst_file);
+    int ret = imgst_file->header.num_files >= imgst_file->header.max_files ? ERR_FULL_IMGSTORE : ERR_NONE;
+    if (ret == ERR_NONE) {
+        ret = imgst_space_alloc(imgst_file, expected_size > 0, expected_size, &insertion->offset, &insertion->in_hole);
+    }
+    imgst_unlock(imgst_file);
+
+    if (ret != ERR_NONE) {
+        imgst_insertion_end(imgst_file);
+        EVP_MD_CTX_free(insertion->sha);
+        insertion->sha = NULL;
+        return ret;
+    }
+    insertion->reserved = expected_size;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Gives 'extra' more bytes to the content of an insertion of
+ *        unknown size: they follow it, or it is moved (copied) after the
+ *        bytes given meanwhile to other insertions.
+ */
+static int
+extend_content (struct imgst_insertion* insertion, size_t extra)
+{
+    struct imgst_file* imgst_file = insertion->imgst_file;
+
+    uint64_t offset = insertion->offset;
+    imgst_read_lock(imgst_file);
+    int ret = imgst_space_extend(imgst_file, insertion->reserved, extra, &offset);
+    imgst_unlock(imgst_file);
+    if (ret != ERR_NONE) return ret;
+
+    if (offset != insertion->offset) {
+        const int fd = fileno(imgst_file->file);
+        char* buffer = malloc(COPY_BUFFER_SIZE);
+        ret = buffer == NULL ? ERR_OUT_OF_MEMORY
+              : copy_range(fd, fd, insertion->offset, offset, insertion->size, buffer);
+        free(buffer);
+
+        // Gives back the former place, or the new one if not copied
+        imgst_read_lock(imgst_file);
+        if (ret == ERR_NONE) {
+            imgst_space_release(imgst_file, insertion->offset, insertion->reserved, 0);
+        } else {
+            imgst_space_release(imgst_file, offset, insertion->reserved + extra, 0);
+        }
+        imgst_unlock(imgst_file);
+        if (ret != ERR_NONE) return ret;
+        insertion->offset = offset;
+    }
+    insertion->reserved += extra;
+    return ERR_NONE;
+}
+
+// See imgStore.h
+int do_insert_append(struct imgst_insertion* insertion, const char* chunk, size_t size)
+{
+    M_REQUIRE_NON_NULL(insertion);
+    M_REQUIRE_NON_NULL(insertion->sha);
+    M_REQUIRE_NON_NULL(chunk);
+    if (size > UINT32_MAX - insertion->size) return ERR_INVALID_ARGUMENT; // sizes are stored on 32 bits
+
+    if (size > insertion->reserved - insertion->size) {
+        if (insertion->expected > 0) return ERR_INVALID_ARGUMENT; // more bytes than expected
+        M_EXIT_IF_ERR(extend_content(insertion, size));
+    }
+
+    // Written without the lock: the place is given to this insertion only
+    M_EXIT_IF_ERR(pwrite_full(fileno(insertion->imgst_file->file), chunk, size, insertion->offset + insertion->size));
+    if (EVP_DigestUpdate(insertion->sha, chunk, size) != 1) return ERR_IO;
+    insertion->size += size;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Reads the resolution of the 'size' bytes of an image at 'offset'
+ *        from a mapping of them (the content is not loaded in memory).
+ */
+static int
+read_resolution (const struct imgst_file* imgst_file, uint64_t offset, uint64_t size,
+                 uint32_t* width, uint32_t* height)
+{
+    if (size == 0) return ERR_IMGLIB;
+
+    const uint64_t page_size = (uint64_t) sysconf(_SC_PAGESIZE);
+    const uint64_t start = offset - offset % page_size;
+    const size_t map_size = (size_t) (offset - start + size);
+
+    void* map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fileno(imgst_file->file), (off_t) start);
+    if (map == MAP_FAILED) return ERR_IO;
+    const int ret = get_resolution(height, width, (const char*) map + (offset - start), (size_t) size);
+    munmap(map, map_size);
+    return ret;
+}
+
+/**
+ * @brief Body of do_insert_commit(), before the insertion is ended: only
+ *        the publication of the image takes the write lock.
+ */
+static int
+commit_insertion (struct imgst_insertion* insertion)
+{
+    struct imgst_file* imgst_file = insertion->imgst_file;
+
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint32_t width = 0;
+    uint32_t height = 0;
+    if (EVP_DigestFinal_ex(insertion->sha, SHA, NULL) != 1) return ERR_IO;
+    M_EXIT_IF_ERR(read_resolution(imgst_file, insertion->offset, insertion->size, &width, &height));
+
+    imgst_write_lock(imgst_file);
+    size_t i = 0;
+    int ret = add_metadata(insertion->img_id, (size_t) insertion->size, SHA, width, height, imgst_file, &i);
+    if (ret == ERR_NONE) {
+        // The content of a duplicate is already stored: the written bytes are dropped (see do_insert_abort)
+        if (imgst_file->metadata[i].offset[RES_ORIG] == 0) {
+            imgst_file->metadata[i].offset[RES_ORIG] = insertion->offset;
+
+            // The content is published: only the unused end of its place (if any) is given back
+            imgst_space_release(imgst_file, insertion->offset + insertion->size,
+                                insertion->reserved - insertion->size, insertion->in_hole);
+            insertion->reserved = 0;
+            insertion->size = 0;
+        }
+
+        // Updates the database header and metadata on the disk
+        ++imgst_file->header.imgst_version;
+        ++imgst_file->header.num_files;
+        ret = update_header(imgst_file);
+        if (ret == ERR_NONE) ret = update_metadata(imgst_file, i);
+        if (ret == ERR_NONE) ret = commit_updates(imgst_file);
+    }
+    imgst_unlock(imgst_file);
+    return ret;
+}
+
+// See imgStore.h
+int do_insert_commit(struct imgst_insertion* insertion)
+{
+    M_REQUIRE_NON_NULL(insertion);
+    M_REQUIRE_NON_NULL(insertion->sha);
+
+    const int ret = commit_insertion(insertion);
+    do_insert_abort(insertion); // ends the insertion (dropping the content if not published)
+    return ret;
+}
+
+// See imgStore.h
+void do_insert_abort(struct imgst_insertion* insertion)
+{
+    if (insertion == NULL || insertion->sha == NULL) return;
+
+    drop_content(insertion);
+    EVP_MD_CTX_free(insertion->sha);
+    insertion->sha = NULL;
+    imgst_insertion_end(insertion->imgst_file);
+}
+
+// See imgStore.h
+int do_insert_fd(int fd, const char* img_id, struct imgst_file* imgst_file)
+{
+    // The size of a regular file is known: its content may then fill a hole
+    struct stat st;
+    const size_t expected_size = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ? (size_t) st.st_size : 0;
+
+    char* chunk = malloc(INSERT_CHUNK_SIZE);
+    M_EXIT_IF_NULL(chunk, INSERT_CHUNK_SIZE);
+
+    struct imgst_insertion insertion;
+    int ret = do_insert_begin(img_id, expected_size, &insertion, imgst_file);
+    if (ret != ERR_NONE) {
+        free(chunk);
+        return ret;
+    }
+
+    ssize_t n = 0;
+    while (ret == ERR_NONE && (n = read(fd, chunk, INSERT_CHUNK_SIZE)) > 0) {
+        ret = do_insert_append(&insertion, chunk, (size_t) n);
+    }
+    if (ret == ERR_NONE && n < 0) ret = ERR_IO;
+    free(chunk);
+
+    if (ret != ERR_NONE) {
+        do_insert_abort(&insertion);
+        return ret;
+    }
+    return do_insert_commit(&insertion);
+}
+
+/**
+ * @brief Body of do_create_variants() (resolution RES_ORIG: all the missing
+ *        ones) and do_create_resized(), once the resize of the image is
+ *        claimed (see imgst_resize_begin).
+ */
+static int create_variants(const char* img_id, int resolution, struct imgst_file* imgst_file)
+{
+    // Creates the missing resized images under the read lock only: the imgStore is still read meanwhile
+    struct resized_variants variants;
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    imgst_read_lock(imgst_file);
+    size_t i = 0;
+    int ret = index_find_id(imgst_file, img_id, SIZE_MAX, &i);
+    if (ret == ERR_NONE) {
+        memcpy(SHA, imgst_file->metadata[i].SHA, SHA256_DIGEST_LENGTH);
+        ret = resize_variants(imgst_file, i, resolution, &variants);
+    }
+    imgst_unlock(imgst_file);
+    if (ret != ERR_NONE) return ret;
+
+    // Stores them under the write lock, unless the image was replaced meanwhile;
+    // what is still missing then (e.g. a deleted duplicate had it) is created there
+    imgst_write_lock(imgst_file);
+    ret = index_find_id(imgst_file, img_id, SIZE_MAX, &i);
+    if (ret == ERR_NONE && !memcmp(SHA, imgst_file->metadata[i].SHA, SHA256_DIGEST_LENGTH)) {
+        ret = store_variants(imgst_file, i, &variants);
+    }
+    if (ret == ERR_NONE) {
+        ret = resolution == RES_ORIG ? lazily_resize_all(imgst_file, i)
+                                     : lazily_resize(resolution, imgst_file, i);
+    }
+    imgst_unlock(imgst_file);
+
+    free_variants(&variants);
+    return ret;
+}
+
+/**
+ * @brief Creates the missing resized images of the image of the given ID,
+ *        only one thread at a time for this image (see create_variants).
+ */
+static int create_one_at_a_time(const char* img_id, int resolution, struct imgst_file* imgst_file)
+{
+    imgst_read_lock(imgst_file);
+    size_t i = 0;
+    int ret = index_find_id(imgst_file, img_id, SIZE_MAX, &i);
+    imgst_unlock(imgst_file);
+    if (ret != ERR_NONE) return ret;
+
+    // Only one thread resizes an image at a time: the others wait for it, then
+    // find its resized images stored (only what is still missing is created)
+    imgst_resize_begin(imgst_file, i);
+    ret = create_variants(img_id, resolution, imgst_file);
+    imgst_resize_end(imgst_file, i);
+    return ret;
+}
+
+// See imgStore.h
+int do_create_variants(const char* img_id, struct imgst_file* imgst_file)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(imgst_file);
+
+    return create_one_at_a_time(img_id, RES_ORIG, imgst_file);
+}
+
+// See imgStore.h
+int do_create_resized(const char* img_id, int resolution, struct imgst_file* imgst_file)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE(resolution >= RES_THUMB && resolution <= RES_ORIG, ERR_RESOLUTIONS, "wrong resolution (%d)", resolution);
+    if (resolution == RES_ORIG) return ERR_NONE;
+
+    return create_one_at_a_time(img_id, resolution, imgst_file);
+}
@@ -9,11 +9,12 @@
 #include <json-c/json.h>
 #include <string.h>
 
-// See imgStore.h
-char* do_list (const struct imgst_file * imgst_file, do_list_mode mode)
+/**
+ * @brief Body of do_list(), under the read lock.
+ */
+static char*
+list_images (const struct imgst_file * imgst_file, do_list_mode mode)
 {
-    if (imgst_file == NULL) return NULL;
-
     if (mode == STDOUT) {
         print_header(&(imgst_file->header));
         if (imgst_file->header.num_files == 0) {
@@ -77,3 +78,14 @@ char* do_list (const struct imgst_file * imgst_file, do_list_mode mode)
 
     return ret;
 }
+
+// See imgStore.h
+char* do_list (const struct imgst_file * imgst_file, do_list_mode mode)
+{
+    if (imgst_file == NULL) return NULL;
+
+    imgst_read_lock(imgst_file);
+    char* ret = list_images(imgst_file, mode);
+    imgst_unlock(imgst_file);
+    return ret;
+}
@@ -1,15 +1,85 @@
 /**
  * @file imgst_read.c
- * @brief imgStore library: do_read implementation.
+ * @brief imgStore library: do_read, do_is_stored, do_read_batch, do_read_view, do_read_stored_view and do_read_stream implementations.
  */
 
+#define _DEFAULT_SOURCE // for fileno, sysconf, preadv
+
 #include "imgStore.h"
-#include "image_content.h"
+#include "index.h"
 #include "util.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>   // for sysconf
+#include <sys/mman.h> // for mmap
+#include <sys/uio.h>  // for preadv
+
+#define MAX_RUN_IMAGES 1024 // max. number of images read by one preadv() (IOV_MAX on Linux)
+
+/**
+ * @brief Creates the image of the given ID in the given resolution, if still
+ *        missing, and only in this one (see do_create_resized). The read
+ *        lock is released meanwhile, then taken again: the image has to be
+ *        looked up again.
+ */
+static int
+resize_missing (const char* img_id, int resolution, struct imgst_file* imgst_file)
+{
+    imgst_unlock(imgst_file);
+    const int ret = do_create_resized(img_id, resolution, imgst_file);
+    imgst_read_lock(imgst_file);
+    return ret;
+}
+
+/**
+ * @brief Finds the position 'index' in the metadata of the image of the
+ *        given ID, creating it in the given resolution if missing and
+ *        'create' is set (otherwise its offset is left at 0)
+ *        (under the read lock).
+ */
+static int
+find_image (const char* img_id, int resolution, int create, struct imgst_file* imgst_file, size_t* index)
+{
+    if (imgst_file->header.num_files == 0) return ERR_FILE_NOT_FOUND;
+
+    // Finds (if possible) the entry in the metadata corresponding to the given ID
+    size_t i = 0;
+    M_EXIT_IF_ERR(index_find_id(imgst_file, img_id, SIZE_MAX, &i));
+
+    // If the found image does not exist in the given resolution, creates it
+    if (create && imgst_file->metadata[i].offset[resolution] == 0) {
+        M_EXIT_IF_ERR(resize_missing(img_id, resolution, imgst_file));
+        M_EXIT_IF_ERR(index_find_id(imgst_file, img_id, SIZE_MAX, &i));
+        if (imgst_file->metadata[i].offset[resolution] == 0) return ERR_IO;
+    }
+
+    *index = i;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Body of do_read(), under the read lock.
+ */
+static int
+read_image (const char* img_id, int resolution, char** image_buffer, uint32_t* image_size, struct imgst_file* imgst_file)
+{
+    size_t i = 0;
+    M_EXIT_IF_ERR(find_image(img_id, resolution, 1, imgst_file, &i));
+
+    // Reads the image content in the image buffer
+    *image_size = imgst_file->metadata[i].size[resolution];
+    *image_buffer = calloc(1, *image_size);
+    M_EXIT_IF_NULL(*image_buffer, *image_size);
+
+    int error_load = load_image_from_imgst(i, resolution, *image_buffer, *image_size, imgst_file);
+    if (error_load != ERR_NONE) {
+        FREE_POINTER(*image_buffer);
+    }
+
+    return error_load;
+}
 
 // See imgStore.h
 int do_read(const char * img_id, int resolution, char** image_buffer, uint32_t* image_size, struct imgst_file * imgst_file)
@@ -19,30 +89,329 @@ int do_read(const char * img_id, int resolution, char** image_buffer, uint32_t*
     M_REQUIRE_NON_NULL(image_size);
     M_REQUIRE_NON_NULL(imgst_file);
     if (resolution < RES_THUMB || resolution > RES_ORIG) return ERR_INVALID_ARGUMENT;
-    if (imgst_file->header.num_files == 0) return ERR_FILE_NOT_FOUND;
 
-    for (size_t i = 0; i < imgst_file->header.max_files; ++i) {
-        // Finds (if possible) the entry in the metadata corresponding to the given ID
-        if (!strncmp(imgst_file->metadata[i].img_id, img_id, MAX_IMG_ID)
-            && imgst_file->metadata[i].is_valid == NON_EMPTY) { // for all other valid images
+    imgst_read_lock(imgst_file);
+    const int ret = read_image(img_id, resolution, image_buffer, image_size, imgst_file);
+    imgst_unlock(imgst_file);
+    return ret;
+}
+
+// See imgStore.h
+int do_is_stored(const char* img_id, int resolution, int* stored, struct imgst_file* imgst_file)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(stored);
+    M_REQUIRE_NON_NULL(imgst_file);
+    if (resolution < RES_THUMB || resolution > RES_ORIG) return ERR_INVALID_ARGUMENT;
+
+    imgst_read_lock(imgst_file);
+    size_t i = 0;
+    const int ret = index_find_id(imgst_file, img_id, SIZE_MAX, &i);
+    if (ret == ERR_NONE) *stored = imgst_file->metadata[i].offset[resolution] != 0;
+    imgst_unlock(imgst_file);
+    return ret;
+}
+
+/**
+ * @brief Body of do_read_view() and do_read_stored_view(), under the read
+ *        lock: maps the pages holding the image (mappings start at a page
+ *        boundary), unless it is missing in this resolution and not to be
+ *        created ('stored' then set to 0).
+ */
+static int
+map_image (const char* img_id, int resolution, int create, struct img_view* view, int* stored,
+           struct imgst_file* imgst_file)
+{
+    size_t i = 0;
+    M_EXIT_IF_ERR(find_image(img_id, resolution, create, imgst_file, &i));
+
+    const uint64_t offset = imgst_file->metadata[i].offset[resolution];
+    *stored = offset != 0;
+    if (!*stored) return ERR_NONE;
+
+    view->size = imgst_file->metadata[i].size[resolution];
+    if (view->size == 0) {
+        view->data = "";
+        return ERR_NONE;
+    }
+
+    const uint64_t page_size = (uint64_t) sysconf(_SC_PAGESIZE);
+    const uint64_t start = offset - offset % page_size;
+    view->map_size = (size_t) (offset - start) + view->size;
+    view->map = mmap(NULL, view->map_size, PROT_READ, MAP_SHARED, fileno(imgst_file->file), (off_t) start);
+    if (view->map == MAP_FAILED) {
+        view->map = NULL;
+        view->map_size = 0;
+        return ERR_IO;
+    }
+    view->data = (const char*) view->map + (offset - start);
+    return ERR_NONE;
+}
+
+/**
+ * @brief Body of do_read_view() and do_read_stored_view(): the read lock
+ *        is kept only along with a view.
+ */
+static int
+read_view (const char* img_id, int resolution, int create, struct img_view* view, int* stored,
+           struct imgst_file* imgst_file)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(view);
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->file);
+    if (resolution < RES_THUMB || resolution > RES_ORIG) return ERR_INVALID_ARGUMENT;
+
+    *view = (struct img_view) { NULL, 0, NULL, 0, NULL };
+
+    imgst_read_lock(imgst_file);
+    const int ret = map_image(img_id, resolution, create, view, stored, imgst_file);
+    if (ret != ERR_NONE || !*stored) {
+        imgst_unlock(imgst_file);
+        *view = (struct img_view) { NULL, 0, NULL, 0, NULL };
+        return ret;
+    }
+    view->imgst_file = imgst_file;
+    return ERR_NONE;
+}
+
+// See imgStore.h
+int do_read_view(const char* img_id, int resolution, struct img_view* view, struct imgst_file* imgst_file)
+{
+    int stored = 0; // (always set once created)
+    return read_view(img_id, resolution, 1, view, &stored, imgst_file);
+}
+
+// See imgStore.h
+int do_read_stored_view(const char* img_id, int resolution, struct img_view* view, int* stored,
+                        struct imgst_file* imgst_file)
+{
+    M_REQUIRE_NON_NULL(stored);
+    return read_view(img_id, resolution, 0, view, stored, imgst_file);
+}
+
+// See imgStore.h
+void do_release_view(struct img_view* view)
+{
+    if (view == NULL || view->imgst_file == NULL) return;
+
+    if (view->map != NULL) munmap(view->map, view->map_size);
+    imgst_unlock(view->imgst_file);
+    *view = (struct img_view) { NULL, 0, NULL, 0, NULL };
+}
 
-            // If the found image does not exist in the given resolution, creates it
-            if (imgst_file->metadata[i].offset[resolution] == 0) {
-                M_EXIT_IF_ERR(lazily_resize(resolution, imgst_file, i));
+/**
+ * @brief Body of do_read_stream(), under the read lock.
+ */
+static int
+stream_image (const char* img_id, int resolution, size_t chunk_size, img_chunk_callback callback, void* arg,
+              struct imgst_file* imgst_file)
+{
+    size_t i = 0;
+    M_EXIT_IF_ERR(find_image(img_id, resolution, 1, imgst_file, &i));
+
+    const uint64_t offset = imgst_file->metadata[i].offset[resolution];
+    const uint32_t size = imgst_file->metadata[i].size[resolution];
+    if (size < chunk_size) chunk_size = size;
+
+    char* chunk = malloc(chunk_size > 0 ? chunk_size : 1);
+    M_EXIT_IF_NULL(chunk, chunk_size);
+
+    int ret = ERR_NONE;
+    for (uint32_t done = 0; done < size && ret == ERR_NONE; ) {
+        const size_t n = size - done < chunk_size ? size - done : chunk_size;
+        ret = pread_full(fileno(imgst_file->file), chunk, n, offset + done);
+        if (ret == ERR_NONE) ret = callback(chunk, n, arg);
+        done += (uint32_t) n;
+    }
+
+    free(chunk);
+    return ret;
+}
+
+// See imgStore.h
+int do_read_stream(const char* img_id, int resolution, size_t chunk_size, img_chunk_callback callback, void* arg,
+                   struct imgst_file* imgst_file)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(callback);
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->file);
+    if (resolution < RES_THUMB || resolution > RES_ORIG) return ERR_INVALID_ARGUMENT;
+    if (chunk_size == 0) chunk_size = READ_CHUNK_SIZE;
+
+    imgst_read_lock(imgst_file);
+    const int ret = stream_image(img_id, resolution, chunk_size, callback, arg, imgst_file);
+    imgst_unlock(imgst_file);
+    return ret;
+}
+
+/**
+ * @brief An image of a batch, at its place in the file.
+ */
+struct read_extent {
+    uint64_t offset; // position of the image in the file
+    size_t image;    // position of the image in the batch
+};
+
+/**
+ * @brief Compares two extents by offset (for qsort).
+ */
+static int
+compare_extent (const void* a, const void* b)
+{
+    const uint64_t x = ((const struct read_extent*) a)->offset;
+    const uint64_t y = ((const struct read_extent*) b)->offset;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Looks up the images of a batch and sets their sizes (0 and an
+ *        error if not found). Missing resolutions are created (which
+ *        releases the read lock for a while) if 'create' is set, and
+ *        'relocked' is then set.
+ */
+static void
+resolve_batch (struct img_to_read* images, size_t nb_images, struct read_extent* extents,
+               struct imgst_file* imgst_file, int create, int* relocked)
+{
+    for (size_t k = 0; k < nb_images; ++k) {
+        struct img_to_read* image = &images[k];
+        image->size = 0;
+        extents[k] = (struct read_extent) { 0, k };
+        if (image->error != ERR_NONE) continue;
+
+        size_t i = 0;
+        image->error = index_find_id(imgst_file, image->img_id, SIZE_MAX, &i);
+        if (image->error == ERR_NONE && imgst_file->metadata[i].offset[image->resolution] == 0) {
+            if (create) {
+                *relocked = 1;
+                image->error = find_image(image->img_id, image->resolution, 1, imgst_file, &i);
+            } else {
+                image->error = ERR_IO; // created then removed meanwhile
             }
+        }
+        if (image->error == ERR_NONE) {
+            extents[k].offset = imgst_file->metadata[i].offset[image->resolution];
+            image->size = imgst_file->metadata[i].size[image->resolution];
+        }
+    }
+}
 
-            // Reads the image content in the image buffer
-            *image_size = imgst_file->metadata[i].size[resolution];
-            *image_buffer = calloc(1, *image_size);
-            M_EXIT_IF_NULL(*image_buffer, *image_size);
+/**
+ * @brief Reads the iovcnt buffers of 'iov' from offset 'offset' of a file
+ *        (preadv(), repeated on partial reads; 'iov' is consumed).
+ */
+static int
+preadv_full (int fd, struct iovec* iov, int iovcnt, uint64_t offset)
+{
+    while (iovcnt > 0) {
+        const ssize_t n = preadv(fd, iov, iovcnt, (off_t) offset);
+        if (n <= 0) return ERR_IO;
+        offset += (uint64_t) n;
+
+        size_t left = (size_t) n;
+        while (iovcnt > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Body of do_read_batch(), under the read lock: the images are
+ *        read run by run, a run being contiguous images of the file.
+ */
+static int
+read_batch (struct img_to_read* images, size_t nb_images, struct imgst_file* imgst_file)
+{
+    struct read_extent* extents = calloc(nb_images, sizeof(struct read_extent));
+    struct iovec* iov = calloc(nb_images < MAX_RUN_IMAGES ? nb_images : MAX_RUN_IMAGES, sizeof(struct iovec));
+    if (extents == NULL || iov == NULL) {
+        free(extents);
+        free(iov);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // The offsets are only stable once no resolution has to be created anymore
+    int relocked = 0;
+    resolve_batch(images, nb_images, extents, imgst_file, 1, &relocked);
+    if (relocked) resolve_batch(images, nb_images, extents, imgst_file, 0, &relocked);
+    qsort(extents, nb_images, sizeof(struct read_extent), compare_extent);
+
+    int ret = ERR_NONE;
+    for (size_t first = 0; first < nb_images && ret == ERR_NONE; ) {
+        struct img_to_read* image = &images[extents[first].image];
+        if (image->error != ERR_NONE) {
+            ++first;
+            continue;
+        }
 
-            int error_load = load_image_from_imgst(i, resolution, *image_buffer, *image_size, imgst_file);
-            if (error_load != ERR_NONE) {
-                FREE_POINTER(*image_buffer);
+        // The run: the next images starting where the previous one ends
+        size_t end = first;
+        uint64_t next = extents[first].offset;
+        int iovcnt = 0;
+        while (end < nb_images && iovcnt < MAX_RUN_IMAGES) {
+            struct img_to_read* in_run = &images[extents[end].image];
+            if (in_run->error != ERR_NONE || extents[end].offset != next) break;
+
+            in_run->buffer = malloc(in_run->size > 0 ? in_run->size : 1);
+            if (in_run->buffer == NULL) {
+                ret = ERR_OUT_OF_MEMORY;
+                break;
             }
+            iov[iovcnt].iov_base = in_run->buffer;
+            iov[iovcnt].iov_len = in_run->size;
+            ++iovcnt;
+            next += in_run->size;
+            ++end;
+        }
+
+        int error_run = ret;
+        if (error_run == ERR_NONE && next > extents[first].offset) {
+            error_run = preadv_full(fileno(imgst_file->file), iov, iovcnt, extents[first].offset);
+        }
+        for (size_t e = first; e < end && error_run != ERR_NONE; ++e) {
+            FREE_POINTER(images[extents[e].image].buffer);
+            images[extents[e].image].error = error_run;
+        }
+        first = end;
+    }
+
+    free(extents);
+    free(iov);
+    return ret;
+}
+
+// See imgStore.h
+int do_read_batch(struct img_to_read* images, size_t nb_images, struct imgst_file* imgst_file)
+{
+    M_REQUIRE_NON_NULL(images);
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->file);
+    if (nb_images == 0) return ERR_NONE;
+
+    for (size_t k = 0; k < nb_images; ++k) {
+        M_REQUIRE_NON_NULL(images[k].img_id);
+        images[k].buffer = NULL;
+        images[k].error = images[k].resolution < RES_THUMB || images[k].resolution > RES_ORIG ? ERR_INVALID_ARGUMENT : ERR_NONE;
+    }
+
+    imgst_read_lock(imgst_file);
+    const int ret = read_batch(images, nb_images, imgst_file);
+    imgst_unlock(imgst_file);
 
-            return error_load;
+    if (ret != ERR_NONE) {
+        for (size_t k = 0; k < nb_images; ++k) {
+            FREE_POINTER(images[k].buffer);
+            if (images[k].error == ERR_NONE) images[k].error = ret;
         }
     }
-    return ERR_FILE_NOT_FOUND;
-}
\ No newline at end of file
+    return ret;
+}
@@ -0,0 +1,384 @@
+/**
+ * @file index.c
+ * @brief imgStore library: in-memory index of the metadata.
+ *
+ * Open-addressing hash table with linear probing; deletions shift the
+ * following buckets back, so that no tombstone is needed.
+ */
+
+#include "imgStore.h"
+#include "index.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME        16777619u
+
+#define WORD_BITS 64 // number of positions per word of the bitmap
+
+// ======================================================================
+/**
+ * @brief FNV-1a hash of an image ID.
+ */
+static uint32_t hash_id(const char* img_id)
+{
+    uint32_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < MAX_IMG_ID && img_id[i] != '\0'; ++i) {
+        hash = (hash ^ (unsigned char) img_id[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+// ======================================================================
+/**
+ * @brief Hash of a SHA: its first bytes are already uniformly distributed.
+ */
+static uint32_t hash_sha(const unsigned char* SHA)
+{
+    uint32_t hash = 0;
+    memcpy(&hash, SHA, sizeof(hash));
+    return hash;
+}
+
+// ======================================================================
+/**
+ * @brief Inserts the pair (hash, index) in the table.
+ *        The table is sized at build time so that it is never full.
+ */
+static void table_insert(struct index_bucket* table, size_t capacity, uint32_t hash, size_t index)
+{
+    const size_t mask = capacity - 1;
+    size_t b = hash & mask;
+    while (table[b].slot != 0) {
+        b = (b + 1) & mask;
+    }
+    table[b].hash = hash;
+    table[b].slot = (uint32_t) index + 1;
+}
+
+// ======================================================================
+/**
+ * @brief Removes the pair (hash, index) from the table (if present).
+ */
+static void table_remove(struct index_bucket* table, size_t capacity, uint32_t hash, size_t index)
+{
+    const size_t mask = capacity - 1;
+    size_t b = hash & mask;
+    while (table[b].slot != 0 && table[b].slot != index + 1) {
+        b = (b + 1) & mask;
+    }
+    if (table[b].slot == 0) return; // not found
+
+    // Shifts back the following buckets of the cluster which are not at their home position
+    size_t hole = b;
+    for (size_t next = (hole + 1) & mask; table[next].slot != 0; next = (next + 1) & mask) {
+        const size_t home = table[next].hash & mask;
+        // moves 'next' to the hole unless its home lies cyclically in ]hole, next]
+        const int stays = (hole <= next) ? (hole < home && home <= next)
+                                         : (hole < home || home <= next);
+        if (!stays) {
+            table[hole] = table[next];
+            hole = next;
+        }
+    }
+    table[hole].slot = 0;
+}
+
+// ======================================================================
+/**
+ * @brief Finds the bucket of the blob with the given SHA, or the empty
+ *        bucket ending its cluster if not present.
+ */
+static size_t blob_bucket(const struct imgst_file* imgst_file, const unsigned char* SHA, uint32_t hash)
+{
+    const struct imgst_index* idx = imgst_file->index;
+    const size_t mask = idx->capacity - 1;
+    size_t b = hash & mask;
+    while (idx->blobs[b].slot != 0
+           && (idx->blobs[b].hash != hash || compare_sha(imgst_file->metadata[idx->blobs[b].slot - 1].SHA, SHA))) {
+        b = (b + 1) & mask;
+    }
+    return b;
+}
+
+// ======================================================================
+/**
+ * @brief Adds a reference to the blob of the image at position 'index'.
+ */
+static void blob_acquire(struct imgst_file* imgst_file, size_t index)
+{
+    struct index_blob* blobs = imgst_file->index->blobs;
+    const uint32_t hash = hash_sha(imgst_file->metadata[index].SHA);
+    const size_t b = blob_bucket(imgst_file, imgst_file->metadata[index].SHA, hash);
+    if (blobs[b].slot == 0) {
+        blobs[b].hash = hash;
+        blobs[b].slot = (uint32_t) index + 1;
+        blobs[b].refs = 0;
+    }
+    ++blobs[b].refs;
+}
+
+// ======================================================================
+/**
+ * @brief Removes the reference of the image at position 'index' (already
+ *        removed from the SHA table) to its blob.
+ */
+static void blob_release(struct imgst_file* imgst_file, size_t index)
+{
+    struct imgst_index* idx = imgst_file->index;
+    const size_t b = blob_bucket(imgst_file, imgst_file->metadata[index].SHA, hash_sha(imgst_file->metadata[index].SHA));
+    if (idx->blobs[b].slot == 0) return; // not found
+
+    if (--idx->blobs[b].refs > 0) {
+        // The blob is found through one of its images: another one if this one goes
+        size_t other = 0;
+        if (idx->blobs[b].slot == index + 1
+            && index_find_sha(imgst_file, imgst_file->metadata[index].SHA, index, &other) == ERR_NONE) {
+            idx->blobs[b].slot = (uint32_t) other + 1;
+        }
+        return;
+    }
+
+    // Shifts back the following buckets of the cluster (as table_remove)
+    const size_t mask = idx->capacity - 1;
+    size_t hole = b;
+    for (size_t next = (hole + 1) & mask; idx->blobs[next].slot != 0; next = (next + 1) & mask) {
+        const size_t home = idx->blobs[next].hash & mask;
+        const int stays = (hole <= next) ? (hole < home && home <= next)
+                                         : (hole < home || home <= next);
+        if (!stays) {
+            idx->blobs[hole] = idx->blobs[next];
+            hole = next;
+        }
+    }
+    idx->blobs[hole].slot = 0;
+}
+
+// See index.h
+int index_build(struct imgst_file* imgst_file)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->metadata);
+
+    imgst_file->index = NULL;
+
+    struct imgst_index* index = calloc(1, sizeof(struct imgst_index));
+    M_EXIT_IF_NULL(index, sizeof(struct imgst_index));
+
+    // At most half full, so that a miss costs about one probe
+    index->capacity = 1;
+    while (index->capacity < 2 * (size_t) imgst_file->header.max_files) {
+        index->capacity <<= 1;
+    }
+
+    index->nb_words = (imgst_file->header.max_files + WORD_BITS - 1) / WORD_BITS;
+
+    index->by_id  = calloc(index->capacity, sizeof(struct index_bucket));
+    index->by_sha = calloc(index->capacity, sizeof(struct index_bucket));
+    index->blobs  = calloc(index->capacity, sizeof(struct index_blob));
+    index->used   = calloc(index->nb_words, sizeof(uint64_t));
+    if (index->by_id == NULL || index->by_sha == NULL || index->blobs == NULL || index->used == NULL) {
+        FREE_POINTER(index->by_id);
+        FREE_POINTER(index->by_sha);
+        FREE_POINTER(index->blobs);
+        FREE_POINTER(index->used);
+        FREE_POINTER(index);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // The positions after max_files in the last word are never free
+    const size_t tail = imgst_file->header.max_files % WORD_BITS;
+    if (tail != 0) {
+        index->used[index->nb_words - 1] = ~UINT64_C(0) << tail;
+    }
+
+    imgst_file->index = index;
+    for (size_t i = 0; i < imgst_file->header.max_files; ++i) {
+        if (imgst_file->metadata[i].is_valid == NON_EMPTY) {
+            index_add(imgst_file, i);
+        }
+    }
+
+    return ERR_NONE;
+}
+
+// See index.h
+void index_free(struct imgst_file* imgst_file)
+{
+    if (imgst_file != NULL && imgst_file->index != NULL) {
+        FREE_POINTER(imgst_file->index->by_id);
+        FREE_POINTER(imgst_file->index->by_sha);
+        FREE_POINTER(imgst_file->index->blobs);
+        FREE_POINTER(imgst_file->index->used);
+        FREE_POINTER(imgst_file->index);
+    }
+}
+
+// See index.h
+void index_add(struct imgst_file* imgst_file, size_t index)
+{
+    if (imgst_file == NULL || imgst_file->index == NULL) return;
+
+    struct imgst_index* idx = imgst_file->index;
+    table_insert(idx->by_id,  idx->capacity, hash_id (imgst_file->metadata[index].img_id), index);
+    table_insert(idx->by_sha, idx->capacity, hash_sha(imgst_file->metadata[index].SHA),    index);
+    blob_acquire(imgst_file, index);
+    idx->used[index / WORD_BITS] |= UINT64_C(1) << (index % WORD_BITS);
+}
+
+// See index.h
+void index_remove(struct imgst_file* imgst_file, size_t index)
+{
+    if (imgst_file == NULL || imgst_file->index == NULL) return;
+
+    struct imgst_index* idx = imgst_file->index;
+    table_remove(idx->by_id,  idx->capacity, hash_id (imgst_file->metadata[index].img_id), index);
+    table_remove(idx->by_sha, idx->capacity, hash_sha(imgst_file->metadata[index].SHA),    index);
+    blob_release(imgst_file, index);
+    idx->used[index / WORD_BITS] &= ~(UINT64_C(1) << (index % WORD_BITS));
+    if (index / WORD_BITS < idx->first_free_word) {
+        idx->first_free_word = index / WORD_BITS;
+    }
+}
+
+// See index.h
+int index_find_id(const struct imgst_file* imgst_file, const char* img_id, size_t skip, size_t* index)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(index);
+
+    const struct imgst_index* idx = imgst_file->index;
+
+    if (idx == NULL) { // no index (e.g. hand-made imgst_file): linear scan
+        for (size_t i = 0; i < imgst_file->header.max_files; ++i) {
+            if (i != skip && imgst_file->metadata[i].is_valid == NON_EMPTY
+                && !strncmp(imgst_file->metadata[i].img_id, img_id, MAX_IMG_ID)) {
+                *index = i;
+                return ERR_NONE;
+            }
+        }
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    const uint32_t hash = hash_id(img_id);
+    const size_t mask = idx->capacity - 1;
+    for (size_t b = hash & mask; idx->by_id[b].slot != 0; b = (b + 1) & mask) {
+        const size_t i = idx->by_id[b].slot - 1;
+        if (idx->by_id[b].hash == hash && i != skip
+            && !strncmp(imgst_file->metadata[i].img_id, img_id, MAX_IMG_ID)) {
+            *index = i;
+            return ERR_NONE;
+        }
+    }
+    return ERR_FILE_NOT_FOUND;
+}
+
+// See index.h
+int index_find_sha(const struct imgst_file* imgst_file, const unsigned char* SHA, size_t skip, size_t* index)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(SHA);
+    M_REQUIRE_NON_NULL(index);
+
+    const struct imgst_index* idx = imgst_file->index;
+
+    if (idx == NULL) { // no index (e.g. hand-made imgst_file): linear scan
+        for (size_t i = 0; i < imgst_file->header.max_files; ++i) {
+            if (i != skip && imgst_file->metadata[i].is_valid == NON_EMPTY
+                && !compare_sha(imgst_file->metadata[i].SHA, SHA)) {
+                *index = i;
+                return ERR_NONE;
+            }
+        }
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    const uint32_t hash = hash_sha(SHA);
+    const size_t mask = idx->capacity - 1;
+    for (size_t b = hash & mask; idx->by_sha[b].slot != 0; b = (b + 1) & mask) {
+        const size_t i = idx->by_sha[b].slot - 1;
+        if (idx->by_sha[b].hash == hash && i != skip
+            && !compare_sha(imgst_file->metadata[i].SHA, SHA)) {
+            *index = i;
+            return ERR_NONE;
+        }
+    }
+    return ERR_FILE_NOT_FOUND;
+}
+
+// See index.h
+int index_find_free(struct imgst_file* imgst_file, size_t* index)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(index);
+
+    struct imgst_index* idx = imgst_file->index;
+
+    if (idx == NULL) { // no index (e.g. hand-made imgst_file): linear scan
+        for (size_t i = 0; i < imgst_file->header.max_files; ++i) {
+            if (imgst_file->metadata[i].is_valid != NON_EMPTY) {
+                *index = i;
+                return ERR_NONE;
+            }
+        }
+        return ERR_FULL_IMGSTORE;
+    }
+
+    // Skips the full words (for good: they can only get a free position through index_remove)
+    while (idx->first_free_word < idx->nb_words && idx->used[idx->first_free_word] == ~UINT64_C(0)) {
+        ++idx->first_free_word;
+    }
+    if (idx->first_free_word == idx->nb_words) return ERR_FULL_IMGSTORE;
+
+    const uint64_t free_bits = ~idx->used[idx->first_free_word];
+    *index = idx->first_free_word * WORD_BITS + (size_t) __builtin_ctzll(free_bits);
+    return ERR_NONE;
+}
+
+// See index.h
+uint32_t index_blob_refs(const struct imgst_file* imgst_file, const unsigned char* SHA)
+{
+    if (imgst_file == NULL || SHA == NULL) return 0;
+
+    if (imgst_file->index == NULL) { // no index (e.g. hand-made imgst_file): linear scan
+        uint32_t refs = 0;
+        for (size_t i = 0; i < imgst_file->header.max_files; ++i) {
+            refs += imgst_file->metadata[i].is_valid == NON_EMPTY && !compare_sha(imgst_file->metadata[i].SHA, SHA);
+        }
+        return refs;
+    }
+
+    const size_t b = blob_bucket(imgst_file, SHA, hash_sha(SHA));
+    return imgst_file->index->blobs[b].slot != 0 ? imgst_file->index->blobs[b].refs : 0;
+}
+
+// See index.h
+size_t index_find_all_sha(const struct imgst_file* imgst_file, const unsigned char* SHA, size_t* indexes, size_t max_indexes)
+{
+    if (imgst_file == NULL || SHA == NULL || indexes == NULL) return 0;
+
+    size_t nb_found = 0;
+    const struct imgst_index* idx = imgst_file->index;
+
+    if (idx == NULL) { // no index (e.g. hand-made imgst_file): linear scan
+        for (size_t i = 0; i < imgst_file->header.max_files && nb_found < max_indexes; ++i) {
+            if (imgst_file->metadata[i].is_valid == NON_EMPTY && !compare_sha(imgst_file->metadata[i].SHA, SHA)) {
+                indexes[nb_found++] = i;
+            }
+        }
+        return nb_found;
+    }
+
+    const uint32_t hash = hash_sha(SHA);
+    const size_t mask = idx->capacity - 1;
+    for (size_t b = hash & mask; idx->by_sha[b].slot != 0 && nb_found < max_indexes; b = (b + 1) & mask) {
+        const size_t i = idx->by_sha[b].slot - 1;
+        if (idx->by_sha[b].hash == hash && !compare_sha(imgst_file->metadata[i].SHA, SHA)) {
+            indexes[nb_found++] = i;
+        }
+    }
+    return nb_found;
+}
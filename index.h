@@ -0,0 +1,136 @@
+#pragma once
+
+/**
+ * @file index.h
+ * @brief Methods offered by 'index.c'.
+ *
+ * In-memory hash indexes of the valid metadata entries (by img_id and by
+ * SHA), table of the stored contents (blobs) with their number of
+ * references, and bitmap of the used metadata entries, built by do_open()
+ * (or do_create()) and kept up to date by do_insert() and do_delete().
+ *
+ * A blob is an image content (identified by its SHA) shared by all the
+ * valid entries with that SHA (see dedup.c): they point to the same
+ * original, and to the same resized variants once generated (see
+ * image_content.c).
+ */
+
+#include "imgStore.h"
+
+/**
+ * @brief One bucket of the open-addressing hash table.
+ */
+struct index_bucket {
+    uint32_t hash; // hash of the key stored in this bucket
+    uint32_t slot; // position of the image in the metadata, plus one (0 if the bucket is empty)
+};
+
+/**
+ * @brief One bucket of the blob table.
+ */
+struct index_blob {
+    uint32_t hash; // hash of the SHA of the blob
+    uint32_t slot; // position of one of its images in the metadata, plus one (0 if the bucket is empty)
+    uint32_t refs; // number of valid images sharing it
+};
+
+/**
+ * @brief The in-memory index of an imgStore.
+ */
+struct imgst_index {
+    size_t capacity;              // number of buckets (a power of two)
+    struct index_bucket* by_id;   // img_id -> metadata position
+    struct index_bucket* by_sha;  // SHA -> metadata position(s) (duplicates share the same SHA)
+    struct index_blob* blobs;     // SHA -> number of references (one bucket per distinct content)
+    uint64_t* used;               // bitmap of the valid metadata positions
+    size_t nb_words;              // number of words of the bitmap
+    size_t first_free_word;       // no word before this one has a free position
+};
+
+/**
+ * @brief Builds the index of all the valid images of the imgStore.
+ *
+ * @param imgst_file The main in-memory data structure, with its metadata already loaded.
+ * @return Some error code. 0 if no error.
+ */
+int index_build(struct imgst_file* imgst_file);
+
+/**
+ * @brief Frees the index of the imgStore (if any).
+ *
+ * @param imgst_file The main in-memory data structure.
+ */
+void index_free(struct imgst_file* imgst_file);
+
+/**
+ * @brief Adds the (valid) image at position 'index' in the metadata to the index.
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @param index The position of the image in the metadata.
+ */
+void index_add(struct imgst_file* imgst_file, size_t index);
+
+/**
+ * @brief Removes the image at position 'index' in the metadata from the index.
+ *        Must be called before its img_id or SHA is modified.
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @param index The position of the image in the metadata.
+ */
+void index_remove(struct imgst_file* imgst_file, size_t index);
+
+/**
+ * @brief Finds the position of the valid image with the given ID.
+ *        Falls back to a linear scan of the metadata if the imgStore has no index.
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @param img_id The ID of the image to be found.
+ * @param skip A position to be ignored (e.g. the image being inserted), or SIZE_MAX.
+ * @param index Set to the position of the image in the metadata, if found.
+ * @return ERR_NONE if found, ERR_FILE_NOT_FOUND otherwise.
+ */
+int index_find_id(const struct imgst_file* imgst_file, const char* img_id, size_t skip, size_t* index);
+
+/**
+ * @brief Finds the position of a valid image with the given SHA.
+ *        Falls back to a linear scan of the metadata if the imgStore has no index.
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @param SHA The SHA to be found.
+ * @param skip A position to be ignored (e.g. the image being inserted), or SIZE_MAX.
+ * @param index Set to the position of the first image found with this SHA.
+ * @return ERR_NONE if found, ERR_FILE_NOT_FOUND otherwise.
+ */
+int index_find_sha(const struct imgst_file* imgst_file, const unsigned char* SHA, size_t skip, size_t* index);
+
+/**
+ * @brief Finds the first free (i.e. non valid) position in the metadata.
+ *        Falls back to a linear scan of the metadata if the imgStore has no index.
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @param index Set to the free position found.
+ * @return ERR_NONE if found, ERR_FULL_IMGSTORE otherwise.
+ */
+int index_find_free(struct imgst_file* imgst_file, size_t* index);
+
+/**
+ * @brief Number of valid images sharing the content with the given SHA.
+ *        Falls back to a linear scan of the metadata if the imgStore has no index.
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @param SHA The SHA of the content.
+ * @return The number of references (0 if the content is not stored).
+ */
+uint32_t index_blob_refs(const struct imgst_file* imgst_file, const unsigned char* SHA);
+
+/**
+ * @brief Finds the positions of all the valid images with the given SHA.
+ *        Falls back to a linear scan of the metadata if the imgStore has no index.
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @param SHA The SHA to be found.
+ * @param indexes Filled with the positions found (in no particular order).
+ * @param max_indexes The size of 'indexes'.
+ * @return The number of positions found (at most max_indexes).
+ */
+size_t index_find_all_sha(const struct imgst_file* imgst_file, const unsigned char* SHA, size_t* indexes, size_t max_indexes);
@@ -0,0 +1,339 @@
+/**
+ * @file journal.c
+ * @brief imgStore library: redo journal of the header and metadata updates.
+ *
+ * A transaction is stored as a struct journal_tx, its records (each a
+ * struct journal_record followed by the new bytes) and a checksum of
+ * all of them. Recovery stops at the first incomplete transaction.
+ */
+
+#define _DEFAULT_SOURCE // for fileno, fsync, ftruncate, fseeko, ftello, flock, clock_gettime
+
+#include "journal.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>   // for fsync, ftruncate
+#include <sys/file.h> // for flock
+
+#define JOURNAL_MAGIC 0x4e524a49u // "IJRN"
+#define JOURNAL_INITIAL_CAPACITY 4096
+
+/* Beginning of a transaction */
+struct journal_tx {
+    uint32_t magic;
+    uint32_t nb_records;
+    uint64_t size; // size of the records, headers and data
+};
+
+/* Beginning of a record, followed by its new bytes */
+struct journal_record {
+    uint64_t offset; // position of the bytes in the imgStore file
+    uint64_t size;   // number of bytes
+};
+
+/********************************************************************//**
+ * FNV-1a hash of the transaction, as its checksum.
+ */
+static uint64_t
+checksum (const char* data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= (unsigned char) data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/********************************************************************//**
+ * Writes the complete transactions found in 'data' to the imgStore file,
+ * stopping at the first incomplete (or corrupted) one.
+ */
+static int
+apply_transactions (int imgst, const char* data, size_t size)
+{
+    size_t pos = 0;
+    while (size - pos >= sizeof(struct journal_tx)) {
+        struct journal_tx tx;
+        memcpy(&tx, data + pos, sizeof(tx));
+        const size_t tx_size = sizeof(tx) + (size_t) tx.size;
+        if (tx.magic != JOURNAL_MAGIC
+            || tx.size > size - pos - sizeof(tx)
+            || size - pos - tx_size < sizeof(uint64_t)) break;
+
+        uint64_t sum = 0;
+        memcpy(&sum, data + pos + tx_size, sizeof(sum));
+        if (sum != checksum(data + pos, tx_size)) break;
+
+        // The transaction is complete: writes its records
+        size_t rec = pos + sizeof(tx);
+        for (uint32_t r = 0; r < tx.nb_records; ++r) {
+            struct journal_record record;
+            memcpy(&record, data + rec, sizeof(record));
+            rec += sizeof(record);
+            if (record.size > 0) M_EXIT_IF_ERR(pwrite_full(imgst, data + rec, (size_t) record.size, record.offset));
+            rec += (size_t) record.size;
+        }
+        pos += tx_size + sizeof(uint64_t);
+    }
+    return ERR_NONE;
+}
+
+/********************************************************************//**
+ * Makes room for 'size' more bytes in the buffer.
+ */
+static int
+reserve (struct imgst_journal* journal, size_t size)
+{
+    if (journal->capacity - journal->size >= size) return ERR_NONE;
+
+    size_t capacity = journal->capacity == 0 ? JOURNAL_INITIAL_CAPACITY : journal->capacity;
+    while (capacity - journal->size < size) capacity *= 2;
+
+    char* buffer = realloc(journal->buffer, capacity);
+    if (buffer == NULL) return ERR_OUT_OF_MEMORY;
+    journal->buffer = buffer;
+    journal->capacity = capacity;
+    return ERR_NONE;
+}
+
+/********************************************************************//**
+ * Milliseconds elapsed since 'start'.
+ */
+static long
+elapsed_ms (const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000L + (now.tv_nsec - start->tv_nsec) / 1000000L;
+}
+
+// See journal.h
+char*
+journal_filename (const char* imgst_filename)
+{
+    const size_t length = strlen(imgst_filename);
+    char* filename = malloc(length + sizeof(JOURNAL_SUFFIX));
+    if (filename != NULL) {
+        memcpy(filename, imgst_filename, length);
+        memcpy(filename + length, JOURNAL_SUFFIX, sizeof(JOURNAL_SUFFIX));
+    }
+    return filename;
+}
+
+// See journal.h
+int
+journal_recover (const char* imgst_filename)
+{
+    M_REQUIRE_NON_NULL(imgst_filename);
+
+    char* filename = journal_filename(imgst_filename);
+    if (filename == NULL) return ERR_OUT_OF_MEMORY;
+
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) { // no journal
+        free(filename);
+        return ERR_NONE;
+    }
+
+    // A journal locked by a running process is not left behind by a crash
+    if (flock(fileno(file), LOCK_SH | LOCK_NB) != 0) {
+        fclose(file);
+        free(filename);
+        return ERR_NONE;
+    }
+
+    // Reads the whole journal
+    int ret = ERR_NONE;
+    char* data = NULL;
+    off_t size = 0;
+    if (fseeko(file, 0, SEEK_END) != 0 || (size = ftello(file)) < 0) {
+        ret = ERR_IO;
+    } else if (size > 0) {
+        data = malloc((size_t) size);
+        if (data == NULL) {
+            ret = ERR_OUT_OF_MEMORY;
+        } else {
+            rewind(file);
+            if (fread(data, (size_t) size, 1, file) != 1) ret = ERR_IO;
+        }
+    }
+
+    // Replays it in the imgStore, and makes it durable before removing the journal
+    if (ret == ERR_NONE && size > 0) {
+        FILE* imgst = fopen(imgst_filename, "rb+");
+        if (imgst == NULL) {
+            ret = ERR_IO;
+        } else {
+            ret = apply_transactions(fileno(imgst), data, (size_t) size);
+            if (ret == ERR_NONE && (fflush(imgst) != 0 || fsync(fileno(imgst)) != 0)) ret = ERR_IO;
+            fclose(imgst);
+        }
+    }
+    fclose(file);
+    if (ret == ERR_NONE && remove(filename) != 0) ret = ERR_IO;
+
+    free(data);
+    free(filename);
+    return ret;
+}
+
+// See journal.h
+int
+journal_open (struct imgst_file* imgst_file, const char* imgst_filename,
+              int durability, unsigned group_ops, unsigned group_ms)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_filename);
+    if (imgst_file->read_only) return ERR_IO;
+
+    struct imgst_journal* journal = calloc(1, sizeof(struct imgst_journal));
+    if (journal == NULL) return ERR_OUT_OF_MEMORY;
+    journal->durability = durability;
+    journal->group_ops = group_ops;
+    journal->group_ms = group_ms;
+
+    journal->filename = journal_filename(imgst_filename);
+    if (journal->filename == NULL) {
+        free(journal);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // Only one process may journal the imgStore; the journal left behind by a crash was replayed by do_open()
+    journal->file = fopen(journal->filename, "ab");
+    if (journal->file == NULL
+        || flock(fileno(journal->file), LOCK_EX | LOCK_NB) != 0
+        || ftruncate(fileno(journal->file), 0) != 0) {
+        if (journal->file != NULL) fclose(journal->file);
+        free(journal->filename);
+        free(journal);
+        return ERR_IO;
+    }
+
+    imgst_file->journal = journal;
+    return ERR_NONE;
+}
+
+// See journal.h
+int
+journal_log (struct imgst_journal* journal, uint64_t offset, const void* data, size_t size)
+{
+    M_REQUIRE_NON_NULL(journal);
+    M_REQUIRE_NON_NULL(data);
+
+    // Starts the current transaction on its first record
+    if (journal->size == journal->tx_start) {
+        M_EXIT_IF_ERR(reserve(journal, sizeof(struct journal_tx)));
+        const struct journal_tx tx = { .magic = JOURNAL_MAGIC, .nb_records = 0, .size = 0 };
+        memcpy(journal->buffer + journal->size, &tx, sizeof(tx));
+        journal->size += sizeof(tx);
+    }
+
+    M_EXIT_IF_ERR(reserve(journal, sizeof(struct journal_record) + size));
+    const struct journal_record record = { .offset = offset, .size = size };
+    memcpy(journal->buffer + journal->size, &record, sizeof(record));
+    memcpy(journal->buffer + journal->size + sizeof(record), data, size);
+    journal->size += sizeof(record) + size;
+
+    struct journal_tx tx;
+    memcpy(&tx, journal->buffer + journal->tx_start, sizeof(tx));
+    ++tx.nb_records;
+    tx.size += sizeof(record) + size;
+    memcpy(journal->buffer + journal->tx_start, &tx, sizeof(tx));
+
+    return ERR_NONE;
+}
+
+// See journal.h
+int
+journal_commit (struct imgst_file* imgst_file)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+    struct imgst_journal* journal = imgst_file->journal;
+    M_REQUIRE_NON_NULL(journal);
+
+    if (journal->size > journal->tx_start) {
+        M_EXIT_IF_ERR(reserve(journal, sizeof(uint64_t)));
+        const uint64_t sum = checksum(journal->buffer + journal->tx_start, journal->size - journal->tx_start);
+        memcpy(journal->buffer + journal->size, &sum, sizeof(sum));
+        journal->size += sizeof(sum);
+        journal->tx_start = journal->size;
+
+        if (journal->nb_pending++ == 0) clock_gettime(CLOCK_MONOTONIC, &journal->first_pending);
+    }
+
+    return journal_flush(imgst_file, 0);
+}
+
+// See journal.h
+int
+journal_flush (struct imgst_file* imgst_file, int force)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+    struct imgst_journal* journal = imgst_file->journal;
+    M_REQUIRE_NON_NULL(journal);
+
+    if (journal->nb_pending == 0) return ERR_NONE;
+    if (!force && journal->durability == DURABILITY_GROUP
+        && !(journal->group_ops != 0 && journal->nb_pending >= journal->group_ops)
+        && !(journal->group_ms != 0 && elapsed_ms(&journal->first_pending) >= (long) journal->group_ms)) {
+        return ERR_NONE; // the group is not due yet
+    }
+
+    // The image contents must be on the disk before the metadata pointing to them
+    if (fflush(imgst_file->file) != 0 || fsync(fileno(imgst_file->file)) != 0) return ERR_IO;
+
+    // Writes the committed transactions to the journal (removing any partial write on failure)
+    const off_t start = ftello(journal->file);
+    if (start < 0) return ERR_IO;
+    if (fwrite(journal->buffer, journal->tx_start, 1, journal->file) != 1
+        || fflush(journal->file) != 0
+        || fsync(fileno(journal->file)) != 0) {
+        if (ftruncate(fileno(journal->file), start) == 0) fseeko(journal->file, start, SEEK_SET);
+        return ERR_IO;
+    }
+
+    // They are durable: writes them to the imgStore file
+    M_EXIT_IF_ERR(apply_transactions(fileno(imgst_file->file), journal->buffer, journal->tx_start));
+    if (fflush(imgst_file->file) != 0) return ERR_IO;
+
+    memmove(journal->buffer, journal->buffer + journal->tx_start, journal->size - journal->tx_start);
+    journal->size -= journal->tx_start;
+    journal->tx_start = 0;
+    journal->nb_pending = 0;
+
+    // Checkpoint: once the imgStore file is on the disk, the journal is not needed anymore
+    if (ftello(journal->file) >= JOURNAL_CHECKPOINT_SIZE) {
+        if (fsync(fileno(imgst_file->file)) != 0 || ftruncate(fileno(journal->file), 0) != 0) return ERR_IO;
+        rewind(journal->file);
+    }
+
+    return ERR_NONE;
+}
+
+// See journal.h
+int
+journal_close (struct imgst_file* imgst_file)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+    struct imgst_journal* journal = imgst_file->journal;
+    if (journal == NULL) return ERR_NONE;
+
+    // The journal is removed only once everything it holds is in the imgStore file, on the disk
+    int ret = journal_commit(imgst_file);
+    if (ret == ERR_NONE) ret = journal_flush(imgst_file, 1);
+    if (ret == ERR_NONE && (fflush(imgst_file->file) != 0 || fsync(fileno(imgst_file->file)) != 0)) ret = ERR_IO;
+
+    fclose(journal->file);
+    if (ret == ERR_NONE && remove(journal->filename) != 0) ret = ERR_IO;
+
+    free(journal->filename);
+    free(journal->buffer);
+    free(journal);
+    imgst_file->journal = NULL;
+    return ret;
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+/**
+ * @file journal.h
+ * @brief Methods offered by 'journal.c'.
+ *
+ * Redo journal of the header and metadata updates of an imgStore, kept in
+ * a file next to it (imgStore filename followed by JOURNAL_SUFFIX).
+ *
+ * With a journal (see do_set_durability()), update_header() and
+ * update_metadata() do not write the imgStore file: they log the new bytes
+ * in the current transaction, which commit_updates() closes at the end of
+ * each operation. Committed transactions are written to the journal and
+ * fsync'ed (after the image contents they point to), and only then written
+ * to the imgStore file. do_open() replays the complete transactions of a
+ * journal left behind by a crash.
+ */
+
+#include "imgStore.h"
+
+#include <time.h> // for struct timespec
+
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_CHECKPOINT_SIZE (1 << 20) // size above which the journal is emptied once applied
+
+/**
+ * @brief The redo journal of an open imgStore.
+ */
+struct imgst_journal {
+    FILE* file;                    // journal file
+    char* filename;                // its name
+    int durability;                // DURABILITY_SYNC or DURABILITY_GROUP
+    unsigned group_ops;            // (group commit) max. number of operations per group, 0 for no limit
+    unsigned group_ms;             // (group commit) max. delay of a group in milliseconds, 0 for no limit
+    char* buffer;                  // committed transactions not yet in the journal file, then the current one
+    size_t size;                   // size of the content of the buffer
+    size_t capacity;               // allocated size of the buffer
+    size_t tx_start;               // beginning of the current transaction in the buffer
+    size_t nb_pending;             // number of committed transactions in the buffer
+    struct timespec first_pending; // commit time of the first of them
+};
+
+/**
+ * @brief Builds the name of the journal of an imgStore.
+ *
+ * @param imgst_filename Path to the imgStore file.
+ * @return The name (to be freed by the caller), NULL if out of memory.
+ */
+char* journal_filename(const char* imgst_filename);
+
+/**
+ * @brief Replays the complete transactions of the journal of an imgStore
+ *        (if any) in the imgStore file, then removes the journal.
+ *
+ * @param imgst_filename Path to the imgStore file.
+ * @return Some error code. 0 if no error.
+ */
+int journal_recover(const char* imgst_filename);
+
+/**
+ * @brief Creates the (empty) journal of an open imgStore.
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @param imgst_filename Path to the imgStore file.
+ * @param durability DURABILITY_SYNC or DURABILITY_GROUP.
+ * @param group_ops Max. number of operations per group (DURABILITY_GROUP).
+ * @param group_ms Max. delay of a group in milliseconds (DURABILITY_GROUP).
+ * @return Some error code. 0 if no error.
+ */
+int journal_open(struct imgst_file* imgst_file, const char* imgst_filename,
+                 int durability, unsigned group_ops, unsigned group_ms);
+
+/**
+ * @brief Logs the new content of a part of the imgStore file in the current transaction.
+ *
+ * @param journal The journal.
+ * @param offset Position of the updated bytes in the imgStore file.
+ * @param data The new bytes.
+ * @param size Number of bytes.
+ * @return Some error code. 0 if no error.
+ */
+int journal_log(struct imgst_journal* journal, uint64_t offset, const void* data, size_t size);
+
+/**
+ * @brief Commits the current transaction, and makes the group of committed
+ *        transactions durable if it is due.
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @return Some error code. 0 if no error.
+ */
+int journal_commit(struct imgst_file* imgst_file);
+
+/**
+ * @brief Makes the committed transactions durable: fsync's the image
+ *        contents, then the journal, and applies the transactions to the
+ *        imgStore file.
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @param force Whether to flush even if the group is not due.
+ * @return Some error code. 0 if no error.
+ */
+int journal_flush(struct imgst_file* imgst_file, int force);
+
+/**
+ * @brief Flushes the journal, fsync's the imgStore file, removes the
+ *        journal file and frees the journal.
+ *
+ * @param imgst_file The main in-memory data structure.
+ * @return Some error code. 0 if no error.
+ */
+int journal_close(struct imgst_file* imgst_file);
@@ -149,6 +149,24 @@ fi
 
 [ "x$my_ok" = 'x1' ] && echo '==> PASS' || { echo '==> FAIL'; ok=0; }
 
+# ======================================================================
+printf "Test %1d (delete frees the disk blocks of the image): " $((++test))
+safecp tests/data/test02.imgst_static
+probe="$(new_tmp_file)"
+if ! { head -c 65536 /dev/zero > "$probe" && fallocate -p -o 0 -l 65536 "$probe"; } 2>/dev/null; then
+    echo 'SKIPPED (no hole punching on this filesystem)'
+else
+    blocks_before=$($stat -c%b $db)
+    imgStoreMgr delete $db pic2 >/dev/null 2>&1
+    blocks_after=$($stat -c%b $db)
+    if [ $blocks_after -lt $blocks_before ]; then
+        echo 'PASS'
+    else
+        echo "FAIL: $blocks_after blocks after delete, $blocks_before before"
+        ok=0
+    fi
+fi
+
 # ======================================================================
 if [ "x$ok" = 'x1' ]; then
     echo "$0 SUCCESS"
@@ -258,6 +258,59 @@ $(image_txt pic5 $sha3 $size3 $offset3)"
 standard_test 'undelete of duplicate' \
 pic1 papillon.jpg "$output_txt" || ok=0
 
+# the space of a deleted image (not shared) is reused by a smaller one
+printf "${magenta}Test %1d${end} (delete pic2): " $((++test))
+check_output '' '' delete "$db" pic2 || ok=0
+sha6=76680a0ce93b0608948219bbbdfca452a4897517027c595eba6ab404ed595892
+size6=17327
+standard_test 'insert in the space of a deleted image' \
+pic6 coquelicots_small.jpg "$(header 9 5 100)
+$(image_txt pic1 $sha1 $size1 $offset1)
+$(image_txt pic6 $sha6 $size6  94540 '256 x 170')
+$(image_txt pic3 $sha3 $size3 $offset3)
+$(image_txt pic4 $sha1 $size1 $offset1)
+$(image_txt pic5 $sha3 $size3 $offset3)" || ok=0
+
+# ---- 3. insertions whose content is dropped
+printf "\n${yellow}III. Dropped contents:${end}\n"
+
+# ----------------------------------------------------------------------
+# params: info, expected size of the imgStore
+size_test () {
+    printf '\tImgStore size after %s: ' "$1"
+    local actual_size=$($stat -c%s $db)
+    if [ $actual_size -eq $2 ]; then
+        echo -e "${green}PASS${end}"
+    else
+        echo "Wrong ImgStore size: is ${actual_size}, where it shall be $2"
+        return 1
+    fi
+}
+
+db_size=$($stat -c%s $db)
+
+# the content read from a pipe (size unknown) is appended at the end of the file, then cut off
+printf "${magenta}Test %1d${end} (duplicate content from a pipe): " $((++test))
+check_output '' '' insert "$db" pic7 <(cat tests/data/foret.jpg) || ok=0
+size_test 'the duplicate' $db_size || ok=0
+
+error_test 'existing id from a pipe (insertion aborted)' "$exiid" pic1 <(cat tests/data/coquelicots.jpg) || ok=0
+size_test 'the abort' $db_size || ok=0
+
+# the content of a regular file is given the space of pic2 left by pic6, which is given back
+error_test 'existing id fitting a hole (insertion aborted)' "$exiid" pic1 tests/data/papillon.jpg || ok=0
+sha8=2566ed785c3c94d7db73e743aeb898f26eae83e77928c83934486c44b0cd109b
+size8=16299
+standard_test 'insert in the hole given back' \
+pic8 papillon_small.jpg "$(header 11 7 100)
+$(image_txt pic1 $sha1 $size1 $offset1)
+$(image_txt pic6 $sha6 $size6  94540 '256 x 170')
+$(image_txt pic3 $sha3 $size3 $offset3)
+$(image_txt pic4 $sha1 $size1 $offset1)
+$(image_txt pic5 $sha3 $size3 $offset3)
+$(image_txt pic7 $sha3 $size3 $offset3)
+$(image_txt pic8 $sha8 $size8 $((94540 + $size6)) '256 x 171')" $db_size || ok=0
+
 # ======================================================================
 if [ "x$ok" = 'x1' ]; then
     echo -e "$0 ${bold}${green}SUCCESS${end}"
@@ -146,20 +146,12 @@ standard_test () {
     fi
 
     printf '\tb. check content: '
-    local actual_size=$($stat -c%s "$file")
-    local expected_size=$($stat -c%s "$reffile")
-    if [ $actual_size -eq $expected_size ]; then
-        if cmp -s "$file" "$reffile"; then
-            rm "$file"
-            echo -e "${green}PASS${end}"
-        else
-            rm "$file"
-            echo -e "${red}FAIL${end}: content of image $file is not what I was expecting"
-            return 1
-        fi
+    if same_image "$file" "$reffile" $res; then
+        rm "$file"
+        echo -e "${green}PASS${end}"
     else
         rm "$file"
-        echo -e "${red}FAIL${end}: wrong image size ($file): got ${actual_size}, where I was expecting $expected_size"
+        echo -e "${red}FAIL${end}: content of image $file is not what I was expecting"
         return 1
     fi
 
@@ -201,8 +193,14 @@ standard_test 'default resolution' pic1 '' papillon.jpg || ok=0
 standard_test 'pic1 orig' pic1 orig papillon.jpg    || ok=0
 standard_test 'pic2 orig' pic2 orig coquelicots.jpg || ok=0
 
-# read with resized creation
-standard_test 'thumb first time' pic1 thumb papillon_thumb.jpg 192659 204785 || ok=0
+# a duplicate shares the resized images: the store grows once for both
+printf "${magenta}Test %1d${end} (insert duplicate of pic1): " $((++test))
+check_output '' '' insert "$db" pic3 tests/data/papillon.jpg || ok=0
+
+# read with resized creation (the size of the thumbnail depends on libvips)
+size1t=$(resized_size tests/data/papillon.jpg thumb)
+standard_test 'thumb first time' pic1 thumb papillon.jpg 192659 $((192659 + $size1t)) || ok=0
+standard_test 'thumb of the duplicate' pic3 thumb papillon.jpg $((192659 + $size1t)) $((192659 + $size1t)) || ok=0
 
 # ======================================================================
 if [ "x$ok" = 'x1' ]; then
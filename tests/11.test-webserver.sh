@@ -321,20 +321,12 @@ test_read () {
     fi
 
     printf '\tb. check content: '
-    local actual_size=$($stat -c%s "$file")
-    local expected_size=$($stat -c%s "$reffile")
-    if [ $actual_size -eq $expected_size ]; then
-        if cmp -s "$file" "$reffile"; then
-            rm "$file"
-            echo -e "${green}PASS${end}"
-        else
-            rm "$file"
-            echo -e "${red}FAIL${end}: content of image $file is not what I was expecting"
-            return 1
-        fi
+    if same_image "$file" "$reffile" $2; then
+        rm "$file"
+        echo -e "${green}PASS${end}"
     else
         rm "$file"
-        echo -e "${red}FAIL${end}: wrong image size ($file): got ${actual_size}, where I was expecting $expected_size"
+        echo -e "${red}FAIL${end}: content of image $file is not what I was expecting"
         return 1
     fi
 
@@ -464,10 +456,10 @@ test_url imgStore/list '{ "Images": [ "pic1", "pic2" ] }' || ok=0
 test_read 'first img' pic1 orig papillon.jpg    || ok=0
 test_read '2nd img'   pic2 orig coquelicots.jpg || ok=0
 
-# read with resized creation
+# read with resized creation (the size of the thumbnail depends on libvips)
 size_before=$original_size
-size_after=$(($size_before + 12126))
-test_read 'thumb first time' pic1 thumb papillon_thumb.jpg $size_before $size_after || ok=0
+size_after=$(($size_before + $(resized_size tests/data/papillon.jpg thumb)))
+test_read 'thumb first time' pic1 thumb papillon.jpg $size_before $size_after || ok=0
 
 ## --------------------------------------------------
 ## test of delete
@@ -56,25 +56,22 @@ ioerr='I/O Error'
 sha1=66ac648b32a8268ed0b350b184cfa04c00c6236af3a2aa4411c01518f6061af8
 size1=72876
 offset1=21664
-size1t=12126
-size1s=16299
-thumbs1="$size1t 94540 $size1s 106666"
 
 sha2=95962b09e0fc9716ee4c2a1cf173f9147758235360d7ac0a73dfa378858b8a10
 size2=98119
 offset2=94540
 offset2_bis=122965
-size2t=12309
-size2s=17340
-thumbs2a="$size2t 221084 $size2s 233393"
-thumbs2b="$size2t 119783 $size2s 132092"
-thumbs2c="$size2t 590995 $size2s 603304"
 
 sha3=1183f8ef10dcb4d87a1857bd16f9b5f8728a8d1ea6c9c7eb37ddfa1da01bff52
 size3=369911
-size3s=18432
 offset3=192659
 
+# sizes of the resized images created by the reads (they depend on libvips)
+size1t=$(resized_size tests/data/papillon.jpg thumb)
+size1s=$(resized_size tests/data/papillon.jpg small)
+size2s=$(resized_size tests/data/coquelicots.jpg small)
+size3t=$(resized_size tests/data/foret.jpg thumb)
+
 db="$(new_tmp_file)"
 dbbkup="$(new_tmp_file)"
 
@@ -165,10 +162,18 @@ ORIGINAL: ${9:-1200 x 800}
 *****************************************"
 }
 
-line1a="$(image_txt pic1 $sha1 $size1 $offset1 0 0 $size1s 574696)"
-line2a="$(image_txt pic2 $sha2 $size2 $offset2 0 0 $size2s 590995)"
-line3a="$(image_txt pic3 $sha3 $size3 $offset3 $size3s 608335)"
-line4a="$(image_txt pic4 $sha1 $size1 $offset1 $size1t 562570)"
+# the resized images are appended in the order of the reads, after pic3
+offset4t=$(($offset3 + $size3))
+offset1s=$(($offset4t + $size1t))
+offset2s=$(($offset1s + $size1s))
+offset3t=$(($offset2s + $size2s))
+# pic1 and its duplicate pic4 share their resized images
+line1b="$(image_txt pic1 $sha1 $size1 $offset1 $size1t $offset4t)"
+line4b="$(image_txt pic4 $sha1 $size1 $offset1 $size1t $offset4t)"
+line1a="$(image_txt pic1 $sha1 $size1 $offset1 $size1t $offset4t $size1s $offset1s)"
+line2a="$(image_txt pic2 $sha2 $size2 $offset2 0 0 $size2s $offset2s)"
+line3a="$(image_txt pic3 $sha3 $size3 $offset3 $size3t $offset3t)"
+line4a="$(image_txt pic4 $sha1 $size1 $offset1 $size1t $offset4t $size1s $offset1s)"
 
 line1c="$(image_txt pic1 $sha1 $size1 $offset1)"
 line2c="$(image_txt pic2 $sha2 $size2 $offset2)"
@@ -241,6 +246,7 @@ standard_test () {
 }
 
 # ----------------------------------------------------------------------
+# others (optional): number of threads
 gc_test () {
     local info="$1"; shift
     local msg="$1"; shift
@@ -251,7 +257,7 @@ gc_test () {
     # 2 passes: gc shall be idempotent
     for pass in 1 2; do
         echo "==== pass $pass ===="
-        standard_test "gc on $info" "$msg" $size1 $size2 "$output" gc $db $dbbkup || return 1
+        standard_test "gc on $info" "$msg" $size1 $size2 "$output" gc $db $dbbkup "$@" || return 1
         rm -f $dbbkup
         # in 2nd pass, DB shall not change
         size1=$($stat -c%s $db)
@@ -281,6 +287,8 @@ safecp test02.imgst_dynamic
 error_test 'missing argument'  "   $nea"     || ok=0
 error_test 'missing argument (2)' "$nea" $db || ok=0
 error_test 'inexisting file' "$ioerr" "$(mktemp -u)" $dbbkup || ok=0
+error_test 'no thread' "$iarg" $db $dbbkup 0 || ok=0
+error_test 'too many threads' "$iarg" $db $dbbkup 65 || ok=0
 
 # ---- 2. standard cases
 printf "\n${yellow}II. Standard cases:${end}\n"
@@ -328,10 +336,10 @@ size_after=$(($size_before + $size1t))
 standard_test 'read pic4 thumb' '' \
 $size_before $size_after \
 "$(header 4 4 100)
-$line1c
+$line1b
 $line2c
 $line3c
-$line4a" \
+$line4b" \
 read $db pic4 thumb || ok=0
 
 size_before=$size_after
@@ -357,7 +365,7 @@ $line4a" \
 read $db pic2 small || ok=0
 
 size_before=$size_after
-size_after=$(($size_before + $size3s))
+size_after=$(($size_before + $size3t))
 standard_test 'read pic3 thumb' '' \
 $size_before $size_after \
 "$(header 4 4 100)
@@ -382,13 +390,48 @@ $line3a
 $line4a" \
 delete $db pic1 || ok=0
 
+dbpar="$(new_tmp_file)"
+cp $db $dbpar || error "Cannot copy \"$db\" to \"$dbpar\""
+
+# collected: pic3 and its thumbnail, then pic4, its small image and its thumbnail
+offset4_gc=$(($offset1 + $size3 + $size3t))
+size_gc=$(($offset4_gc + $size1 + $size1s + $size1t))
+gc_output="$(header 2 2 100)
+$(image_txt pic3 $sha3 $size3 $offset1 $size3t $(($offset1 + $size3)))
+$(image_txt pic4 $sha1 $size1 $offset4_gc $size1t $(($offset4_gc + $size1 + $size1s)) $size1s $(($offset4_gc + $size1)))"
+
 gc_test 'resulting imgStore' '101 item(s) written' \
-$size_after 495009 \
-"$(header 2 2 100)
-$(image_txt pic3 $sha3 $size3 $offset1 $size3s 391575)
-$(image_txt pic4 $sha1 $size1 410007   $size1t 482883)" \
+$size_after $size_gc "$gc_output" \
+|| ok=0
+
+## --------------------------------------------------
+## same scenario, collected by several threads
+printf "\n${yellow}+ testing with several threads:${end}\n"
+
+dbseq="$(new_tmp_file)"
+mv $db $dbseq && mv $dbpar $db || error "Cannot swap \"$db\" and \"$dbpar\""
+
+gc_test 'resulting imgStore, 4 threads' '101 item(s) written' \
+$size_after $size_gc "$gc_output" 4 \
 || ok=0
 
+# the images shall be the same as the ones collected by a single thread
+for image in 'pic3 orig' 'pic3 thumb' 'pic4 orig' 'pic4 small' 'pic4 thumb'; do
+    set -- $image
+    printf "${magenta}Test %1d${end} (content of $1 $2 after gc with 4 threads): " $((++test))
+    content="$(new_tmp_file)"
+    imgStoreMgr read $dbseq $1 $2 >/dev/null && mv $1_$2.jpg $content \
+        && imgStoreMgr read $db $1 $2 >/dev/null \
+        && cmp -s $1_$2.jpg $content
+    if [ $? -eq 0 ]; then
+        echo -e "${green}PASS${end}"
+    else
+        echo -e "${red}FAIL${end}"
+        ok=0
+    fi
+    rm -f $1_$2.jpg
+done
+
 # ======================================================================
 if [ "x$ok" = 'x1' ]; then
     echo -e "$0 ${bold}${green}SUCCESS${end}"
@@ -0,0 +1,168 @@
+#!/bin/bash
+
+## Black-box testing of imgStoreMgr -- imgStore larger than 4 GiB (sparse file)
+
+# ======================================================================
+# options
+
+with_colors=0
+while [ $# -ge 1 ]; do
+    case "$1" in
+        -c|--color|--colors) with_colors=1 ;;
+        *) break ;;
+    esac
+    shift
+done
+
+if [ "x$with_colors" = 'x1' ]; then
+    esc="\033["
+    red="${esc}31m"
+    green="${esc}32m"
+    yellow="${esc}33m"
+    blue="${esc}34m"
+    magenta="${esc}35m"
+    cyan="${esc}36m"
+    bold="${esc}1m"
+    end="${esc}0m"
+else
+    red=
+    green=
+    yellow=
+    blue=
+    magenta=
+    cyan=
+    bold=
+    end=
+fi
+
+printf "${bold}${blue}"
+source $(dirname ${BASH_SOURCE[0]})/test_env.sh
+printf "${end}"
+
+test=0
+ok=1
+
+sha1=66ac648b32a8268ed0b350b184cfa04c00c6236af3a2aa4411c01518f6061af8
+size1=72876
+offset1=21664
+size1t=$(resized_size tests/data/papillon.jpg thumb) # depends on libvips
+
+sha2=95962b09e0fc9716ee4c2a1cf173f9147758235360d7ac0a73dfa378858b8a10
+size2=98119
+offset2=94540
+
+sha3=1183f8ef10dcb4d87a1857bd16f9b5f8728a8d1ea6c9c7eb37ddfa1da01bff52
+size3=369911
+
+# the blob region is padded (sparse) up to 5 GiB, so that new images
+# are stored at offsets which do not fit in 32 bits
+big_size=$((5 * 1024 * 1024 * 1024))
+offset3=$big_size
+# but the resized images fill the free space left below pic3 (see do_insert)
+offset1t=$(($offset2 + $size2))
+
+db="$(new_tmp_file)"
+
+check_output() {
+    exec=imgStoreMgr
+    checkX "command line ImgStore tool (namely $exec exec)" $exec
+
+    EXPECTED_OUTPUT="$1"; shift
+
+    mytmp="$(new_tmp_file)"
+    # gets stdout in case of success, stderr in case of error
+    ACTUAL_OUTPUT="$("$exec" "$@" 2>"$mytmp" || cat "$mytmp")"
+
+    if ! diff -w <(echo "$ACTUAL_OUTPUT") <(echo -e "$EXPECTED_OUTPUT"); then
+        echo -e "${red}FAIL${end}"
+        echo -e "${yellow}Expected:${end}\n$EXPECTED_OUTPUT"
+        echo -e "${cyan}Actual:${end}\n$ACTUAL_OUTPUT"
+        return 1
+    fi
+    echo -e "${green}PASS${end}"
+    return 0
+}
+
+header() {
+    echo "*****************************************
+**********IMGSTORE HEADER START**********
+TYPE:            EPFL ImgStore binary
+VERSION: $1
+IMAGE COUNT: $2          MAX IMAGES: 100
+THUMBNAIL: 64 x 64      SMALL: 256 x 256
+***********IMGSTORE HEADER END***********
+*****************************************"
+}
+
+# params: imgId, SHA, size, offset[, thumb size, thumb offset]
+image_txt() {
+    echo "IMAGE ID: $1
+SHA: $2
+VALID: 1
+UNUSED: 0
+OFFSET ORIG. : $4		SIZE ORIG. : $3
+OFFSET THUMB.: ${6:-0}		SIZE THUMB.: ${5:-0}
+OFFSET SMALL : 0		SIZE SMALL : 0
+ORIGINAL: 1200 x 800
+*****************************************"
+}
+
+check_db_size() {
+    printf '\tImgStore size: '
+    local actual_size=$($stat -c%s $db)
+    if [ $actual_size -eq $1 ]; then
+        echo -e "${green}PASS${end}"
+    else
+        echo -e "${red}FAIL${end}: wrong ImgStore size: is ${actual_size}, where it shall be $1"
+        return 1
+    fi
+}
+
+read_test() {
+    local file="${1}_${2}.jpg"
+    printf "\treading $1 $2: "
+    check_output '' read "$db" "$1" "$2" || return 1
+
+    printf '\tcheck content: '
+    if same_image "$file" "tests/data/$3" $2; then
+        rm -f "$file"
+        echo -e "${green}PASS${end}"
+    else
+        rm -f "$file"
+        echo -e "${red}FAIL${end}: content of image $file is not what I was expecting"
+        return 1
+    fi
+}
+
+# ======================================================================
+# make a sparse working copy
+cp tests/data/test02.imgst_dynamic $db || error "Cannot copy reference imgStore to \"$db\""
+truncate -s $big_size $db || error "Cannot extend \"$db\" to $big_size bytes"
+
+printf "${magenta}Test %1d${end} (insert after 4 GiB):\n" $((++test))
+( printf '\tinsert: '; check_output '' insert $db pic3 tests/data/foret.jpg \
+  && printf '\tlist: ' && check_output "$(header 3 3)
+$(image_txt pic1 $sha1 $size1 $offset1)
+$(image_txt pic2 $sha2 $size2 $offset2)
+$(image_txt pic3 $sha3 $size3 $offset3)" list $db \
+  && check_db_size $(($offset3 + $size3)) ) || ok=0
+
+printf "${magenta}Test %1d${end} (read after 4 GiB):\n" $((++test))
+read_test pic3 orig foret.jpg || ok=0
+
+printf "${magenta}Test %1d${end} (read before 4 GiB, resized below pic3):\n" $((++test))
+( read_test pic1 thumb papillon.jpg \
+  && printf '\tlist: ' && check_output "$(header 3 3)
+$(image_txt pic1 $sha1 $size1 $offset1 $size1t $offset1t)
+$(image_txt pic2 $sha2 $size2 $offset2)
+$(image_txt pic3 $sha3 $size3 $offset3)" list $db \
+  && check_db_size $(($offset3 + $size3)) ) || ok=0
+
+# ======================================================================
+if [ "x$ok" = 'x1' ]; then
+    echo -e "$0 ${bold}${green}SUCCESS${end}"
+    exit 0
+else
+   echo -e "$0 ${bold}${red}FAILED${end} at some point"
+   exit 1
+fi
@@ -0,0 +1,233 @@
+#!/bin/bash
+
+## Black-box testing of imgStoreMgr -- grow command
+
+# ======================================================================
+# options
+
+with_colors=0
+while [ $# -ge 1 ]; do
+    case "$1" in
+        -c|--color|--colors) with_colors=1 ;;
+        *) break ;;
+    esac
+    shift
+done
+
+if [ "x$with_colors" = 'x1' ]; then
+    esc="\033["
+    red="${esc}31m"
+    green="${esc}32m"
+    yellow="${esc}33m"
+    blue="${esc}34m"
+    magenta="${esc}35m"
+    cyan="${esc}36m"
+    bold="${esc}1m"
+    end="${esc}0m"
+else
+    red=
+    green=
+    yellow=
+    blue=
+    magenta=
+    cyan=
+    bold=
+    end=
+fi
+
+printf "${bold}${blue}"
+source $(dirname ${BASH_SOURCE[0]})/test_env.sh
+printf "${end}"
+source $(dirname ${BASH_SOURCE[0]})/helptext.sh
+
+test=0
+ok=1
+
+nea='Not enough arguments'
+imf='Invalid max_files number'
+
+sha1=66ac648b32a8268ed0b350b184cfa04c00c6236af3a2aa4411c01518f6061af8
+size1=72876
+offset1=21664
+
+sha2=95962b09e0fc9716ee4c2a1cf173f9147758235360d7ac0a73dfa378858b8a10
+size2=98119
+offset2=94540
+
+sha3=1183f8ef10dcb4d87a1857bd16f9b5f8728a8d1ea6c9c7eb37ddfa1da01bff52
+size3=369911
+
+metadata_size=216
+db_size=$(($offset2 + $size2))
+
+db="$(new_tmp_file)"
+dbbkup="$(new_tmp_file)"
+
+safecp() {
+    local file="tests/data/$1"
+    cp "$file" $db || error "Cannot copy \"$file\" to \"$db\""
+    rm -f $dbbkup
+}
+
+check_output() {
+    exec=imgStoreMgr
+    checkX "command line ImgStore tool (namely $exec exec)" $exec
+
+    EXPECTED_OUTPUT="$1"; shift
+    EXPECTED_ERROR="$1"; shift
+
+    mytmp="$(new_tmp_file)"
+    if [ -z "$EXPECTED_ERROR" ]; then
+        # gets stdout in case of success, stderr in case of error
+        ACTUAL_OUTPUT="$("$exec" "$@" 2>"$mytmp" || cat "$mytmp")"
+    else
+        # gets stdout, puts stderr in temp file
+        ACTUAL_OUTPUT="$("$exec" "$@" 2>"$mytmp")"
+    fi
+
+    if ! diff -w <(echo "$ACTUAL_OUTPUT") <(echo -e "$EXPECTED_OUTPUT"); then
+        echo -e "${red}FAIL${end}"
+        echo -e "${yellow}Expected:${end}\n$EXPECTED_OUTPUT"
+        echo -e "${cyan}Actual:${end}\n$ACTUAL_OUTPUT"
+        return 1
+    fi
+    if ! [ -z "$EXPECTED_ERROR" ]; then
+        if diff -w "$mytmp" <(echo -e "$EXPECTED_ERROR"); then
+            echo -e "${green}PASS${end}"
+            return 0
+        else
+            echo -e "${red}FAIL${end}"
+            echo -e "${yellow}Expected error:${end}\n$EXPECTED_ERROR";
+            echo -e "Actual:${end}"
+            cat "$mytmp"
+            return 1
+        fi
+    else
+        echo -e "${green}PASS${end}"
+    fi
+    return 0
+}
+
+header() {
+    echo "*****************************************
+**********IMGSTORE HEADER START**********
+TYPE:            EPFL ImgStore binary
+VERSION: $1
+IMAGE COUNT: $2          MAX IMAGES: $3
+THUMBNAIL: 64 x 64      SMALL: 256 x 256
+***********IMGSTORE HEADER END***********
+*****************************************"
+}
+
+# params: imgId, SHA, size, offset
+image_txt() {
+    echo "IMAGE ID: $1
+SHA: $2
+VALID: 1
+UNUSED: 0
+OFFSET ORIG. : $4		SIZE ORIG. : $3
+OFFSET THUMB.: 0		SIZE THUMB.: 0
+OFFSET SMALL : 0		SIZE SMALL : 0
+ORIGINAL: 1200 x 800
+*****************************************"
+}
+
+error_test () {
+    info="$1"; shift
+    error_msg="ERROR: $1"; shift
+    printf "${magenta}Test %1d${end} ($info): " $((++test))
+    check_output "$helptxt" "$error_msg" grow "$@"
+}
+
+# params: info, expected output, expected ImgStore size after, command...
+standard_test () {
+    local info="$1"; shift
+    printf "${magenta}Test %1d${end} ($info):\n" $((++test))
+    local expected="$1"; shift
+    local db_size_after="$1"; shift
+
+    printf "\ta. doing $1: "
+    check_output "$expected" '' "$@" || return 1
+
+    printf '\tb. ImgStore size: '
+    local actual_size=$($stat -c%s $db)
+    if [ $actual_size -eq $db_size_after ]; then
+        echo -e "${green}PASS${end}"
+    else
+        echo -e "${red}FAIL${end}: wrong ImgStore size: is ${actual_size}, where it shall be $db_size_after"
+        return 1
+    fi
+
+    echo -e "==> ${green}PASS${end}"
+    return 0
+}
+
+# ---- 1. some error cases
+echo -e "${yellow}I. Error cases:${end}"
+
+safecp test02.imgst_dynamic
+
+error_test 'missing argument'     "$nea"               || ok=0
+error_test 'missing argument (2)' "$nea" $db           || ok=0
+error_test 'zero max_files'       "$imf" $db 0         || ok=0
+error_test 'not larger'           "$imf" $db 100       || ok=0
+error_test 'too large'            "$imf" $db 16777217  || ok=0
+
+# ---- 2. standard cases
+printf "\n${yellow}II. Standard cases:${end}\n"
+
+safecp test02.imgst_dynamic
+
+# the new metadata table is appended at the end of the file, from a page boundary
+page_size=$(getconf PAGESIZE)
+page_align() {
+    echo $(( ($1 + $page_size - 1) / $page_size * $page_size ))
+}
+db_size=$(($(page_align $db_size) + 250 * $metadata_size))
+standard_test 'grow v1 imgStore' "$(header 3 2 250)" $db_size grow $db 250 || ok=0
+
+standard_test 'list grown imgStore' "$(header 3 2 250)
+$(image_txt pic1 $sha1 $size1 $offset1)
+$(image_txt pic2 $sha2 $size2 $offset2)" $db_size list $db || ok=0
+
+# images are appended after the new metadata table
+offset3=$db_size
+db_size=$(($db_size + $size3))
+standard_test 'insert in grown imgStore' '' $db_size insert $db pic3 tests/data/foret.jpg || ok=0
+
+db_size=$(($(page_align $db_size) + 400 * $metadata_size))
+standard_test 'grow v2 imgStore' "$(header 5 3 400)" $db_size grow $db 400 || ok=0
+
+standard_test 'list twice grown imgStore' "$(header 5 3 400)
+$(image_txt pic1 $sha1 $size1 $offset1)
+$(image_txt pic2 $sha2 $size2 $offset2)
+$(image_txt pic3 $sha3 $size3 $offset3)" $db_size list $db || ok=0
+
+printf "${magenta}Test %1d${end} (read in grown imgStore): " $((++test))
+if check_output '' '' read $db pic3 orig >/dev/null && cmp -s pic3_orig.jpg tests/data/foret.jpg; then
+    echo -e "${green}PASS${end}"
+else
+    echo -e "${red}FAIL${end}: cannot read back pic3"
+    ok=0
+fi
+rm -f pic3_orig.jpg
+
+# garbage collecting puts the metadata back right after the header
+offset1_gc=$((64 + 400 * $metadata_size))
+offset2_gc=$(($offset1_gc + $size1))
+offset3_gc=$(($offset2_gc + $size2))
+standard_test 'gc of grown imgStore' '401 item(s) written' $(($offset3_gc + $size3)) gc $db $dbbkup || ok=0
+
+standard_test 'list collected imgStore' "$(header 3 3 400)
+$(image_txt pic1 $sha1 $size1 $offset1_gc)
+$(image_txt pic2 $sha2 $size2 $offset2_gc)
+$(image_txt pic3 $sha3 $size3 $offset3_gc)" $(($offset3_gc + $size3)) list $db || ok=0
+
+# ======================================================================
+if [ "x$ok" = 'x1' ]; then
+    echo -e "$0 ${bold}${green}SUCCESS${end}"
+    exit 0
+else
+   echo -e "$0 ${bold}${red}FAILED${end} at some point"
+   exit 1
+fi
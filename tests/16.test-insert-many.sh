@@ -0,0 +1,223 @@
+#!/bin/bash
+
+## Black-box testing of imgStoreMgr -- insert-many command
+
+# ======================================================================
+# options
+
+with_colors=0
+while [ $# -ge 1 ]; do
+    case "$1" in
+        -c|--color|--colors) with_colors=1 ;;
+        *) break ;;
+    esac
+    shift
+done
+
+if [ "x$with_colors" = 'x1' ]; then
+    esc="\033["
+    red="${esc}31m"
+    green="${esc}32m"
+    yellow="${esc}33m"
+    blue="${esc}34m"
+    magenta="${esc}35m"
+    cyan="${esc}36m"
+    bold="${esc}1m"
+    end="${esc}0m"
+else
+    red=
+    green=
+    yellow=
+    blue=
+    magenta=
+    cyan=
+    bold=
+    end=
+fi
+
+printf "${bold}${blue}"
+source $(dirname ${BASH_SOURCE[0]})/test_env.sh
+printf "${end}"
+source $(dirname ${BASH_SOURCE[0]})/helptext.sh
+
+test=0
+ok=1
+
+nea='Not enough arguments'
+iarg='Invalid argument'
+iiid='Invalid image ID'
+exiid='Existing image ID'
+
+sha1=66ac648b32a8268ed0b350b184cfa04c00c6236af3a2aa4411c01518f6061af8
+size1=72876
+offset1=21664
+
+sha2=95962b09e0fc9716ee4c2a1cf173f9147758235360d7ac0a73dfa378858b8a10
+size2=98119
+offset2=94540
+
+sha3=1183f8ef10dcb4d87a1857bd16f9b5f8728a8d1ea6c9c7eb37ddfa1da01bff52
+size3=369911
+
+db_size=$(($offset2 + $size2))
+
+db="$(new_tmp_file)"
+dbbkup="$(new_tmp_file)"
+
+safecp() {
+    local file="tests/data/$1"
+    cp "$file" $db || error "Cannot copy \"$file\" to \"$db\""
+    rm -f $dbbkup
+}
+
+check_output() {
+    exec=imgStoreMgr
+    checkX "command line ImgStore tool (namely $exec exec)" $exec
+
+    EXPECTED_OUTPUT="$1"; shift
+    EXPECTED_ERROR="$1"; shift
+
+    mytmp="$(new_tmp_file)"
+    if [ -z "$EXPECTED_ERROR" ]; then
+        # gets stdout in case of success, stderr in case of error
+        ACTUAL_OUTPUT="$("$exec" "$@" 2>"$mytmp" || cat "$mytmp")"
+    else
+        # gets stdout, puts stderr in temp file
+        ACTUAL_OUTPUT="$("$exec" "$@" 2>"$mytmp")"
+    fi
+
+    if ! diff -w <(echo "$ACTUAL_OUTPUT") <(echo -e "$EXPECTED_OUTPUT"); then
+        echo -e "${red}FAIL${end}"
+        echo -e "${yellow}Expected:${end}\n$EXPECTED_OUTPUT"
+        echo -e "${cyan}Actual:${end}\n$ACTUAL_OUTPUT"
+        return 1
+    fi
+    if ! [ -z "$EXPECTED_ERROR" ]; then
+        if diff -w "$mytmp" <(echo -e "$EXPECTED_ERROR"); then
+            echo -e "${green}PASS${end}"
+            return 0
+        else
+            echo -e "${red}FAIL${end}"
+            echo -e "${yellow}Expected error:${end}\n$EXPECTED_ERROR";
+            echo -e "Actual:${end}"
+            cat "$mytmp"
+            return 1
+        fi
+    else
+        echo -e "${green}PASS${end}"
+    fi
+    return 0
+}
+
+header() {
+    echo "*****************************************
+**********IMGSTORE HEADER START**********
+TYPE:            EPFL ImgStore binary
+VERSION: $1
+IMAGE COUNT: $2          MAX IMAGES: $3
+THUMBNAIL: 64 x 64      SMALL: 256 x 256
+***********IMGSTORE HEADER END***********
+*****************************************"
+}
+
+# params: imgId, SHA, size, offset
+image_txt() {
+    echo "IMAGE ID: $1
+SHA: $2
+VALID: 1
+UNUSED: 0
+OFFSET ORIG. : $4		SIZE ORIG. : $3
+OFFSET THUMB.: 0		SIZE THUMB.: 0
+OFFSET SMALL : 0		SIZE SMALL : 0
+ORIGINAL: 1200 x 800
+*****************************************"
+}
+
+error_test () {
+    info="$1"; shift
+    error_msg="ERROR: $1"; shift
+    printf "${magenta}Test %1d${end} ($info): " $((++test))
+    check_output "$helptxt" "$error_msg" insert-many "$@"
+}
+
+# params: info, expected output, expected ImgStore size after, command...
+standard_test () {
+    local info="$1"; shift
+    printf "${magenta}Test %1d${end} ($info):\n" $((++test))
+    local expected="$1"; shift
+    local db_size_after="$1"; shift
+
+    printf "\ta. doing $1: "
+    check_output "$expected" '' "$@" || return 1
+
+    printf '\tb. ImgStore size: '
+    local actual_size=$($stat -c%s $db)
+    if [ $actual_size -eq $db_size_after ]; then
+        echo -e "${green}PASS${end}"
+    else
+        echo -e "${red}FAIL${end}: wrong ImgStore size: is ${actual_size}, where it shall be $db_size_after"
+        return 1
+    fi
+
+    echo -e "==> ${green}PASS${end}"
+    return 0
+}
+
+# ---- 1. some error cases
+echo -e "${yellow}I. Error cases:${end}"
+
+safecp test02.imgst_dynamic
+
+error_test 'missing argument'     "$nea"  $db                                       || ok=0
+error_test 'missing argument (2)' "$nea"  $db pic3                                  || ok=0
+error_test 'missing filename'     "$iarg" $db pic3 tests/data/foret.jpg pic4        || ok=0
+error_test 'empty ID'             "$iiid" $db pic3 tests/data/foret.jpg '' tests/data/foret.jpg || ok=0
+
+# ---- 2. standard cases
+printf "\n${yellow}II. Standard cases:${end}\n"
+
+safecp test02.imgst_dynamic
+
+# new contents are appended once, in order; duplicates (also within the batch) share them
+offset3=$db_size
+db_size=$(($db_size + $size3))
+standard_test 'insert three images' '' $db_size insert-many $db \
+              pic3 tests/data/foret.jpg pic4 tests/data/papillon.jpg pic5 tests/data/foret.jpg || ok=0
+
+standard_test 'list after insert-many' "$(header 5 5 100)
+$(image_txt pic1 $sha1 $size1 $offset1)
+$(image_txt pic2 $sha2 $size2 $offset2)
+$(image_txt pic3 $sha3 $size3 $offset3)
+$(image_txt pic4 $sha1 $size1 $offset1)
+$(image_txt pic5 $sha3 $size3 $offset3)" $db_size list $db || ok=0
+
+printf "${magenta}Test %1d${end} (read inserted image): " $((++test))
+if check_output '' '' read $db pic5 orig >/dev/null && cmp -s pic5_orig.jpg tests/data/foret.jpg; then
+    echo -e "${green}PASS${end}"
+else
+    echo -e "${red}FAIL${end}: cannot read back pic5"
+    ok=0
+fi
+rm -f pic5_orig.jpg
+
+# an image with an existing ID is skipped, the others are inserted
+printf "${magenta}Test %1d${end} (existing ID in batch): " $((++test))
+check_output "$helptxt" "ERROR: pic1: $exiid
+ERROR: $exiid" insert-many $db pic1 tests/data/foret.jpg pic6 tests/data/coquelicots.jpg || ok=0
+
+standard_test 'list after partial insert-many' "$(header 6 6 100)
+$(image_txt pic1 $sha1 $size1 $offset1)
+$(image_txt pic2 $sha2 $size2 $offset2)
+$(image_txt pic3 $sha3 $size3 $offset3)
+$(image_txt pic4 $sha1 $size1 $offset1)
+$(image_txt pic5 $sha3 $size3 $offset3)
+$(image_txt pic6 $sha2 $size2 $offset2)" $db_size list $db || ok=0
+
+# ======================================================================
+if [ "x$ok" = 'x1' ]; then
+    echo -e "$0 ${bold}${green}SUCCESS${end}"
+    exit 0
+else
+   echo -e "$0 ${bold}${red}FAILED${end} at some point"
+   exit 1
+fi
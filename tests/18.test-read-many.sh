@@ -0,0 +1,211 @@
+#!/bin/bash
+
+## Black-box testing of imgStoreMgr -- read-many command
+
+# ======================================================================
+# options
+
+with_colors=0
+while [ $# -ge 1 ]; do
+    case "$1" in
+        -c|--color|--colors) with_colors=1 ;;
+        *) break ;;
+    esac
+    shift
+done
+
+if [ "x$with_colors" = 'x1' ]; then
+    esc="\033["
+    red="${esc}31m"
+    green="${esc}32m"
+    yellow="${esc}33m"
+    blue="${esc}34m"
+    magenta="${esc}35m"
+    cyan="${esc}36m"
+    bold="${esc}1m"
+    end="${esc}0m"
+else
+    red=
+    green=
+    yellow=
+    blue=
+    magenta=
+    cyan=
+    bold=
+    end=
+fi
+
+printf "${bold}${blue}"
+source $(dirname ${BASH_SOURCE[0]})/test_env.sh
+printf "${end}"
+source $(dirname ${BASH_SOURCE[0]})/helptext.sh
+
+test=0
+ok=1
+
+nea='Not enough arguments'
+iiid='Invalid image ID'
+ires='Invalid resolution(s)'
+fnf='File not found'
+
+db="$(new_tmp_file)"
+
+safecp() {
+    local file="tests/data/$1"
+    cp "$file" $db || error "Cannot copy \"$file\" to \"$db\""
+}
+
+check_output() {
+    exec=imgStoreMgr
+    checkX "command line ImgStore tool (namely $exec exec)" $exec
+
+    EXPECTED_OUTPUT="$1"; shift
+    EXPECTED_ERROR="$1"; shift
+
+    mytmp="$(new_tmp_file)"
+    if [ -z "$EXPECTED_ERROR" ]; then
+        # gets stdout in case of success, stderr in case of error
+        ACTUAL_OUTPUT="$("$exec" "$@" 2>"$mytmp" || cat "$mytmp")"
+    else
+        # gets stdout, puts stderr in temp file
+        ACTUAL_OUTPUT="$("$exec" "$@" 2>"$mytmp")"
+    fi
+
+    if ! diff -w <(echo "$ACTUAL_OUTPUT") <(echo -e "$EXPECTED_OUTPUT"); then
+        echo -e "${red}FAIL${end}"
+        echo -e "${yellow}Expected:${end}\n$EXPECTED_OUTPUT"
+        echo -e "${cyan}Actual:${end}\n$ACTUAL_OUTPUT"
+        return 1
+    fi
+    if ! [ -z "$EXPECTED_ERROR" ]; then
+        if diff -w "$mytmp" <(echo -e "$EXPECTED_ERROR"); then
+            echo -e "${green}PASS${end}"
+            return 0
+        else
+            echo -e "${red}FAIL${end}"
+            echo -e "${yellow}Expected error:${end}\n$EXPECTED_ERROR";
+            echo -e "Actual:${end}"
+            cat "$mytmp"
+            return 1
+        fi
+    else
+        echo -e "${green}PASS${end}"
+    fi
+    return 0
+}
+
+header() {
+    echo "*****************************************
+**********IMGSTORE HEADER START**********
+TYPE:            EPFL ImgStore binary
+VERSION: $1
+IMAGE COUNT: $2          MAX IMAGES: $3
+THUMBNAIL: 64 x 64      SMALL: 256 x 256
+***********IMGSTORE HEADER END***********
+*****************************************"
+}
+
+error_test () {
+    info="$1"; shift
+    error_msg="ERROR: $1"; shift
+    printf "${magenta}Test %1d${end} ($info): " $((++test))
+    check_output "$helptxt" "$error_msg" read-many "$@"
+}
+
+# params: info, expected error of the command (empty if none), command arguments;
+# then pairs of written file and reference file
+read_test () {
+    local info="$1"; shift
+    local expected_error="$1"; shift
+    local nb_args="$1"; shift
+    printf "${magenta}Test %1d${end} ($info):\n" $((++test))
+
+    printf "\ta. doing read-many: "
+    local expected_output=''
+    [ -z "$expected_error" ] || expected_output="$helptxt"
+    check_output "$expected_output" "$expected_error" read-many "${@:1:$nb_args}" || return 1
+    shift $nb_args
+
+    printf "\tb. written files: "
+    while [ $# -ge 2 ]; do
+        if ! cmp -s "$1" "$2"; then
+            echo -e "${red}FAIL${end}: $1 differs from $2"
+            return 1
+        fi
+        rm -f "$1"
+        shift 2
+    done
+    echo -e "${green}PASS${end}"
+
+    echo -e "==> ${green}PASS${end}"
+    return 0
+}
+
+# params: info, command arguments (4); then pairs of written file and original file,
+# the written one being the original resized (see same_image)
+resized_test () {
+    local info="$1"; shift
+    printf "${magenta}Test %1d${end} ($info):\n" $((++test))
+
+    local res="$2"
+    printf "\ta. doing read-many: "
+    check_output '' '' read-many "${@:1:4}" || return 1
+    shift 4
+
+    printf "\tb. written files: "
+    while [ $# -ge 2 ]; do
+        if ! same_image "$1" "$2" $res; then
+            echo -e "${red}FAIL${end}: $1 is not $2 resized"
+            return 1
+        fi
+        rm -f "$1"
+        shift 2
+    done
+    echo -e "${green}PASS${end}"
+
+    echo -e "==> ${green}PASS${end}"
+    return 0
+}
+
+# ---- 1. some error cases
+echo -e "${yellow}I. Error cases:${end}"
+
+safecp test02.imgst_dynamic
+
+error_test 'missing argument'     "$nea"  $db                  || ok=0
+error_test 'missing argument (2)' "$nea"  $db orig             || ok=0
+error_test 'invalid resolution'   "$ires" $db large pic1       || ok=0
+error_test 'empty ID'             "$iiid" $db orig pic1 ''     || ok=0
+
+# ---- 2. standard cases
+printf "\n${yellow}II. Standard cases:${end}\n"
+
+# the images are read in the order of the file, and written in the given order
+read_test 'read two images' '' 4 $db orig pic2 pic1 \
+          pic2_orig.jpg tests/data/coquelicots.jpg pic1_orig.jpg tests/data/papillon.jpg || ok=0
+
+read_test 'read an image twice' '' 4 $db original pic1 pic1 \
+          pic1_orig.jpg tests/data/papillon.jpg || ok=0
+
+# a missing image is reported, the others are read
+read_test 'read a missing image' "ERROR: pic3: $fnf
+ERROR: $fnf" 4 $db orig pic3 pic2 \
+          pic2_orig.jpg tests/data/coquelicots.jpg || ok=0
+
+# the resized images missing are created by the reads (fresh copy: none of them exists yet)
+safecp test02.imgst_dynamic
+
+resized_test 'read the thumbnails of fresh images' $db thumb pic2 pic1 \
+             pic2_thumb.jpg tests/data/coquelicots.jpg pic1_thumb.jpg tests/data/papillon.jpg || ok=0
+
+resized_test 'read the small images of fresh images' $db small pic1 pic2 \
+             pic1_small.jpg tests/data/papillon.jpg pic2_small.jpg tests/data/coquelicots.jpg || ok=0
+
+# ======================================================================
+if [ "x$ok" = 'x1' ]; then
+    echo -e "$0 ${bold}${green}SUCCESS${end}"
+    exit 0
+else
+   echo -e "$0 ${bold}${red}FAILED${end} at some point"
+   exit 1
+fi
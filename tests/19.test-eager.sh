@@ -0,0 +1,133 @@
+#!/bin/bash
+
+## Black-box testing of imgStoreMgr and imgStore_server -- creation of the resized images at insertion (create -eager)
+
+# ======================================================================
+# options
+
+with_colors=0
+while [ $# -ge 1 ]; do
+    case "$1" in
+        -c|--color|--colors) with_colors=1 ;;
+        *) break ;;
+    esac
+    shift
+done
+
+if [ "x$with_colors" = 'x1' ]; then
+    esc="\033["
+    red="${esc}31m"
+    green="${esc}32m"
+    yellow="${esc}33m"
+    blue="${esc}34m"
+    magenta="${esc}35m"
+    cyan="${esc}36m"
+    bold="${esc}1m"
+    end="${esc}0m"
+else
+    red=
+    green=
+    yellow=
+    blue=
+    magenta=
+    cyan=
+    bold=
+    end=
+fi
+
+printf "${bold}${blue}"
+source $(dirname ${BASH_SOURCE[0]})/test_env.sh
+printf "${end}"
+source $(dirname ${BASH_SOURCE[0]})/helptext.sh
+
+test=0
+ok=1
+
+db="$(new_tmp_file)"
+
+# number of resized images (thumbnail and small) not stored, without reading them
+missing_resized () {
+    imgStoreMgr list $db | grep -E 'OFFSET (THUMB|SMALL)' | grep -c ': 0[[:space:]]'
+}
+
+# params: info, whether the resized images are expected (1) or not (0), create options
+insert_test () {
+    local info="$1"; shift
+    local expected="$1"; shift
+    exec=imgStoreMgr
+    checkX "command line ImgStore tool (namely $exec exec)" $exec
+    printf "${magenta}Test %1d${end} ($info): " $((++test))
+
+    rm -f $db
+    if ! "$exec" create $db "$@" > /dev/null \
+        || ! "$exec" insert $db pic1 tests/data/papillon.jpg; then
+        echo -e "${red}FAIL${end}: cannot create $db or insert into it"
+        return 1
+    fi
+
+    local missing=$(( expected ? 0 : 2 ))
+    local offsets="$(missing_resized)"
+    if [ "$offsets" -ne $missing ]; then
+        echo -e "${red}FAIL${end}: $offsets resized image(s) missing, $missing expected"
+        return 1
+    fi
+    echo -e "${green}PASS${end}"
+    return 0
+}
+
+insert_test 'lazy imgStore (default)' 0                      || ok=0
+insert_test 'eager imgStore'          1 -eager               || ok=0
+insert_test 'eager imgStore, options' 1 -max_files 5 -eager  || ok=0
+
+# the server creates them in the background, once the insertion is answered
+server="${PWD}/imgStore_server"
+export LD_LIBRARY_PATH="${PWD}/libmongoose"
+export DYLD_FALLBACK_LIBRARY_PATH="${PWD}/libmongoose"
+
+# params: info
+server_test () {
+    checkX "webserver exec ($server)" $server
+    printf "${magenta}Test %1d${end} ($1): " $((++test))
+
+    rm -f $db
+    imgStoreMgr create $db -eager > /dev/null || { echo -e "${red}FAIL${end}: cannot create $db"; return 1; }
+    "$server" $db > /dev/null 2>&1 &
+    local pid=$!
+    sleep 1 # wait a bit
+
+    local size=$($stat -c%s tests/data/papillon.jpg)
+    curl -s --data-binary @tests/data/papillon.jpg "http://localhost:8000/imgStore/insert?offset=0&name=pic1" > /dev/null \
+        && curl -s -d '' "http://localhost:8000/imgStore/insert?offset=${size}&name=pic1" > /dev/null
+    local error=$?
+
+    # waits (up to 5 s) for the worker to store them
+    local missing=2
+    for i in $(seq 50); do
+        missing="$(missing_resized)"
+        [ "$error" -ne 0 ] || [ "$missing" -eq 0 ] && break
+        sleep 0.1
+    done
+    kill -TERM $pid && wait $pid 2> /dev/null
+
+    if [ "$error" -ne 0 ]; then
+        echo -e "${red}FAIL${end}: cannot insert into $db through the server"
+        return 1
+    fi
+    if [ "$missing" -ne 0 ]; then
+        echo -e "${red}FAIL${end}: $missing resized image(s) missing, 0 expected"
+        return 1
+    fi
+    echo -e "${green}PASS${end}"
+    return 0
+}
+
+server_test 'eager imgStore, through the server' || ok=0
+
+# ======================================================================
+if [ "x$ok" = 'x1' ]; then
+    echo -e "$0 ${bold}${green}SUCCESS${end}"
+    exit 0
+else
+   echo -e "$0 ${bold}${red}FAILED${end} at some point"
+   exit 1
+fi
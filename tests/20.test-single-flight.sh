@@ -0,0 +1,106 @@
+#!/bin/bash
+
+## Black-box testing of imgStore_server -- concurrent reads of an image being resized (single flight)
+
+# ======================================================================
+# options
+
+with_colors=0
+while [ $# -ge 1 ]; do
+    case "$1" in
+        -c|--color|--colors) with_colors=1 ;;
+        *) break ;;
+    esac
+    shift
+done
+
+if [ "x$with_colors" = 'x1' ]; then
+    esc="\033["
+    red="${esc}31m"
+    green="${esc}32m"
+    yellow="${esc}33m"
+    blue="${esc}34m"
+    magenta="${esc}35m"
+    cyan="${esc}36m"
+    bold="${esc}1m"
+    end="${esc}0m"
+else
+    red=
+    green=
+    yellow=
+    blue=
+    magenta=
+    cyan=
+    bold=
+    end=
+fi
+
+printf "${bold}${blue}"
+source $(dirname ${BASH_SOURCE[0]})/test_env.sh
+printf "${end}"
+
+test=0
+ok=1
+
+db="$(new_tmp_file)"
+
+server="${PWD}/imgStore_server"
+export LD_LIBRARY_PATH="${PWD}/libmongoose"
+export DYLD_FALLBACK_LIBRARY_PATH="${PWD}/libmongoose"
+checkX "webserver exec ($server)" $server
+
+# ----------------------------------------------------------------------
+# params: number of concurrent reads of the thumbnail of pic1
+# With a single worker and room for a single job, the reads are answered only
+# if they wait for the same resize, which creates the thumbnail once.
+single_flight_test () {
+    local nb_reads=$1
+    printf "${magenta}Test %1d${end} ($nb_reads concurrent reads of a thumbnail not created yet): " $((++test))
+
+    cp tests/data/test02.imgst_dynamic $db || error "Cannot copy reference imgStore to \"$db\""
+    local size_before=$($stat -c%s $db)
+    local size_after=$(($size_before + $(resized_size tests/data/papillon.jpg thumb)))
+
+    "$server" $db workers 1 1 > /dev/null 2>&1 &
+    local pid=$!
+    sleep 1 # wait a bit
+
+    local dir="$(mktemp -d)"
+    local readers=
+    for i in $(seq $nb_reads); do
+        curl -s -o "$dir/$i.jpg" -w '%{http_code}\n' "http://localhost:8000/imgStore/read?res=thumb&img_id=pic1" > "$dir/$i.code" &
+        readers="$readers $!"
+    done
+    wait $readers
+    kill -TERM $pid && wait $pid 2> /dev/null
+
+    local failed=0
+    for i in $(seq $nb_reads); do
+        if [ "$(cat "$dir/$i.code")" != 200 ] || ! same_image "$dir/$i.jpg" tests/data/papillon.jpg thumb; then
+            failed=$(($failed + 1))
+        fi
+    done
+    rm -rf "$dir"
+
+    if [ $failed -ne 0 ]; then
+        echo -e "${red}FAIL${end}: $failed read(s) not answered with the thumbnail"
+        return 1
+    fi
+    if [ $($stat -c%s $db) -ne $size_after ]; then
+        echo -e "${red}FAIL${end}: imgStore size is $($stat -c%s $db), $size_after expected (a single thumbnail)"
+        return 1
+    fi
+    echo -e "${green}PASS${end}"
+    return 0
+}
+
+single_flight_test 8 || ok=0
+
+# ======================================================================
+if [ "x$ok" = 'x1' ]; then
+    echo -e "$0 ${bold}${green}SUCCESS${end}"
+    exit 0
+else
+   echo -e "$0 ${bold}${red}FAILED${end} at some point"
+   exit 1
+fi
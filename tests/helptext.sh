@@ -13,13 +13,28 @@ helptxt_next="  create <imgstore_filename> [options]: create a new imgStore.
                                   maximum value is 128x128
           -small_res <X_RES> <Y_RES>: resolution for small images.
                                   default value is 256x256
-                                  maximum value is 512x512"
+                                  maximum value is 512x512
+          -eager: creates the resized images when inserting the images,
+                                  rather than when first reading them"
 helptxt_next="$helptxt_next
   read   <imgstore_filename> <imgID> [original|orig|thumbnail|thumb|small]:
       read an image from the imgStore and save it to a file.
       default resolution is \"original\".
+  read-many <imgstore_filename> <original|orig|thumbnail|thumb|small> <imgID> [<imgID> ...]:
+      read several images from the imgStore at once and save them to files.
   insert <imgstore_filename> <imgID> <filename>: insert a new image in the imgStore."
+helptxt_next="$helptxt_next
+  insert-many <imgstore_filename> <imgID> <filename> [<imgID> <filename> ...]:
+      insert several new images in the imgStore at once."
 helptxt_next="$helptxt_next
   delete <imgstore_filename> <imgID>: delete image imgID from imgStore."
+helptxt_next="$helptxt_next
+  gc <imgstore_filename> <tmp imgstore_filename> [<nb_threads>]: performs garbage collecting on imgStore. Requires a temporary filename for copying the imgStore.
+      <nb_threads>: number of threads copying the images (default 1, maximum 64)."
+helptxt_next="$helptxt_next
+  compact <imgstore_filename>: removes the deleted images in place, without temporary copy."
+helptxt_next="$helptxt_next
+  grow <imgstore_filename> <MAX_FILES>: raises the maximum number of files of the imgStore, in place.
+                                  maximum value is 16777216"
 helptxt="$helptxt
 $helptxt_next"
@@ -129,5 +129,46 @@ random_value() {
 }
 
 
+# ======================================================================
+# writes in the file $3 the image of resolution $2 (thumb or small, of the
+# default sizes) of the JPEG file $1, as resized by vipsthumbnail with the
+# options of the imgStore: its bytes depend on the installed libvips only,
+# not on the code under test
+resized_reference() {
+    local size
+    case "$2" in
+        thumb) size=64x64 ;;
+        small) size=256x256 ;;
+        *) return 1 ;;
+    esac
+    vipsthumbnail "$1" --size $size --no-rotate -o "$3" >/dev/null
+}
+
+# ======================================================================
+# whether the image file $1, read in resolution $3 (orig, thumb or small),
+# is the original JPEG file $2 in this resolution (byte for byte)
+same_image() {
+    if [ "$3" = orig ]; then
+        cmp -s "$1" "$2"
+    else
+        local reference="$(mktemp)"
+        resized_reference "$2" $3 "$reference" && cmp -s "$1" "$reference"
+        local status=$?
+        rm -f "$reference"
+        return $status
+    fi
+}
+
+# ======================================================================
+# prints the size of the image of resolution $2 (thumb or small) of the
+# JPEG file $1 (see resized_reference)
+resized_size() {
+    local reference="$(mktemp)"
+    local status=0
+    resized_reference "$1" $2 "$reference" && $stat -c%s "$reference" || status=1
+    rm -f "$reference"
+    return $status
+}
+
 # ======================================================================
 init
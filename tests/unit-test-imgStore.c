@@ -0,0 +1,553 @@
+/**
+ * @file unit-test-imgStore.c
+ * @brief Unit tests of the imgStore library on small imgStores: growth,
+ *   compaction in slices, and reads concurrent with insertions and resizes
+ *   (to be launched from the root of the project).
+ */
+#define _DEFAULT_SOURCE // for clock_gettime
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // unlink, sysconf
+#include <time.h>   // clock_gettime
+#include <pthread.h>
+
+#include <check.h>
+
+#include "tests.h"
+#include "imgStore.h"
+
+// ======================================================================
+#define TEST_DB "/tmp/unit-test-imgStore.imgst"
+
+// ======================================================================
+/**
+ * @brief Creates TEST_DB with the given maximal number of images, and opens it (mapped).
+ */
+static int create_test_db(uint32_t max_files, struct imgst_file* imgst_file)
+{
+    struct imgst_header header = { .max_files = max_files, .res_resized = { 64, 64, 256, 256 } };
+    struct imgst_file created = { .header = header };
+    if (do_create(TEST_DB, &created) != ERR_NONE) return 1;
+    do_close(&created);
+    return do_open(TEST_DB, "rb+m", imgst_file) != ERR_NONE;
+}
+
+// ======================================================================
+/**
+ * @brief Reads a whole file in a new buffer.
+ */
+static char* read_file(const char* filename, size_t* size)
+{
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) return NULL;
+    fseek(file, 0, SEEK_END);
+    *size = (size_t) ftell(file);
+    rewind(file);
+    char* buffer = malloc(*size);
+    if (buffer != NULL && fread(buffer, 1, *size, file) != *size) {
+        free(buffer);
+        buffer = NULL;
+    }
+    fclose(file);
+    return buffer;
+}
+
+// ======================================================================
+/**
+ * @brief Whether the original image 'img_id' reads back as the given content.
+ */
+static int read_back(const char* img_id, const char* content, size_t size, struct imgst_file* imgst_file)
+{
+    char* buffer = NULL;
+    uint32_t read_size = 0;
+    if (do_read(img_id, RES_ORIG, &buffer, &read_size, imgst_file) != ERR_NONE) return 0;
+    const int same = read_size == size && !memcmp(buffer, content, size);
+    free(buffer);
+    return same;
+}
+
+// ======================================================================
+/**
+ * @brief The test images (all different).
+ */
+static const char* const test_images[] = {
+    "tests/data/papillon.jpg", "tests/data/coquelicots.jpg", "tests/data/foret.jpg",
+    "tests/data/papillon_small.jpg", "tests/data/coquelicots_small.jpg",
+    "tests/data/papillon_thumb.jpg", "tests/data/coquelicots_thumb.jpg"
+};
+#define NB_TEST_IMAGES (sizeof(test_images) / sizeof(test_images[0]))
+
+// ======================================================================
+/**
+ * @brief The metadata table appended by do_grow() is still mapped.
+ */
+START_TEST(grow_mapped)
+{
+    struct imgst_file imgst_file;
+    ck_assert_msg(!create_test_db(10, &imgst_file), "cannot create " TEST_DB);
+    do_close(&imgst_file);
+
+    // An odd-sized content at the end of the file
+    FILE* file = fopen(TEST_DB, "ab");
+    ck_assert_msg(file != NULL && fputc(0, file) == 0 && fclose(file) == 0, "cannot append to " TEST_DB);
+
+    ck_assert_msg(do_open(TEST_DB, "rb+m", &imgst_file) == ERR_NONE, "cannot open " TEST_DB);
+    ck_assert_msg(do_grow(&imgst_file, 1000) == ERR_NONE, "cannot grow");
+    do_close(&imgst_file);
+
+    ck_assert_msg(do_open(TEST_DB, "rb+m", &imgst_file) == ERR_NONE, "cannot open grown imgStore");
+    const int aligned = get_metadata_offset(&imgst_file.header) % (uint64_t) sysconf(_SC_PAGESIZE) == 0;
+    const int mapped = imgst_file.map != NULL && imgst_file.header.max_files == 1000;
+    do_close(&imgst_file);
+    ck_assert_msg(aligned, "grown metadata is not aligned on a page");
+    ck_assert_msg(mapped, "grown metadata is not mapped");
+}
+END_TEST
+
+// ======================================================================
+/**
+ * @brief A compaction run in slices, with images inserted and deleted in
+ *        between, keeps all the images readable, and the file compact.
+ */
+START_TEST(compact_interleaved)
+{
+    char* contents[NB_TEST_IMAGES];
+    size_t sizes[NB_TEST_IMAGES];
+    int stored[NB_TEST_IMAGES] = { 0 };
+    char img_id[] = "pic0";
+    for (size_t k = 0; k < NB_TEST_IMAGES; ++k) {
+        contents[k] = read_file(test_images[k], &sizes[k]);
+        ck_assert_msg(contents[k] != NULL, "cannot read the test images");
+    }
+
+    struct imgst_file imgst_file;
+    ck_assert_msg(!create_test_db(10, &imgst_file), "cannot create " TEST_DB);
+    for (size_t k = 0; k < 5; ++k) {
+        img_id[3] = (char) ('0' + k);
+        ck_assert_msg(do_insert(contents[k], sizes[k], img_id, &imgst_file) == ERR_NONE, "cannot insert");
+        stored[k] = 1;
+    }
+    ck_assert_msg(do_delete("pic0", &imgst_file) == ERR_NONE, "cannot delete");
+    stored[0] = 0;
+
+    // One image moved per slice; after slices 2 to 5: insert pic5, delete pic3 (being moved), insert pic6, delete pic2
+    const size_t changed[] = { 5, 3, 6, 2 };
+    struct imgst_compaction compaction = { .state = NULL };
+    do_compact_start(&compaction);
+    for (size_t step = 1; compaction.running && step < 50; ++step) {
+        ck_assert_msg(do_compact_step(&imgst_file, &compaction, 1) == ERR_NONE, "cannot compact a slice");
+        const size_t k = step >= 2 && step <= 5 ? changed[step - 2] : NB_TEST_IMAGES;
+        img_id[3] = (char) ('0' + k);
+        if (k < NB_TEST_IMAGES && stored[k]) {
+            ck_assert_msg(do_delete(img_id, &imgst_file) == ERR_NONE, "cannot delete between slices");
+            stored[k] = 0;
+        } else if (k < NB_TEST_IMAGES) {
+            ck_assert_msg(do_insert(contents[k], sizes[k], img_id, &imgst_file) == ERR_NONE, "cannot insert between slices");
+            stored[k] = 1;
+        }
+        for (size_t j = 0; j < NB_TEST_IMAGES; ++j) {
+            img_id[3] = (char) ('0' + j);
+            ck_assert_msg(!stored[j] || read_back(img_id, contents[j], sizes[j], &imgst_file), "wrong image between slices");
+        }
+    }
+    ck_assert_msg(!compaction.running, "compaction does not end");
+
+    // What was freed during the pass is reclaimed by the next one
+    ck_assert_msg(do_compact(&imgst_file) == ERR_NONE, "cannot compact");
+    uint64_t expected_end = get_metadata_offset(&imgst_file.header) + 10 * sizeof(struct img_metadata);
+    for (size_t j = 0; j < NB_TEST_IMAGES; ++j) {
+        img_id[3] = (char) ('0' + j);
+        ck_assert_msg(!stored[j] || read_back(img_id, contents[j], sizes[j], &imgst_file), "wrong image after compaction");
+        if (stored[j]) expected_end += sizes[j];
+    }
+    uint64_t end = 0;
+    ck_assert_msg(get_file_end(&imgst_file, &end) == ERR_NONE && end == expected_end, "imgStore not compact");
+
+    do_close(&imgst_file);
+    for (size_t k = 0; k < NB_TEST_IMAGES; ++k) free(contents[k]);
+}
+END_TEST
+
+// ======================================================================
+/**
+ * @brief A reader of the test images, run by a thread.
+ */
+struct reader {
+    struct imgst_file* imgst_file;
+    char** contents;
+    size_t* sizes;
+    size_t nb_images; // pic0 to pic<nb_images - 1> are read
+    size_t nb_rounds;
+    int wrong;        // set if an image does not read back
+    int done;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static void reader_done(struct reader* reader, int wrong)
+{
+    pthread_mutex_lock(&reader->mutex);
+    reader->wrong = wrong;
+    reader->done = 1;
+    pthread_cond_signal(&reader->cond);
+    pthread_mutex_unlock(&reader->mutex);
+}
+
+static void* read_images(void* arg)
+{
+    struct reader* reader = arg;
+    char img_id[] = "pic0";
+    int wrong = 0;
+    for (size_t round = 0; round < reader->nb_rounds; ++round) {
+        for (size_t k = 0; k < reader->nb_images; ++k) {
+            img_id[3] = (char) ('0' + k);
+            if (!read_back(img_id, reader->contents[k], reader->sizes[k], reader->imgst_file)) wrong = 1;
+        }
+    }
+    reader_done(reader, wrong);
+    return NULL;
+}
+
+/**
+ * @brief Deletes pic0, run by a thread (reported like a reader).
+ */
+static void* delete_first(void* arg)
+{
+    struct reader* reader = arg;
+    reader_done(reader, do_delete("pic0", reader->imgst_file) != ERR_NONE);
+    return NULL;
+}
+
+/**
+ * @brief Creates the small image of pic0, run by a thread (reported like a reader).
+ */
+static void* resize_first(void* arg)
+{
+    struct reader* reader = arg;
+    reader_done(reader, do_create_resized("pic0", RES_SMALL, reader->imgst_file) != ERR_NONE);
+    return NULL;
+}
+
+static void init_reader(struct reader* reader, struct imgst_file* imgst_file, char** contents, size_t* sizes,
+                         size_t nb_images, size_t nb_rounds)
+{
+    *reader = (struct reader) { imgst_file, contents, sizes, nb_images, nb_rounds, 0, 0,
+                                PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+}
+
+/**
+ * @brief Whether the reader is done within 'seconds'.
+ */
+static int wait_reader(struct reader* reader, int seconds)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += seconds;
+    pthread_mutex_lock(&reader->mutex);
+    while (!reader->done && pthread_cond_timedwait(&reader->cond, &reader->mutex, &deadline) == 0);
+    const int done = reader->done;
+    pthread_mutex_unlock(&reader->mutex);
+    return done;
+}
+
+// ======================================================================
+/**
+ * @brief The imgStore is read while the content of an insertion is written.
+ */
+START_TEST(read_during_insertion)
+{
+    char* contents[2];
+    size_t sizes[2];
+    for (size_t k = 0; k < 2; ++k) {
+        contents[k] = read_file(test_images[k], &sizes[k]);
+        ck_assert_msg(contents[k] != NULL, "cannot read the test images");
+    }
+
+    struct imgst_file imgst_file;
+    ck_assert_msg(!create_test_db(10, &imgst_file), "cannot create " TEST_DB);
+    ck_assert_msg(imgst_lock_init(&imgst_file) == ERR_NONE, "cannot create the lock");
+    ck_assert_msg(do_insert(contents[0], sizes[0], "pic0", &imgst_file) == ERR_NONE, "cannot insert");
+
+    // Half of the content written, then pic0 read by another thread
+    struct imgst_insertion insertion;
+    ck_assert_msg(do_insert_begin("pic1", sizes[1], &insertion, &imgst_file) == ERR_NONE, "cannot begin an insertion");
+    ck_assert_msg(do_insert_append(&insertion, contents[1], sizes[1] / 2) == ERR_NONE, "cannot append");
+
+    struct reader reader;
+    pthread_t thread;
+    init_reader(&reader, &imgst_file, contents, sizes, 1, 1);
+    ck_assert_msg(pthread_create(&thread, NULL, read_images, &reader) == 0, "cannot start the reader");
+    const int answered = wait_reader(&reader, 2);
+
+    const int appended = do_insert_append(&insertion, contents[1] + sizes[1] / 2, sizes[1] - sizes[1] / 2);
+    const int committed = appended == ERR_NONE ? do_insert_commit(&insertion) : appended;
+    if (appended != ERR_NONE) do_insert_abort(&insertion);
+    pthread_join(thread, NULL);
+
+    ck_assert_msg(answered, "read blocked by the insertion");
+    ck_assert_msg(!reader.wrong, "wrong image read during the insertion");
+    ck_assert_msg(committed == ERR_NONE, "cannot commit");
+    ck_assert_msg(read_back("pic1", contents[1], sizes[1], &imgst_file), "wrong inserted image");
+
+    do_close(&imgst_file);
+    for (size_t k = 0; k < 2; ++k) free(contents[k]);
+}
+END_TEST
+
+// ======================================================================
+#define NB_READERS 4
+
+/**
+ * @brief Images inserted (one at a time, then as a batch) while other
+ *        threads read the stored ones: all read back.
+ */
+START_TEST(insert_while_reading)
+{
+    char* contents[NB_TEST_IMAGES];
+    size_t sizes[NB_TEST_IMAGES];
+    char img_id[] = "pic0";
+    for (size_t k = 0; k < NB_TEST_IMAGES; ++k) {
+        contents[k] = read_file(test_images[k], &sizes[k]);
+        ck_assert_msg(contents[k] != NULL, "cannot read the test images");
+    }
+
+    struct imgst_file imgst_file;
+    ck_assert_msg(!create_test_db(10, &imgst_file), "cannot create " TEST_DB);
+    ck_assert_msg(imgst_lock_init(&imgst_file) == ERR_NONE, "cannot create the lock");
+    for (size_t k = 0; k < 3; ++k) {
+        img_id[3] = (char) ('0' + k);
+        ck_assert_msg(do_insert(contents[k], sizes[k], img_id, &imgst_file) == ERR_NONE, "cannot insert");
+    }
+    ck_assert_msg(do_delete("pic1", &imgst_file) == ERR_NONE, "cannot delete"); // a hole to fill
+    ck_assert_msg(do_insert(contents[1], sizes[1], "pic1", &imgst_file) == ERR_NONE, "cannot insert again");
+
+    struct reader readers[NB_READERS];
+    pthread_t threads[NB_READERS];
+    for (size_t r = 0; r < NB_READERS; ++r) {
+        init_reader(&readers[r], &imgst_file, contents, sizes, 3, 20);
+        ck_assert_msg(pthread_create(&threads[r], NULL, read_images, &readers[r]) == 0, "cannot start a reader");
+    }
+
+    int inserted = 1;
+    for (size_t k = 3; k < 5; ++k) {
+        img_id[3] = (char) ('0' + k);
+        if (do_insert(contents[k], sizes[k], img_id, &imgst_file) != ERR_NONE) inserted = 0;
+    }
+    struct img_to_insert batch[] = {
+        { contents[5], sizes[5], "pic5", 0 }, { contents[6], sizes[6], "pic6", 0 }, { contents[5], sizes[5], "dup5", 0 }
+    };
+    if (do_insert_batch(batch, 3, &imgst_file) != ERR_NONE || batch[0].error || batch[1].error || batch[2].error) {
+        inserted = 0;
+    }
+
+    int wrong = 0;
+    for (size_t r = 0; r < NB_READERS; ++r) {
+        pthread_join(threads[r], NULL);
+        wrong |= readers[r].wrong;
+    }
+    ck_assert_msg(inserted, "cannot insert while reading");
+    ck_assert_msg(!wrong, "wrong image read during the insertions");
+    for (size_t k = 0; k < NB_TEST_IMAGES; ++k) {
+        img_id[3] = (char) ('0' + k);
+        ck_assert_msg(read_back(img_id, contents[k], sizes[k], &imgst_file), "wrong image after the insertions");
+    }
+    ck_assert_msg(read_back("dup5", contents[5], sizes[5], &imgst_file), "wrong duplicate after the insertions");
+
+    do_close(&imgst_file);
+    for (size_t k = 0; k < NB_TEST_IMAGES; ++k) free(contents[k]);
+}
+END_TEST
+
+// ======================================================================
+/**
+ * @brief An image of a batch too large for the metadata (4 GiB or more) is
+ *        skipped, and the others are inserted.
+ */
+START_TEST(insert_batch_too_large)
+{
+    char* contents[2];
+    size_t sizes[2];
+    for (size_t k = 0; k < 2; ++k) {
+        contents[k] = read_file(test_images[k], &sizes[k]);
+        ck_assert_msg(contents[k] != NULL, "cannot read the test images");
+    }
+
+    struct imgst_file imgst_file;
+    ck_assert_msg(!create_test_db(10, &imgst_file), "cannot create " TEST_DB);
+    struct img_to_insert batch[] = {
+        { contents[0], (size_t) UINT32_MAX + 1, "big", 0 }, { contents[1], sizes[1], "pic1", 0 }
+    };
+    ck_assert_msg(do_insert_batch(batch, 2, &imgst_file) == ERR_NONE, "cannot insert the batch");
+    ck_assert_msg(batch[0].error == ERR_INVALID_ARGUMENT, "too large image inserted");
+    ck_assert_msg(batch[1].error == ERR_NONE && read_back("pic1", contents[1], sizes[1], &imgst_file),
+                  "image of the batch not inserted");
+    ck_assert_msg(imgst_file.header.num_files == 1, "wrong number of images");
+
+    do_close(&imgst_file);
+    for (size_t k = 0; k < 2; ++k) free(contents[k]);
+}
+END_TEST
+
+// ======================================================================
+/**
+ * @brief The views of the images: their content and size (also of an
+ *        empty image, and of a resolution not created), and the read lock
+ *        given back by their release.
+ */
+START_TEST(read_view)
+{
+    char* contents[2];
+    size_t sizes[2];
+    char img_id[] = "pic0";
+    for (size_t k = 0; k < 2; ++k) {
+        contents[k] = read_file(test_images[k], &sizes[k]);
+        ck_assert_msg(contents[k] != NULL, "cannot read the test images");
+    }
+
+    struct imgst_file imgst_file;
+    ck_assert_msg(!create_test_db(10, &imgst_file), "cannot create " TEST_DB);
+    ck_assert_msg(imgst_lock_init(&imgst_file) == ERR_NONE, "cannot create the lock");
+    for (size_t k = 0; k < 2; ++k) {
+        img_id[3] = (char) ('0' + k);
+        ck_assert_msg(do_insert(contents[k], sizes[k], img_id, &imgst_file) == ERR_NONE, "cannot insert");
+    }
+
+    // Two views held at once
+    struct img_view views[2];
+    for (size_t k = 0; k < 2; ++k) {
+        img_id[3] = (char) ('0' + k);
+        ck_assert_msg(do_read_view(img_id, RES_ORIG, &views[k], &imgst_file) == ERR_NONE, "cannot read a view");
+    }
+    for (size_t k = 0; k < 2; ++k) {
+        const int same = views[k].size == sizes[k] && !memcmp(views[k].data, contents[k], sizes[k]);
+        do_release_view(&views[k]);
+        ck_assert_msg(same, "wrong view");
+        ck_assert_msg(views[k].data == NULL && views[k].map == NULL && views[k].imgst_file == NULL, "view not reset");
+    }
+    ck_assert_msg(do_read_view("none", RES_ORIG, &views[0], &imgst_file) == ERR_FILE_NOT_FOUND, "view of a missing image");
+    ck_assert_msg(views[0].imgst_file == NULL, "view of a missing image not reset");
+
+    // An empty content (as in a hand-made imgStore) is viewed without mapping
+    size_t i = 0;
+    while (i < imgst_file.header.max_files && strcmp(imgst_file.metadata[i].img_id, "pic1")) ++i;
+    ck_assert_msg(i < imgst_file.header.max_files, "pic1 not found");
+    imgst_file.metadata[i].size[RES_ORIG] = 0;
+    ck_assert_msg(do_read_view("pic1", RES_ORIG, &views[1], &imgst_file) == ERR_NONE, "cannot read an empty view");
+    const int empty = views[1].size == 0 && views[1].data != NULL && views[1].map == NULL;
+    do_release_view(&views[1]);
+    ck_assert_msg(empty, "wrong empty view");
+
+    // A resolution not created yet is not created by a stored view
+    int stored = 1;
+    ck_assert_msg(do_read_stored_view("pic0", RES_THUMB, &views[0], &stored, &imgst_file) == ERR_NONE,
+                  "cannot read a stored view");
+    ck_assert_msg(!stored && views[0].imgst_file == NULL, "stored view of a missing resolution");
+    ck_assert_msg(do_is_stored("pic0", RES_THUMB, &stored, &imgst_file) == ERR_NONE && !stored,
+                  "resolution created by a stored view");
+    ck_assert_msg(do_read_stored_view("pic0", RES_ORIG, &views[0], &stored, &imgst_file) == ERR_NONE && stored,
+                  "cannot read a stored view");
+    const int same = views[0].size == sizes[0] && !memcmp(views[0].data, contents[0], sizes[0]);
+    do_release_view(&views[0]);
+    ck_assert_msg(same, "wrong stored view");
+
+    // Released, the views let another thread take the write lock
+    struct reader deleter;
+    pthread_t thread;
+    init_reader(&deleter, &imgst_file, contents, sizes, 0, 0);
+    ck_assert_msg(pthread_create(&thread, NULL, delete_first, &deleter) == 0, "cannot start the deleter");
+    const int deleted = wait_reader(&deleter, 2);
+    ck_assert_msg(deleted, "write lock held after the release of the views"); // (the deleter is left blocked)
+    pthread_join(thread, NULL);
+    ck_assert_msg(!deleter.wrong, "cannot delete after the release of the views");
+
+    do_close(&imgst_file);
+    for (size_t k = 0; k < 2; ++k) free(contents[k]);
+}
+END_TEST
+
+// ======================================================================
+/**
+ * @brief What the event loop of the server does on each poll (group commit,
+ *        read of a stored image) does not wait for a resize, which reads the
+ *        imgStore meanwhile.
+ */
+START_TEST(read_during_resize)
+{
+    // pic0 (the largest image) is resized, pic1 is read
+    const size_t images[2] = { 2, 0 };
+    char* contents[2];
+    size_t sizes[2];
+    char img_id[] = "pic0";
+    for (size_t k = 0; k < 2; ++k) {
+        contents[k] = read_file(test_images[images[k]], &sizes[k]);
+        ck_assert_msg(contents[k] != NULL, "cannot read the test images");
+    }
+
+    struct imgst_file imgst_file;
+    ck_assert_msg(!create_test_db(10, &imgst_file), "cannot create " TEST_DB);
+    ck_assert_msg(imgst_lock_init(&imgst_file) == ERR_NONE, "cannot create the lock");
+    for (size_t k = 0; k < 2; ++k) {
+        img_id[3] = (char) ('0' + k);
+        ck_assert_msg(do_insert(contents[k], sizes[k], img_id, &imgst_file) == ERR_NONE, "cannot insert");
+    }
+
+    struct reader resizer;
+    pthread_t thread;
+    init_reader(&resizer, &imgst_file, contents, sizes, 0, 0);
+    ck_assert_msg(pthread_create(&thread, NULL, resize_first, &resizer) == 0, "cannot start the resize");
+
+    // Waits for the resize to hold the read lock
+    int reading = 0;
+    for (int k = 0; k < 1000000 && !reading; ++k) {
+        reading = !imgst_try_write_lock(&imgst_file);
+        if (!reading) imgst_unlock(&imgst_file);
+    }
+
+    // Then commits and reads pic1, the resize still reading
+    const int committed = do_group_commit(&imgst_file);
+    const int read = read_back("pic1", contents[1], sizes[1], &imgst_file);
+    const int still_reading = !imgst_try_write_lock(&imgst_file);
+    if (!still_reading) imgst_unlock(&imgst_file);
+
+    const int resized = wait_reader(&resizer, 10);
+    pthread_join(thread, NULL);
+
+    ck_assert_msg(committed == ERR_NONE, "cannot commit");
+    ck_assert_msg(read, "wrong image read during the resize");
+    ck_assert_msg(resized && !resizer.wrong, "cannot resize");
+    if (reading) ck_assert_msg(still_reading, "commit or read blocked by the resize");
+    else printf("%s: resize too fast to be seen reading the imgStore, not checked\n", __func__);
+
+    do_close(&imgst_file);
+    for (size_t k = 0; k < 2; ++k) free(contents[k]);
+}
+END_TEST
+
+// ======================================================================
+static void remove_test_db(void)
+{
+    unlink(TEST_DB);
+}
+
+// ======================================================================
+Suite* imgStore_test_suite()
+{
+    Suite* s = suite_create("Tests of the imgStore library");
+
+    Add_Case(s, tc1, "imgStore tests");
+    tcase_add_checked_fixture(tc1, NULL, remove_test_db);
+    tcase_set_timeout(tc1, 30); // the resizes of the concurrent tests
+    tcase_add_test(tc1, grow_mapped);
+    tcase_add_test(tc1, compact_interleaved);
+    tcase_add_test(tc1, read_during_insertion);
+    tcase_add_test(tc1, insert_while_reading);
+    tcase_add_test(tc1, insert_batch_too_large);
+    tcase_add_test(tc1, read_view);
+    tcase_add_test(tc1, read_during_resize);
+
+    return s;
+}
+
+TEST_SUITE(imgStore_test_suite)
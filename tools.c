@@ -5,15 +5,46 @@
  * @author Mia Primorac
  */
 
+#define _GNU_SOURCE // for fileno, fsync, pread, pwrite, copy_file_range
+
 #include "imgStore.h"
+#include "freespace.h"
+#include "index.h"
+#include "journal.h"
 #include "util.h"
 
 #include <stdint.h> // for uint8_t
 #include <stdio.h> // for sprintf
 #include <stdlib.h>
+#include <string.h> // for memcmp
+#include <unistd.h> // for fsync, pread, pwrite, copy_file_range
+#include <pthread.h> // for pthread_rwlock_t
+#include <sys/mman.h> // for mmap
+#include <sys/stat.h> // for fstat
+#ifdef __linux__
+#include <sys/sendfile.h> // for sendfile
+#endif
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
 
-#define SHA256_STRING_LENGTH (2*SHA256_DIGEST_LENGTH) // length of a human-readable SHA
+#define MAX_OPEN_MODE 7 // max. size of a fopen() mode
+#define MAX_RESIZES 64 // max. number of images whose resized images are created at the same time
+
+/**
+ * @brief Readers/writers lock of the operations on an imgStore (see do_open()).
+ */
+struct imgst_lock {
+    pthread_rwlock_t rwlock;
+    pthread_mutex_t resizes_mutex; // protects the images being resized
+    pthread_cond_t resize_done;    // signaled when the resize of an image ends
+    size_t resizes[MAX_RESIZES];   // positions of the images being resized (see imgst_resize_begin)
+    size_t nb_resizes;
+    uint64_t changes;              // writes of the header or of the metadata (see imgst_changes)
+    pthread_mutex_t space_mutex;   // protects the space given to the insertions (see imgst_space_alloc)
+    pthread_cond_t space_changed;  // signaled when an insertion, or the exclusive use of the space, ends
+    size_t nb_insertions;          // insertions writing their content (see imgst_insertion_begin)
+    int space_exclusive;           // whether the space is (to be) used by a single operation
+    uint64_t reserved_end;         // end of the file, including the contents being written
+};
 
 /********************************************************************//**
  * Human-readable SHA
@@ -76,6 +107,95 @@ print_metadata (const struct img_metadata * metadata)
     }
 }
 
+// See imgStore.h
+uint64_t
+get_metadata_offset (const struct imgst_header* header)
+{
+    if (header->format == IMGST_FORMAT_V2) return header->metadata_offset;
+    return sizeof(struct imgst_header); // v1: right after the header
+}
+
+/********************************************************************//**
+ * Loads the metadata from the file on the heap.
+ */
+static int
+read_metadata (struct imgst_file* imgst_file)
+{
+    const uint64_t offset = get_metadata_offset(&imgst_file->header);
+
+    // Allocates the metadata on the heap
+    struct img_metadata * metadata = calloc(imgst_file->header.max_files, sizeof(struct img_metadata));
+    if (NULL == metadata) return ERR_OUT_OF_MEMORY;
+    imgst_file->metadata = metadata;
+
+    // Reads the metadata from the file
+    const int error = pread_full(fileno(imgst_file->file), imgst_file->metadata,
+                                 imgst_file->header.max_files * sizeof(struct img_metadata), offset);
+    if (error != ERR_NONE) FREE_POINTER(imgst_file->metadata);
+    return error;
+}
+
+/********************************************************************//**
+ * Maps the metadata of the file in memory, from the page holding its
+ * beginning (so that the header is mapped as well as long as the
+ * metadata has not been moved away by do_grow()).
+ * Shared (i.e. edited in place) if the file is writable and not journaled,
+ * private otherwise (the journal writes the updates to the file).
+ */
+static int
+map_metadata (struct imgst_file* imgst_file)
+{
+    const uint64_t offset = get_metadata_offset(&imgst_file->header);
+    const uint64_t page_size = (uint64_t) sysconf(_SC_PAGESIZE);
+    const uint64_t map_offset = offset - offset % page_size;
+    const uint64_t map_end = offset + (uint64_t) imgst_file->header.max_files * sizeof(struct img_metadata);
+
+    // Mapping past the end of the file would fault on access
+    struct stat st;
+    const int fd = fileno(imgst_file->file);
+    if (fstat(fd, &st) != 0 || (uint64_t) st.st_size < map_end || map_end > (uint64_t) INT64_MAX) return ERR_IO;
+
+    const size_t map_size = (size_t) (map_end - map_offset);
+    const int flags = imgst_file->read_only || imgst_file->journal != NULL ? MAP_PRIVATE : MAP_SHARED;
+    void* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, flags, fd, (off_t) map_offset);
+    if (map == MAP_FAILED) return ERR_IO;
+
+    imgst_file->map = map;
+    imgst_file->map_size = map_size;
+    imgst_file->metadata = (struct img_metadata*) ((char*) map + (offset - map_offset));
+    return ERR_NONE;
+}
+
+/********************************************************************//**
+ * Returns the header in the mapping of the metadata, if mapped there.
+ */
+static struct imgst_header*
+mapped_header (const struct imgst_file* imgst_file)
+{
+    if (imgst_file->map == NULL) return NULL;
+
+    const size_t offset_in_map = (size_t) ((char*) imgst_file->metadata - (char*) imgst_file->map);
+    if (get_metadata_offset(&imgst_file->header) != offset_in_map) return NULL; // does not start at 0
+
+    return (struct imgst_header*) imgst_file->map;
+}
+
+/********************************************************************//**
+ * Frees (or unmaps) the metadata.
+ */
+static void
+release_metadata (struct imgst_file* imgst_file)
+{
+    if (imgst_file->map != NULL) {
+        munmap(imgst_file->map, imgst_file->map_size);
+        imgst_file->map = NULL;
+        imgst_file->map_size = 0;
+        imgst_file->metadata = NULL;
+    } else if (imgst_file->metadata != NULL) {
+        FREE_POINTER(imgst_file->metadata);
+    }
+}
+
 // See imgStore.h
 int
 do_open (const char* imgst_filename, const char* open_mode, struct imgst_file* imgst_file)
@@ -84,47 +204,193 @@ do_open (const char* imgst_filename, const char* open_mode, struct imgst_file* i
     M_REQUIRE_NON_NULL(open_mode);
     M_REQUIRE_NON_NULL(imgst_file);
 
+    imgst_file->metadata = NULL;
+    imgst_file->index = NULL;
+    imgst_file->map = NULL;
+    imgst_file->map_size = 0;
+    imgst_file->journal = NULL;
+    imgst_file->freespace = NULL;
+    imgst_file->lock = NULL;
+
+    // Replays the journal left behind by a crash, if any
+    M_EXIT_IF_ERR(journal_recover(imgst_filename));
+
+    // Separates the mapping flag from the mode given to fopen()
+    char fopen_mode[MAX_OPEN_MODE+1] = "";
+    int mapped = 0;
+    size_t len = 0;
+    for (size_t i = 0; open_mode[i] != '\0'; ++i) {
+        if (open_mode[i] == MMAP_FLAG) {
+            mapped = 1;
+        } else if (len < MAX_OPEN_MODE) {
+            fopen_mode[len++] = open_mode[i];
+        }
+    }
+    imgst_file->read_only = fopen_mode[0] == 'r' && strchr(fopen_mode, '+') == NULL;
+
     // Opens the binary file on which has been written the DB
-    imgst_file->file = fopen(imgst_filename, open_mode);
+    imgst_file->file = fopen(imgst_filename, fopen_mode);
     if (NULL == imgst_file->file) return ERR_IO;
 
     // Reads the header from the file
-    size_t nb_ok = fread(&imgst_file->header,  sizeof(struct imgst_header), 1, imgst_file->file);
-    if (nb_ok != 1 || imgst_file->header.max_files > MAX_MAX_FILES) {
+    const int error_header = pread_full(fileno(imgst_file->file), &imgst_file->header, sizeof(struct imgst_header), 0);
+    const struct imgst_header* header = &imgst_file->header;
+    if (error_header != ERR_NONE
+        || (header->format != IMGST_FORMAT_V1 && header->format != IMGST_FORMAT_V2)
+        || header->max_files > (header->format == IMGST_FORMAT_V2 ? MAX_GROWN_FILES : MAX_MAX_FILES)) {
         CLOSE_FILE(imgst_file->file);
         return ERR_IO;
     }
 
-    // Allocates the metadata on the heap
-    struct img_metadata * metadata = calloc(imgst_file->header.max_files, sizeof(struct img_metadata));
-    if (NULL == metadata) {
+    // Reads (or maps) the metadata
+    const int error_metadata = mapped ? map_metadata(imgst_file) : read_metadata(imgst_file);
+    if (error_metadata != ERR_NONE) {
         CLOSE_FILE(imgst_file->file);
-        return ERR_OUT_OF_MEMORY;
+        return error_metadata;
     }
-    imgst_file->metadata = metadata;
 
-    // Reads the metadata from the file
-    nb_ok = fread(imgst_file->metadata, sizeof(struct img_metadata), imgst_file->header.max_files, imgst_file->file);
-    if (nb_ok != imgst_file->header.max_files) {
+    // Builds the in-memory index of the metadata, and the lock of the readers and writers
+    int error_index = index_build(imgst_file);
+    if (error_index == ERR_NONE) error_index = imgst_lock_init(imgst_file);
+    if (error_index != ERR_NONE) {
         CLOSE_FILE(imgst_file->file);
-        FREE_POINTER(imgst_file->metadata);
-        return ERR_IO;
+        release_metadata(imgst_file);
+        index_free(imgst_file);
+        return error_index;
     }
     return ERR_NONE;
 }
 
+// See imgStore.h
+int
+reload_metadata (struct imgst_file* imgst_file)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->file);
+
+    const int mapped = imgst_file->map != NULL;
+    index_free(imgst_file);
+    freespace_free(imgst_file);
+    release_metadata(imgst_file);
+
+    M_EXIT_IF_ERR(mapped ? map_metadata(imgst_file) : read_metadata(imgst_file));
+    return index_build(imgst_file);
+}
+
 // See imgStore.h
 void
 do_close (struct imgst_file* imgst_file)
 {
     if (imgst_file != NULL) {
+        if (imgst_file->journal != NULL) {
+            journal_close(imgst_file);
+        }
         if (imgst_file->file != NULL) {
             CLOSE_FILE(imgst_file->file);
         }
-        if (imgst_file->metadata != NULL) {
-            FREE_POINTER(imgst_file->metadata);
+        release_metadata(imgst_file);
+        index_free(imgst_file);
+        freespace_free(imgst_file);
+        if (imgst_file->lock != NULL) {
+            pthread_rwlock_destroy(&imgst_file->lock->rwlock);
+            pthread_mutex_destroy(&imgst_file->lock->resizes_mutex);
+            pthread_cond_destroy(&imgst_file->lock->resize_done);
+            pthread_mutex_destroy(&imgst_file->lock->space_mutex);
+            pthread_cond_destroy(&imgst_file->lock->space_changed);
+            FREE_POINTER(imgst_file->lock);
+        }
+    }
+}
+
+// See imgStore.h
+int
+do_sync (struct imgst_file* imgst_file)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->file);
+
+    if (imgst_file->journal != NULL) {
+        M_EXIT_IF_ERR(commit_updates(imgst_file));
+        M_EXIT_IF_ERR(journal_flush(imgst_file, 1));
+    }
+    if (fflush(imgst_file->file) != 0) return ERR_IO;
+    if (imgst_file->map != NULL && msync(imgst_file->map, imgst_file->map_size, MS_SYNC) != 0) return ERR_IO;
+    if (fsync(fileno(imgst_file->file)) != 0) return ERR_IO;
+
+    return ERR_NONE;
+}
+
+/********************************************************************//**
+ * Body of do_set_durability(), under the write lock.
+ */
+static int
+set_durability (const char* imgst_filename, int durability, unsigned group_ops, unsigned group_ms,
+                struct imgst_file* imgst_file)
+{
+    // Changing the level makes the pending operations durable first
+    if (imgst_file->journal != NULL) {
+        if (durability != DURABILITY_NONE) {
+            M_EXIT_IF_ERR(do_sync(imgst_file));
+            imgst_file->journal->durability = durability;
+            imgst_file->journal->group_ops = group_ops;
+            imgst_file->journal->group_ms = group_ms;
+            return ERR_NONE;
         }
+        M_EXIT_IF_ERR(journal_close(imgst_file));
+    } else if (durability != DURABILITY_NONE) {
+        M_EXIT_IF_ERR(do_sync(imgst_file));
+        M_EXIT_IF_ERR(journal_open(imgst_file, imgst_filename, durability, group_ops, group_ms));
+    } else {
+        return ERR_NONE;
     }
+
+    // Mapped metadata is shared if and only if there is no journal
+    return imgst_file->map != NULL ? reload_metadata(imgst_file) : ERR_NONE;
+}
+
+// See imgStore.h
+int
+do_set_durability (const char* imgst_filename, int durability, unsigned group_ops, unsigned group_ms,
+                   struct imgst_file* imgst_file)
+{
+    M_REQUIRE_NON_NULL(imgst_filename);
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(imgst_file->file);
+    M_REQUIRE(durability == DURABILITY_NONE || durability == DURABILITY_SYNC || durability == DURABILITY_GROUP,
+              ERR_INVALID_ARGUMENT, "unknown durability level (%d)", durability);
+
+    // The metadata may be loaded again, and the map of the holes built again from it:
+    // no insertion may be writing meanwhile
+    imgst_space_exclusive_begin(imgst_file);
+    imgst_write_lock(imgst_file);
+    const int ret = set_durability(imgst_filename, durability, group_ops, group_ms, imgst_file);
+    imgst_unlock(imgst_file);
+    imgst_space_exclusive_end(imgst_file);
+    return ret;
+}
+
+// See imgStore.h
+int
+do_group_commit (struct imgst_file* imgst_file)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+
+    // Nothing to flush without a journal: the lock is not even taken
+    if (imgst_file->journal == NULL) return ERR_NONE;
+    if (!imgst_try_write_lock(imgst_file)) return ERR_NONE;
+
+    const int ret = journal_flush(imgst_file, 0);
+    imgst_unlock(imgst_file);
+    return ret;
+}
+
+// See imgStore.h
+int
+commit_updates (struct imgst_file * imgst_file)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+
+    return imgst_file->journal != NULL ? journal_commit(imgst_file) : ERR_NONE;
 }
 
 // See imgStore.h
@@ -143,18 +409,31 @@ resolution_atoi (const char* resolution)
 // See imgStore.h
 int
 update_metadata (struct imgst_file * imgst_file, const size_t index)
+{
+    return update_metadata_range(imgst_file, index, 1);
+}
+
+// See imgStore.h
+int
+update_metadata_range (struct imgst_file * imgst_file, const size_t first, const size_t count)
 {
     M_REQUIRE_NON_NULL(imgst_file);
-    M_REQUIRE(index >= 0, ERR_INVALID_ARGUMENT, "input value (%lu) is too low (< 0)", i);
+    M_REQUIRE(first + count <= imgst_file->header.max_files, ERR_INVALID_ARGUMENT,
+              "range end (%zu) is too high (> max_files)", first + count);
+    if (imgst_file->lock != NULL) ++imgst_file->lock->changes;
 
-    // Sets the file position indicator to the position of the metadata of the image
-    int offset = sizeof(struct imgst_header) + index * sizeof(struct img_metadata);
-    fseek(imgst_file->file, offset, SEEK_SET);
+    const uint64_t offset = get_metadata_offset(&imgst_file->header) + (uint64_t) first * sizeof(struct img_metadata);
 
-    // Writes the updated metadata on the disk at the offset position
-    if (fwrite(&(imgst_file->metadata[index]), sizeof(struct img_metadata), 1, imgst_file->file) != 1) return ERR_IO;
+    // A journaled update is written to the file once committed
+    if (imgst_file->journal != NULL) {
+        return journal_log(imgst_file->journal, offset, &(imgst_file->metadata[first]), count * sizeof(struct img_metadata));
+    }
 
-    return ERR_NONE;
+    // A mapped metadata is edited in place: nothing to write
+    if (imgst_file->map != NULL) return imgst_file->read_only ? ERR_IO : ERR_NONE;
+
+    // Writes the updated metadata on the disk at the offset position
+    return pwrite_full(fileno(imgst_file->file), &(imgst_file->metadata[first]), count * sizeof(struct img_metadata), offset);
 }
 
 // See imgStore.h
@@ -163,11 +442,23 @@ update_header (struct imgst_file * imgst_file)
 {
     M_REQUIRE_NON_NULL(imgst_file);
 
-    // Writes the content of the header at the beginning of the file
-    rewind(imgst_file->file);
-    if (fwrite(&(imgst_file->header), sizeof(struct imgst_header), 1, imgst_file->file) != 1) return ERR_IO;
+    if (imgst_file->read_only) return ERR_IO;
+    if (imgst_file->lock != NULL) ++imgst_file->lock->changes;
 
-    return ERR_NONE;
+    // A journaled update is written to the file once committed
+    if (imgst_file->journal != NULL) {
+        return journal_log(imgst_file->journal, 0, &(imgst_file->header), sizeof(struct imgst_header));
+    }
+
+    // A mapped header is copied in place
+    struct imgst_header* header = mapped_header(imgst_file);
+    if (header != NULL) {
+        memcpy(header, &(imgst_file->header), sizeof(struct imgst_header));
+        return ERR_NONE;
+    }
+
+    // Writes the content of the header at the beginning of the file
+    return pwrite_full(fileno(imgst_file->file), &(imgst_file->header), sizeof(struct imgst_header), 0);
 }
 
 // See imgStore.h
@@ -177,53 +468,402 @@ compare_sha (const unsigned char* sha1, const unsigned char* sha2)
     M_REQUIRE_NON_NULL(sha1);
     M_REQUIRE_NON_NULL(sha2);
 
-    // Transforms the first SHA value into a string
-    char* sha1_str;
-    M_EXIT_IF_NULL(sha1_str = malloc(SHA256_STRING_LENGTH+1), SHA256_STRING_LENGTH+1);
-    sha_to_string(sha1, sha1_str);
+    // 0 if and only if the two SHA are equal (same order as their hexadecimal representation)
+    return memcmp(sha1, sha2, SHA256_DIGEST_LENGTH);
+}
 
-    // Transforms the second SHA value into a string
-    char* sha2_str = malloc(SHA256_STRING_LENGTH+1);
-    if (sha2_str == NULL) {
-        FREE_POINTER(sha1_str);
-        return ERR_OUT_OF_MEMORY;
+// See imgStore.h
+int
+write_image_end_of_imgst (size_t index, const int res, const char* buffer, size_t size, struct imgst_file* imgst_file)
+{
+    // Position of the end of the imgStore (after the contents being written by insertions)
+    uint64_t offset = 0;
+    M_EXIT_IF_ERR(imgst_space_alloc(imgst_file, 0, size, &offset, NULL));
+
+    // Writes the buffer content (i.e. the image) and the image position to the imgStore
+    const int error_write = pwrite_full(fileno(imgst_file->file), buffer, size, offset);
+    if (error_write != ERR_NONE) {
+        imgst_space_release(imgst_file, offset, size, 0);
+        return error_write;
     }
-    sha_to_string(sha2, sha2_str);
+    imgst_file->metadata[index].offset[res] = offset;
 
-    // 0 if and only if the two strings are equal
-    int are_equal = strncmp(sha1_str, sha2_str, SHA256_STRING_LENGTH);
+    return ERR_NONE;
+}
 
-    // Clean-up
-    FREE_POINTER(sha1_str);
-    FREE_POINTER(sha2_str);
+// See imgStore.h
+int
+write_image_to_imgst (size_t index, const int res, const char* buffer, size_t size, struct imgst_file* imgst_file)
+{
+    uint64_t offset = 0;
+    int in_hole = 0;
+    M_EXIT_IF_ERR(imgst_space_alloc(imgst_file, 1, size, &offset, &in_hole));
+
+    const int error_write = pwrite_full(fileno(imgst_file->file), buffer, size, offset);
+    if (error_write != ERR_NONE) {
+        imgst_space_release(imgst_file, offset, size, in_hole);
+        return error_write;
+    }
+    imgst_file->metadata[index].offset[res] = offset;
 
-    return are_equal;
+    return ERR_NONE;
 }
 
 // See imgStore.h
 int
-write_image_end_of_imgst (size_t index, const int res, const char* buffer, size_t size, struct imgst_file* imgst_file)
+load_image_from_imgst (size_t index, const int resolution, char* image_buffer, uint32_t image_size, struct imgst_file* imgst_file)
 {
-    // Sets the file position indicator to the end of the imgStore, and sets the memory position of the image
-    fseek(imgst_file->file, 0, SEEK_END);
-    int offset = ftell(imgst_file->file);
+    // Loads the image in the buffer (without moving the file position: other threads may read at the same time)
+    return pread_full(fileno(imgst_file->file), image_buffer, image_size, imgst_file->metadata[index].offset[resolution]);
+}
 
-    // Writes the buffer content (i.e. the image) and the image position to the imgStore
-    if (fwrite(buffer, size, 1, imgst_file->file) != 1) return ERR_IO;
-    imgst_file->metadata[index].offset[res] = offset;
+// See imgStore.h
+int
+copy_range (int in, int out, uint64_t from, uint64_t to, uint64_t size, char* buffer)
+{
+    M_REQUIRE_NON_NULL(buffer);
+    if (from > (uint64_t) INT64_MAX || to > (uint64_t) INT64_MAX) return ERR_IO;
 
+    off_t in_offset = (off_t) from;
+    off_t out_offset = (off_t) to;
+
+#ifdef __linux__
+    while (size > 0) {
+        const ssize_t n = copy_file_range(in, &in_offset, out, &out_offset, (size_t) size, 0);
+        if (n <= 0) break; // not supported (e.g. across filesystems): falls back
+        size -= (uint64_t) n;
+    }
+
+    if (size > 0 && lseek(out, out_offset, SEEK_SET) == out_offset) {
+        while (size > 0) {
+            const ssize_t n = sendfile(out, in, &in_offset, (size_t) size);
+            if (n <= 0) break;
+            size -= (uint64_t) n;
+        }
+        out_offset = lseek(out, 0, SEEK_CUR);
+        if (out_offset < 0) return ERR_IO;
+    }
+#endif
+
+    while (size > 0) {
+        const size_t chunk = size < COPY_BUFFER_SIZE ? (size_t) size : COPY_BUFFER_SIZE;
+        const ssize_t n = pread(in, buffer, chunk, in_offset);
+        if (n <= 0 || pwrite(out, buffer, (size_t) n, out_offset) != n) return ERR_IO;
+        in_offset += n;
+        out_offset += n;
+        size -= (uint64_t) n;
+    }
     return ERR_NONE;
 }
 
 // See imgStore.h
 int
-load_image_from_imgst (size_t index, const int resolution, char* image_buffer, uint32_t image_size, struct imgst_file* imgst_file)
+pread_full (int fd, void* buffer, size_t size, uint64_t offset)
 {
-    // Sets the file position indicator to the position of the image in memory
-    fseek(imgst_file->file, imgst_file->metadata[index].offset[resolution], SEEK_SET);
+    M_REQUIRE_NON_NULL(buffer);
+    if (offset > (uint64_t) INT64_MAX) return ERR_IO;
+
+    char* to = buffer;
+    while (size > 0) {
+        const ssize_t n = pread(fd, to, size, (off_t) offset);
+        if (n <= 0) return ERR_IO; // error, or end of file before 'size' bytes
+        to += n;
+        offset += (uint64_t) n;
+        size -= (size_t) n;
+    }
+    return ERR_NONE;
+}
 
-    // Loads the image in the buffer
-    if (fread(image_buffer, image_size, 1, imgst_file->file) != 1) return ERR_IO;
+// See imgStore.h
+int
+pwrite_full (int fd, const void* buffer, size_t size, uint64_t offset)
+{
+    M_REQUIRE_NON_NULL(buffer);
+    if (offset > (uint64_t) INT64_MAX) return ERR_IO;
+
+    const char* from = buffer;
+    while (size > 0) {
+        const ssize_t n = pwrite(fd, from, size, (off_t) offset);
+        if (n <= 0) return ERR_IO;
+        from += n;
+        offset += (uint64_t) n;
+        size -= (size_t) n;
+    }
+    return ERR_NONE;
+}
 
+// See imgStore.h
+int
+get_file_end (const struct imgst_file* imgst_file, uint64_t* end)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(end);
+
+    struct stat st;
+    if (fstat(fileno(imgst_file->file), &st) != 0) return ERR_IO;
+    *end = (uint64_t) st.st_size;
     return ERR_NONE;
-}
\ No newline at end of file
+}
+
+// See imgStore.h
+int
+imgst_lock_init (struct imgst_file* imgst_file)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+
+    imgst_file->lock = malloc(sizeof(struct imgst_lock));
+    if (imgst_file->lock == NULL) return ERR_OUT_OF_MEMORY;
+    if (pthread_rwlock_init(&imgst_file->lock->rwlock, NULL) != 0) {
+        FREE_POINTER(imgst_file->lock);
+        return ERR_OUT_OF_MEMORY;
+    }
+    pthread_mutex_init(&imgst_file->lock->resizes_mutex, NULL);
+    pthread_cond_init(&imgst_file->lock->resize_done, NULL);
+    imgst_file->lock->nb_resizes = 0;
+    imgst_file->lock->changes = 0;
+    pthread_mutex_init(&imgst_file->lock->space_mutex, NULL);
+    pthread_cond_init(&imgst_file->lock->space_changed, NULL);
+    imgst_file->lock->nb_insertions = 0;
+    imgst_file->lock->space_exclusive = 0;
+    imgst_file->lock->reserved_end = 0;
+    return ERR_NONE;
+}
+
+// See imgStore.h
+void
+imgst_read_lock (const struct imgst_file* imgst_file)
+{
+    if (imgst_file != NULL && imgst_file->lock != NULL) pthread_rwlock_rdlock(&imgst_file->lock->rwlock);
+}
+
+// See imgStore.h
+void
+imgst_write_lock (const struct imgst_file* imgst_file)
+{
+    if (imgst_file != NULL && imgst_file->lock != NULL) pthread_rwlock_wrlock(&imgst_file->lock->rwlock);
+}
+
+// See imgStore.h
+void
+imgst_unlock (const struct imgst_file* imgst_file)
+{
+    if (imgst_file != NULL && imgst_file->lock != NULL) pthread_rwlock_unlock(&imgst_file->lock->rwlock);
+}
+
+// See imgStore.h
+int
+imgst_try_write_lock (const struct imgst_file* imgst_file)
+{
+    if (imgst_file == NULL || imgst_file->lock == NULL) return 1;
+    return pthread_rwlock_trywrlock(&imgst_file->lock->rwlock) == 0;
+}
+
+/********************************************************************//**
+ * Takes, resp. releases, the mutex of the space given to the insertions
+ * (nothing is done if the imgStore has no lock).
+ */
+static void
+space_lock (const struct imgst_file* imgst_file)
+{
+    if (imgst_file->lock != NULL) pthread_mutex_lock(&imgst_file->lock->space_mutex);
+}
+
+static void
+space_unlock (const struct imgst_file* imgst_file)
+{
+    if (imgst_file->lock != NULL) pthread_mutex_unlock(&imgst_file->lock->space_mutex);
+}
+
+/********************************************************************//**
+ * Gives 'size' bytes at the end of the file, after the ones already given
+ * (under the mutex of the space).
+ */
+static int
+reserve_end (struct imgst_file* imgst_file, uint64_t size, uint64_t* offset)
+{
+    M_EXIT_IF_ERR(get_file_end(imgst_file, offset));
+    struct imgst_lock* lock = imgst_file->lock;
+    if (lock == NULL) return ERR_NONE;
+
+    // Built before any content is written unpublished: built later from the
+    // metadata, the map would count it as a hole
+    M_EXIT_IF_ERR(freespace_build(imgst_file));
+
+    // After the holes given back beyond the end of the file (never written), if any
+    const struct imgst_freespace* map = imgst_file->freespace;
+    if (map->nb_extents > 0) {
+        const struct free_extent* last = &map->extents[map->nb_extents - 1];
+        if (last->offset + last->size > *offset) *offset = last->offset + last->size;
+    }
+    if (lock->reserved_end > *offset) *offset = lock->reserved_end;
+    lock->reserved_end = *offset + size;
+    return ERR_NONE;
+}
+
+// See imgStore.h
+int
+imgst_space_alloc (struct imgst_file* imgst_file, int in_holes, uint64_t size, uint64_t* offset, int* in_hole)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(offset);
+
+    space_lock(imgst_file);
+    int ret = in_holes && size > 0 ? freespace_alloc(imgst_file, size, offset) : ERR_FULL_IMGSTORE;
+    const int hole = ret == ERR_NONE;
+    if (hole && imgst_file->journal != NULL) {
+        // The deletion which freed the hole must be durable before the hole is overwritten
+        ret = journal_flush(imgst_file, 1);
+        if (ret != ERR_NONE) freespace_release(imgst_file, *offset, size);
+    } else if (ret == ERR_FULL_IMGSTORE) {
+        ret = reserve_end(imgst_file, size, offset);
+    }
+    space_unlock(imgst_file);
+
+    if (in_hole != NULL) *in_hole = hole && ret == ERR_NONE;
+    return ret;
+}
+
+// See imgStore.h
+int
+imgst_space_extend (struct imgst_file* imgst_file, uint64_t size, uint64_t extra, uint64_t* offset)
+{
+    M_REQUIRE_NON_NULL(imgst_file);
+    M_REQUIRE_NON_NULL(offset);
+    if (imgst_file->lock == NULL) return ERR_NONE; // nothing else is given meanwhile
+
+    space_lock(imgst_file);
+    int ret = ERR_NONE;
+    if (*offset + size == imgst_file->lock->reserved_end) {
+        imgst_file->lock->reserved_end += extra;
+    } else {
+        ret = reserve_end(imgst_file, size + extra, offset);
+    }
+    space_unlock(imgst_file);
+    return ret;
+}
+
+// See imgStore.h
+void
+imgst_space_release (struct imgst_file* imgst_file, uint64_t offset, uint64_t size, int in_hole)
+{
+    if (imgst_file == NULL || size == 0) return;
+
+    space_lock(imgst_file);
+    uint64_t file_end = 0;
+    const int known_end = get_file_end(imgst_file, &file_end) == ERR_NONE;
+    const int last = imgst_file->lock != NULL ? offset + size == imgst_file->lock->reserved_end
+                     : offset + size >= file_end; // possibly not all written
+    if (!in_hole && last && known_end) {
+        // The last bytes given at the end of the file: the file ends before them again
+        if (imgst_file->lock != NULL) imgst_file->lock->reserved_end = offset;
+        if (file_end > offset && ftruncate(fileno(imgst_file->file), (off_t) offset) != 0) {
+            (void) freespace_release(imgst_file, offset, size); // the bytes stay: reused as a hole
+        }
+    } else {
+        (void) freespace_release(imgst_file, offset, size);
+    }
+    space_unlock(imgst_file);
+}
+
+// See imgStore.h
+void
+imgst_insertion_begin (const struct imgst_file* imgst_file)
+{
+    if (imgst_file == NULL || imgst_file->lock == NULL) return;
+    struct imgst_lock* lock = imgst_file->lock;
+
+    pthread_mutex_lock(&lock->space_mutex);
+    while (lock->space_exclusive) pthread_cond_wait(&lock->space_changed, &lock->space_mutex);
+    ++lock->nb_insertions;
+    pthread_mutex_unlock(&lock->space_mutex);
+}
+
+// See imgStore.h
+void
+imgst_insertion_end (const struct imgst_file* imgst_file)
+{
+    if (imgst_file == NULL || imgst_file->lock == NULL) return;
+    struct imgst_lock* lock = imgst_file->lock;
+
+    pthread_mutex_lock(&lock->space_mutex);
+    // Once none is left, all the bytes given at the end of the file are published or given back
+    if (--lock->nb_insertions == 0) lock->reserved_end = 0;
+    pthread_cond_broadcast(&lock->space_changed);
+    pthread_mutex_unlock(&lock->space_mutex);
+}
+
+// See imgStore.h
+void
+imgst_space_exclusive_begin (const struct imgst_file* imgst_file)
+{
+    if (imgst_file == NULL || imgst_file->lock == NULL) return;
+    struct imgst_lock* lock = imgst_file->lock;
+
+    // No new insertion starts meanwhile: the ones writing their content end first
+    pthread_mutex_lock(&lock->space_mutex);
+    while (lock->space_exclusive) pthread_cond_wait(&lock->space_changed, &lock->space_mutex);
+    lock->space_exclusive = 1;
+    while (lock->nb_insertions > 0) pthread_cond_wait(&lock->space_changed, &lock->space_mutex);
+    pthread_mutex_unlock(&lock->space_mutex);
+}
+
+// See imgStore.h
+void
+imgst_space_exclusive_end (const struct imgst_file* imgst_file)
+{
+    if (imgst_file == NULL || imgst_file->lock == NULL) return;
+    struct imgst_lock* lock = imgst_file->lock;
+
+    pthread_mutex_lock(&lock->space_mutex);
+    lock->space_exclusive = 0;
+    pthread_cond_broadcast(&lock->space_changed);
+    pthread_mutex_unlock(&lock->space_mutex);
+}
+
+// See imgStore.h
+uint64_t
+imgst_changes (const struct imgst_file* imgst_file)
+{
+    return imgst_file != NULL && imgst_file->lock != NULL ? imgst_file->lock->changes : UINT64_MAX;
+}
+
+/********************************************************************//**
+ * Position of the image among the ones being resized, nb_resizes if absent.
+ */
+static size_t
+find_resize (const struct imgst_lock* lock, size_t index)
+{
+    size_t r = 0;
+    while (r < lock->nb_resizes && lock->resizes[r] != index) ++r;
+    return r;
+}
+
+// See imgStore.h
+void
+imgst_resize_begin (const struct imgst_file* imgst_file, size_t index)
+{
+    if (imgst_file == NULL || imgst_file->lock == NULL) return;
+    struct imgst_lock* lock = imgst_file->lock;
+
+    // Waits until no other thread resizes the image (nor too many images)
+    pthread_mutex_lock(&lock->resizes_mutex);
+    while (find_resize(lock, index) < lock->nb_resizes || lock->nb_resizes == MAX_RESIZES) {
+        pthread_cond_wait(&lock->resize_done, &lock->resizes_mutex);
+    }
+    lock->resizes[lock->nb_resizes++] = index;
+    pthread_mutex_unlock(&lock->resizes_mutex);
+}
+
+// See imgStore.h
+void
+imgst_resize_end (const struct imgst_file* imgst_file, size_t index)
+{
+    if (imgst_file == NULL || imgst_file->lock == NULL) return;
+    struct imgst_lock* lock = imgst_file->lock;
+
+    pthread_mutex_lock(&lock->resizes_mutex);
+    const size_t r = find_resize(lock, index);
+    if (r < lock->nb_resizes) lock->resizes[r] = lock->resizes[--lock->nb_resizes];
+    pthread_cond_broadcast(&lock->resize_done);
+    pthread_mutex_unlock(&lock->resizes_mutex);
+}